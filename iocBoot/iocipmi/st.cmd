@@ -9,6 +9,11 @@ dbLoadDatabase "${TOP}/dbd/ipmi.dbd"
 ipmi_registerRecordDeviceDriver pdbbase
 
 ipmiConnect IPMI1 192.168.1.252 "" "" "none" "lan" "operator"
+# Alternatively connect to many hosts concurrently, one per line:
+# <conn id>,<hostname>,[username],[password],[authtype],[protocol],[privlevel]
+#ipmiConnectFile "${TOP}/iocBoot/${IOC}/inventory.csv" 16
+# FRU inventory is read once and cached, optionally re-read it every hour
+#ipmiSetOption IPMI1 fru_ttl 3600
 
 ## Load record instances
 dbLoadRecords("${TOP}/db/test.db","IPMI=IPMI:")
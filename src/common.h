@@ -13,6 +13,7 @@
 #include <epicsGuard.h>
 #include <epicsMutex.h>
 
+#include <algorithm>
 #include <numeric>
 #include <string>
 #include <vector>
@@ -52,6 +53,60 @@ void copy(const std::string& str, char* buf, size_t bufSize);
 
 std::string to_upper(const std::string& s);
 
+/**
+ * @brief Pool of fixed size memory blocks, recycled within each thread.
+ *
+ * Released blocks are kept on a thread local free list and handed out again
+ * by the next allocation from the same thread. Record and FRU area buffers
+ * are allocated and released in tight loops, this keeps the heap out of it.
+ */
+template <typename T, size_t S>
+class BlockPool {
+    public:
+        static T* get()
+        {
+            auto& blocks = freeList().blocks;
+            if (blocks.empty())
+                return new T[S];
+            T* block = blocks.back();
+            blocks.pop_back();
+            return block;
+        }
+
+        static void put(T* block)
+        {
+            auto& blocks = freeList().blocks;
+            if (blocks.size() < maxFree)
+                blocks.push_back(block);
+            else
+                delete[] block;
+        }
+
+    private:
+        static const size_t maxFree = 64;    //!< Blocks above this limit are returned to heap
+
+        struct FreeList {
+            std::vector<T*> blocks;
+            ~FreeList()
+            {
+                for (auto block: blocks)
+                    delete[] block;
+            }
+        };
+
+        static FreeList& freeList()
+        {
+            static thread_local FreeList list;
+            return list;
+        }
+};
+
+/**
+ * @brief Owning buffer of up to max_size elements.
+ *
+ * Buffers with compile time size are allocated from BlockPool, others
+ * from heap. Memory is released when buffer goes out of scope.
+ */
 template <typename T, size_t S=0>
 struct buffer {
     T* data{nullptr};
@@ -61,15 +116,52 @@ struct buffer {
     buffer()
         : max_size(S)
     {
-        data = new T[S];
+        data = allocate(max_size);
     }
 
     buffer(size_t max_size_)
         : max_size(max_size_)
     {
         // new[] throws bad_alloc exception
-        data = new T[max_size];
+        data = allocate(max_size);
     }
+
+    buffer(const buffer& other)
+        : max_size(other.max_size)
+        , size(other.size)
+    {
+        data = allocate(max_size);
+        std::copy(other.data, other.data + size, data);
+    }
+
+    buffer(buffer&& other) noexcept
+        : data(other.data)
+        , max_size(other.max_size)
+        , size(other.size)
+    {
+        other.data = nullptr;
+        other.size = 0;
+    }
+
+    ~buffer()
+    {
+        if (data == nullptr)
+            return;
+        if (S > 0 && max_size == S)
+            BlockPool<T, S>::put(data);
+        else
+            delete[] data;
+    }
+
+    buffer& operator=(const buffer&) = delete;
+
+    private:
+        static T* allocate(size_t n)
+        {
+            if (S > 0 && n == S)
+                return BlockPool<T, S>::get();
+            return new T[n];
+        }
 };
 
 typedef epicsGuard<epicsMutex> ScopedLock;
@@ -13,18 +13,41 @@
 #include "print.h"
 #include "dispatcher.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cstring>
 #include <map>
+#include <memory>
 #include <string>
 
+#include <epicsEvent.h>
+#include <epicsThread.h>
+#include <epicsTime.h>
+
 // EPICS records that we support
 #include <aiRecord.h>
 #include <stringinRecord.h>
 
 namespace dispatcher {
 
-static std::map<std::string, std::shared_ptr<FreeIpmiProvider>> g_connections; //!< Global map of connections.
-static epicsMutex g_mutex; //!< Global mutex to protect g_connections.
+/**
+ * @brief Fixed size block of connection slots.
+ *
+ * Connections are only ever added. A slot is filled before connection
+ * count is published and never changes afterwards, so readers that look
+ * up connection by index need no locking or reference counting. Adding
+ * a connection doesn't copy existing ones.
+ */
+struct Chunk {
+    static const int SIZE = 64;
+    std::shared_ptr<FreeIpmiProvider> connections[SIZE];
+};
+
+static const int MAX_CHUNKS = 1024;
+static std::atomic<Chunk*> g_chunks[MAX_CHUNKS];                //!< Allocated as needed, never released
+static std::atomic<int> g_count{0};                             //!< Number of published connections
+static std::map<std::string, int> g_ids;                        //!< Maps connection id to connection index, protected by g_mutex
+static epicsMutex g_mutex; //!< Serializes adding connections and id lookups.
 
 static std::pair<std::string, std::string> _parseLink(const std::string& link)
 {
@@ -40,70 +63,191 @@ static std::string _createLink(const std::string& conn_id, const std::string& ad
     return "@ipmi " + conn_id + " " + addr;
 }
 
-static std::shared_ptr<FreeIpmiProvider> _getConnection(const std::string& conn_id)
+static int _findConnection(const std::string& conn_id)
 {
     common::ScopedLock lock(g_mutex);
-    auto it = g_connections.find(conn_id);
-    if (it != g_connections.end())
-        return it->second;
-    return nullptr;
+    auto it = g_ids.find(conn_id);
+    return (it != g_ids.end() ? it->second : -1);
 }
 
-bool connect(const std::string& conn_id, const std::string& hostname,
-             const std::string& username, const std::string& password,
-             const std::string& authtype, const std::string& protocol,
-             const std::string& privlevel)
+static std::shared_ptr<FreeIpmiProvider> _getConnection(const std::string& conn_id)
 {
-    common::ScopedLock lock(g_mutex);
+    // Id is only visible once its connection was published
+    auto conn = _findConnection(conn_id);
+    if (conn < 0)
+        return nullptr;
+    return g_chunks[conn / Chunk::SIZE].load(std::memory_order_acquire)->connections[conn % Chunk::SIZE];
+}
+
+static FreeIpmiProvider* _getConnection(int conn)
+{
+    if (conn < 0 || conn >= g_count.load(std::memory_order_acquire))
+        return nullptr;
+    return g_chunks[conn / Chunk::SIZE].load(std::memory_order_acquire)->connections[conn % Chunk::SIZE].get();
+}
 
-    if (g_connections.find(conn_id) != g_connections.end())
+static bool _connect(const ConnectParams& params, std::string& error)
+{
+    if (_getConnection(params.conn_id)) {
+        error = "connection " + params.conn_id + " already exists";
         return false;
+    }
 
+    // Establishing session takes a while, don't block other connections
     std::shared_ptr<FreeIpmiProvider> conn;
     try {
-        conn.reset(new FreeIpmiProvider(conn_id, hostname, username, password, authtype, protocol, privlevel));
+        conn.reset(new FreeIpmiProvider(params.conn_id, params.hostname, params.username, params.password,
+                                        params.authtype, params.protocol, params.privlevel));
     } catch (std::bad_alloc& e) {
-        LOG_ERROR("can't allocate FreeIPMI provider\n");
+        error = "can't allocate FreeIPMI provider";
         return false;
     } catch (std::runtime_error& e) {
-        if (username.empty())
-            LOG_ERROR("can't connect to %s - %s", hostname.c_str(), e.what());
+        if (params.username.empty())
+            error = "can't connect to " + params.hostname + " - " + e.what();
         else
-            LOG_ERROR("can't connect to %s as user %s - %s", hostname.c_str(), username.c_str(), e.what());
+            error = "can't connect to " + params.hostname + " as user " + params.username + " - " + e.what();
+        return false;
+    }
+
+    common::ScopedLock lock(g_mutex);
+
+    if (g_ids.find(params.conn_id) != g_ids.end()) {
+        error = "connection " + params.conn_id + " already exists";
         return false;
     }
 
-    g_connections[conn_id] = conn;
+    int index = g_count.load(std::memory_order_relaxed);
+    if (index >= MAX_CHUNKS * Chunk::SIZE) {
+        error = "too many connections";
+        return false;
+    }
+    auto chunk = g_chunks[index / Chunk::SIZE].load(std::memory_order_relaxed);
+    if (!chunk) {
+        chunk = new Chunk;
+        g_chunks[index / Chunk::SIZE].store(chunk, std::memory_order_release);
+    }
+    chunk->connections[index % Chunk::SIZE] = conn;
+    g_ids[params.conn_id] = index;
+
+    g_count.store(index + 1, std::memory_order_release);
     return true;
 }
 
-void scan(const std::string& conn_id, const std::vector<EntityType>& types)
+bool connect(const std::string& conn_id, const std::string& hostname,
+             const std::string& username, const std::string& password,
+             const std::string& authtype, const std::string& protocol,
+             const std::string& privlevel)
 {
-    g_mutex.lock();
-    auto it = g_connections.find(conn_id);
-    bool found = (it != g_connections.end());
-    g_mutex.unlock();
+    ConnectParams params{conn_id, hostname, username, password, authtype, protocol, privlevel};
+    std::string error;
+    if (!_connect(params, error)) {
+        LOG_ERROR(error);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Work shared by all threads establishing connections concurrently.
+ */
+struct ConnectWork {
+    const std::vector<ConnectParams>& connections;
+    std::vector<ConnectResult> results;
+    size_t next{0};             //!< Index of next connection to be established
+    unsigned running{0};        //!< Number of threads still running
+    epicsMutex mutex;
+    epicsEvent done;
+
+    ConnectWork(const std::vector<ConnectParams>& connections_)
+        : connections(connections_)
+        , results(connections_.size())
+    {}
+};
+
+extern "C" {
+    static void connectThread(void* ctx)
+    {
+        auto work = reinterpret_cast<ConnectWork*>(ctx);
 
-    if (!found) {
+        while (true) {
+            work->mutex.lock();
+            size_t i = work->next++;
+            work->mutex.unlock();
+            if (i >= work->connections.size())
+                break;
+
+            ConnectResult result;
+            auto start = epicsTime::getCurrent();
+            result.success = _connect(work->connections[i], result.error);
+            result.latency = epicsTime::getCurrent() - start;
+
+            work->mutex.lock();
+            work->results[i] = std::move(result);
+            work->mutex.unlock();
+        }
+
+        work->mutex.lock();
+        bool last = (--work->running == 0);
+        work->mutex.unlock();
+        if (last)
+            work->done.signal();
+    }
+};
+
+std::vector<ConnectResult> connect(const std::vector<ConnectParams>& connections, unsigned parallel)
+{
+    ConnectWork work(connections);
+    if (connections.empty())
+        return work.results;
+
+    unsigned nThreads = std::max(1U, std::min<unsigned>(parallel, connections.size()));
+
+    work.mutex.lock();
+    for (unsigned i = 0; i < nThreads; i++) {
+        auto name = "ipmiConnect" + std::to_string(i);
+        if (epicsThreadCreate(name.c_str(), epicsThreadPriorityMedium, epicsThreadGetStackSize(epicsThreadStackMedium),
+                              (EPICSTHREADFUNC)&connectThread, &work) != nullptr) {
+            work.running++;
+        }
+    }
+    bool started = (work.running > 0);
+    work.mutex.unlock();
+
+    if (!started) {
+        LOG_WARN("can't create connection threads, connecting serially");
+        work.running = 1;
+        connectThread(&work);
+    }
+
+    work.done.wait();
+    return work.results;
+}
+
+void scan(const std::string& conn_id, const std::vector<EntityType>& types, Provider::ScanMode mode)
+{
+    auto conn = _getConnection(conn_id);
+    if (!conn) {
         LOG_ERROR("no such connection " + conn_id);
         return;
     }
 
-    auto conn = it->second;
     for (auto& type: types) {
         try {
             std::vector<Provider::Entity> entities;
             std::string header;
             if (type == EntityType::SENSOR) {
-                entities = conn->getSensors();
+                entities = conn->getSensors(mode);
                 header = "Sensors:";
             } else if (type == EntityType::FRU) {
-                entities = conn->getFrus();
+                entities = conn->getFrus(mode);
                 header = "FRUs:";
             } else if (type == EntityType::PICMG_LED) {
-                entities = conn->getPicmgLeds();
+                entities = conn->getPicmgLeds(mode);
                 header = "PICMG LEDs:";
             }
+            // Records reading the same entities can use fresh values
+            if (mode == Provider::ScanMode::FULL)
+                conn->cacheEntities(entities);
             print::printScanReport(header, entities);
         } catch (std::runtime_error& e) {
             LOG_ERROR(e.what());
@@ -113,32 +257,33 @@ void scan(const std::string& conn_id, const std::vector<EntityType>& types)
 
 void printDb(const std::string& conn_id, const std::string& path, const std::string& pv_prefix)
 {
-    g_mutex.lock();
-    auto it = g_connections.find(conn_id);
-    bool found = (it != g_connections.end());
-    g_mutex.unlock();
-
-    if (!found) {
+    auto conn = _getConnection(conn_id);
+    if (!conn) {
         LOG_ERROR("no such connection " + conn_id);
         return;
     }
-    auto conn = it->second;
 
     FILE *dbfile = fopen(path.c_str(), "w+");
-    if (dbfile == nullptr)
+    if (dbfile == nullptr) {
         LOG_ERROR("Failed to open output database file - %s", strerror(errno));
+        return;
+    }
 
     try {
-        auto sensors = conn->getSensors();
+        auto sensors = conn->getSensors(Provider::ScanMode::METADATA);
         for (auto& sensor: sensors) {
             auto inp = sensor.getField<std::string>("INP", "");
+            auto out = sensor.getField<std::string>("OUT", "");
             if (!inp.empty()) {
                 sensor["INP"] = _createLink(conn_id, inp);
                 print::printRecord(dbfile, pv_prefix, sensor);
+            } else if (!out.empty()) {
+                sensor["OUT"] = _createLink(conn_id, out);
+                print::printRecord(dbfile, pv_prefix, sensor);
             }
         }
 
-        auto frus = conn->getFrus();
+        auto frus = conn->getFrus(Provider::ScanMode::METADATA);
         for (auto& fru: frus) {
             auto inp = fru.getField<std::string>("INP", "");
             if (!inp.empty()) {
@@ -147,7 +292,7 @@ void printDb(const std::string& conn_id, const std::string& path, const std::str
             }
         }
 
-        auto leds = conn->getPicmgLeds();
+        auto leds = conn->getPicmgLeds(Provider::ScanMode::METADATA);
         for (auto& led: leds) {
             auto inp = led.getField<std::string>("INP", "");
             if (!inp.empty()) {
@@ -156,27 +301,129 @@ void printDb(const std::string& conn_id, const std::string& path, const std::str
             }
         }
 
+    } catch (std::runtime_error& e) {
+        LOG_ERROR("Database file incomplete - %s", e.what());
     } catch (...) {
-        // TODO: do we need to log
+        LOG_ERROR("Database file incomplete - unhandled exception");
     }
 
     fclose(dbfile);
 }
 
+bool setOption(const std::string& conn_id, const std::string& name, const std::string& value)
+{
+    auto conn = _getConnection(conn_id);
+    if (!conn) {
+        LOG_ERROR("no such connection " + conn_id);
+        return false;
+    }
+
+    try {
+        conn->setOption(name, value);
+    } catch (std::runtime_error& e) {
+        LOG_ERROR(e.what());
+        return false;
+    }
+    return true;
+}
+
+bool invalidateCache(const std::string& conn_id)
+{
+    auto conn = _getConnection(conn_id);
+    if (!conn) {
+        LOG_ERROR("no such connection " + conn_id);
+        return false;
+    }
+
+    conn->invalidateCache();
+    return true;
+}
+
+std::map<std::string, double> getStats(const std::string& conn_id, bool reset)
+{
+    auto conn = _getConnection(conn_id);
+    if (!conn) {
+        LOG_ERROR("no such connection " + conn_id);
+        return std::map<std::string, double>();
+    }
+
+    auto stats = conn->getStats();
+    if (reset)
+        conn->resetStats();
+    return stats;
+}
+
 bool checkLink(const std::string& address)
 {
-    auto conn = _getConnection( _parseLink(address).first );
-    return (!!conn);
+    return (parseLink(address).conn >= 0);
 }
 
-bool scheduleGet(const std::string& address, const std::function<void()>& cb, Provider::Entity& entity)
+Link parseLink(const std::string& address)
 {
     auto addr = _parseLink(address);
-    auto conn = _getConnection(addr.first);
+
+    Link link;
+    link.conn = _findConnection(addr.first);
+    link.address = std::move(addr.second);
+
+    // Per record poll period is not part of entity address
+    static const std::string pollToken = " POLL=";
+    auto pos = link.address.rfind(pollToken);
+    if (pos != std::string::npos) {
+        try {
+            link.pollPeriod = std::stod(link.address.substr(pos + pollToken.size()));
+        } catch (...) {
+            link.pollPeriod = -1.0;
+        }
+        if (link.pollPeriod <= 0.0) {
+            LOG_ERROR("Invalid poll period in link '%s'", address.c_str());
+            link.conn = -1;
+        }
+        link.address.erase(pos);
+    }
+    return link;
+}
+
+bool getCached(const Link& link, Provider::Entity& entity)
+{
+    auto conn = _getConnection(link.conn);
     if (!conn)
         return false;
 
-    return conn->schedule( Provider::Task(std::move(addr.second), cb, entity) );
+    return conn->getCached(link.address, entity);
+}
+
+bool scheduleGet(const Link& link, const std::function<void()>& cb, Provider::Entity& entity)
+{
+    auto conn = _getConnection(link.conn);
+    if (!conn)
+        return false;
+
+    return conn->schedule( Provider::Task(link.address, cb, entity) );
+}
+
+bool scheduleSet(const Link& link, const std::function<void()>& cb, Provider::Entity& entity, const Provider::Variant& value)
+{
+    auto conn = _getConnection(link.conn);
+    if (!conn)
+        return false;
+
+    return conn->schedule( Provider::Task(link.address, cb, entity, value) );
+}
+
+bool subscribe(const Link& link, const std::function<void()>& cb)
+{
+    auto conn = _getConnection(link.conn);
+    if (!conn)
+        return false;
+
+    try {
+        conn->subscribe(link.address, cb, link.pollPeriod);
+    } catch (std::runtime_error& e) {
+        LOG_ERROR(e.what());
+        return false;
+    }
+    return true;
 }
 
 }; // namespace dispatcher
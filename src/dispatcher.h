@@ -11,6 +11,7 @@
 #pragma once
 
 #include <functional>
+#include <map>
 #include <provider.h>
 #include <vector>
 
@@ -30,6 +31,18 @@ enum class AuthType {
     NONE,
 };
 
+/**
+ * @brief Record link parsed and resolved at record initialization time.
+ *
+ * Connection id string is resolved to a small integer index into connection
+ * registry once, so that processing records doesn't need any string lookups.
+ */
+struct Link {
+    int conn{-1};           //!< Connection index, -1 when connection doesn't exist
+    std::string address;    //!< Provider specific entity address
+    double pollPeriod{0.0}; //!< Seconds between change notifications from optional trailing POLL=<seconds>, 0 uses poll_period_<kind> option
+};
+
 /**
  * @brief Establishes connection with IPMI sub-system.
  * @param connection_id unique connection id
@@ -48,21 +61,80 @@ bool connect(const std::string& connection_id, const std::string& hostname,
              const std::string& authtype, const std::string& protocol,
              const std::string& privlevel);
 
+/**
+ * @brief Parameters for establishing single connection, see connect() for details.
+ */
+struct ConnectParams {
+    std::string conn_id;
+    std::string hostname;
+    std::string username;
+    std::string password;
+    std::string authtype;
+    std::string protocol;
+    std::string privlevel;
+};
+
+/**
+ * @brief Outcome of establishing single connection.
+ */
+struct ConnectResult {
+    bool success{false};
+    double latency{0.0};    //!< Time spent establishing connection in seconds
+    std::string error;      //!< Reason for failure, empty on success
+};
+
+/**
+ * @brief Establishes many connections concurrently.
+ * @param connections list of connections to establish
+ * @param parallel maximum number of connections being established at the same time
+ * @return results in the same order as connections
+ *
+ * Returns when all connections were either established or failed.
+ */
+std::vector<ConnectResult> connect(const std::vector<ConnectParams>& connections, unsigned parallel);
+
 /**
  * @brief Scans for IPMI entity types and prints them to console.
  * @param connection_id
  * @param types valid options are 'sensors', 'fru'
+ * @param mode METADATA skips reading current values
  */
-void scan(const std::string& connection_id, const std::vector<EntityType>& types);
+void scan(const std::string& connection_id, const std::vector<EntityType>& types, Provider::ScanMode mode=Provider::ScanMode::FULL);
 
 /**
  * @brief Scans for IPMI entity types and prints corresponding EPICS records to file.
+ *
+ * Records are generated from metadata only, values are not read.
  * @param connection_id
  * @param filename Full path to filename to be saved
  * @param pv_prefix Prefix to be prepended to record names
  */
 void printDb(const std::string& connection_id, const std::string& path, const std::string& pv_prefix);
 
+/**
+ * @brief Set connection specific option.
+ * @param connection_id
+ * @param name of the option, supported options depend on connection type
+ * @param value new value for the option
+ * @return true when option was set
+ */
+bool setOption(const std::string& connection_id, const std::string& name, const std::string& value);
+
+/**
+ * @brief Drop data cached by connection, like FRU inventory.
+ * @param connection_id
+ * @return true when connection exists
+ */
+bool invalidateCache(const std::string& connection_id);
+
+/**
+ * @brief Get connection processing statistics.
+ * @param connection_id
+ * @param reset start collecting anew once retrieved
+ * @return statistics by name, empty when there's no such connection
+ */
+std::map<std::string, double> getStats(const std::string& connection_id, bool reset=false);
+
 /**
  * @brief Verify that record link is indeed valid IPMI address
  * @param address to be checked
@@ -70,6 +142,13 @@ void printDb(const std::string& connection_id, const std::string& path, const st
  */
 bool checkLink(const std::string& address);
 
+/**
+ * @brief Parse record link and resolve connection to its index.
+ * @param address record link to be parsed
+ * @return parsed link, Link::conn is -1 when link is invalid or there's no such connection
+ */
+Link parseLink(const std::string& address);
+
 /**
  * @brief Finds existing IPMI sub-system and schedules asynchronous processing.
  * @param rec to process
@@ -85,6 +164,41 @@ bool checkLink(const std::string& address);
 template<typename T>
 bool process(T* rec);
 
-bool scheduleGet(const std::string& address, const std::function<void()>& cb, Provider::Entity& entity);
+/**
+ * @brief Update entity from connection value cache, without scheduling a task.
+ * @param link previously parsed with parseLink()
+ * @param entity to be updated
+ * @return true when connection found and cached value is fresh
+ */
+bool getCached(const Link& link, Provider::Entity& entity);
+
+/**
+ * @brief Schedule asynchronous retrieval of IPMI entity.
+ * @param link previously parsed with parseLink()
+ * @param cb function to be called when entity is updated
+ * @param entity to be updated
+ * @return true when connection found and task scheduled, false otherwise
+ *
+ * Connection lookup is wait-free and can be called from any thread.
+ */
+bool scheduleGet(const Link& link, const std::function<void()>& cb, Provider::Entity& entity);
+
+/**
+ * @brief Schedule asynchronous write to IPMI entity.
+ * @param link previously parsed with parseLink()
+ * @param cb function to be called when value was written
+ * @param entity to be updated with the value read back
+ * @param value to be written
+ * @return true when connection found and task scheduled, false otherwise
+ */
+bool scheduleSet(const Link& link, const std::function<void()>& cb, Provider::Entity& entity, const Provider::Variant& value);
+
+/**
+ * @brief Register function to be called when IPMI entity changes.
+ * @param link previously parsed with parseLink()
+ * @param cb function to be called from connection thread, must not block
+ * @return true when connection found and entity supports change notifications
+ */
+bool subscribe(const Link& link, const std::function<void()>& cb);
 
 }; // namespace
@@ -10,15 +10,30 @@
 
 #include <aiRecord.h>
 #include <alarm.h>
+#include <aoRecord.h>
+#include <biRecord.h>
+#include <boRecord.h>
 #include <callback.h>
 #include <cantProceed.h>
+#include <dbDefs.h>
+#include <dbScan.h>
 #include <devSup.h>
+#include <epicsTime.h>
 #include <epicsExport.h>
+#include <longinRecord.h>
+#include <longoutRecord.h>
+#include <mbbiDirectRecord.h>
 #include <mbbiRecord.h>
+#include <mbboRecord.h>
+#include <menuFtype.h>
 #include <recGbl.h>
 #include <stringinRecord.h>
+#include <waveformRecord.h>
 
+#include <algorithm>
+#include <cmath>
 #include <limits>
+#include <type_traits>
 
 #include "common.h"
 #include "dispatcher.h"
@@ -26,126 +41,344 @@
 struct IpmiRecord {
     CALLBACK callback;
     Provider::Entity entity;
+    dispatcher::Link link;
+    IOSCANPVT ioscan{nullptr};
+    bool subscribed{false};
 };
 
 template<typename T>
-long initInpRecord(T* rec)
+inline void copyDesc(T* rec, const Provider::Entity& entity)
 {
-    if (dispatcher::checkLink(rec->inp.value.instio.string) == false) {
-        if (rec->tpro == 1) {
-            LOG_ERROR("invalid record link or no connection");
-        }
-        rec->dpvt = nullptr;
-        return -1;
-    }
-    void* buffer = callocMustSucceed(1, sizeof(IpmiRecord), "ipmi::initGeneric");
-    rec->dpvt = new (buffer) IpmiRecord;
-    return 0;
+    if (rec->desc[0] == 0)
+        common::copy(entity.getField<std::string>("DESC", ""), rec->desc, sizeof(rec->desc));
 }
 
-static long processAiRecord(aiRecord* rec)
+template<typename T>
+inline void copyEgu(T* rec, const Provider::Entity& entity)
 {
-    IpmiRecord* ctx = reinterpret_cast<IpmiRecord*>(rec->dpvt);
-    if (ctx == nullptr) {
-        // Keep PACT=1 to prevent further processing
-        rec->pact = 1;
-        recGblSetSevr(rec, epicsAlarmUDF, epicsSevInvalid);
-        return -1;
+    if (rec->egu[0] == 0)
+        common::copy(entity.getField<std::string>("EGU", ""), rec->egu, sizeof(rec->egu));
+}
+
+/**
+ * @brief Per record type hooks used by the generic processing functions.
+ *
+ * Input records implement update() to move entity value into record,
+ * output records implement value() to get the value to be written and
+ * update() to take what was read back. Status constants are what record
+ * support expects from device support, ie. 2 to skip raw value conversion.
+ */
+template<typename T>
+struct RecordTraits;
+
+template<>
+struct RecordTraits<aiRecord> {
+    static constexpr long initStatus = 0;
+    static constexpr long processStatus = 2; //!< VAL is already converted
+    static inline void update(aiRecord* rec, const Provider::Entity& entity)
+    {
+        rec->val = entity.getNumber("VAL", rec->val);
+        rec->rval = rec->val;
+        // Skipped conversion is what normally clears UDF
+        rec->udf = std::isnan(rec->val);
+        copyEgu(rec, entity);
+        copyDesc(rec, entity);
     }
+};
 
-    if (rec->pact == 0) {
-        rec->pact = 1;
+template<>
+struct RecordTraits<longinRecord> {
+    static constexpr long initStatus = 0;
+    static constexpr long processStatus = 0;
+    static inline void update(longinRecord* rec, const Provider::Entity& entity)
+    {
+        rec->val = entity.getNumber("VAL", rec->val);
+        copyEgu(rec, entity);
+        copyDesc(rec, entity);
+    }
+};
 
-        std::function<void()> cb = std::bind(callbackRequestProcessCallback, &ctx->callback, rec->prio, rec);
-        if (dispatcher::scheduleGet(rec->inp.value.instio.string, cb, ctx->entity) == false) {
-            // Keep PACT=1 to prevent further processing
-            recGblSetSevr(rec, epicsAlarmUDF, epicsSevInvalid);
-            return -1;
+template<>
+struct RecordTraits<stringinRecord> {
+    static constexpr long initStatus = 0;
+    static constexpr long processStatus = 0;
+    static inline void update(stringinRecord* rec, const Provider::Entity& entity)
+    {
+        common::copy(entity.getField<std::string>("VAL", rec->val), rec->val, sizeof(rec->val));
+        copyDesc(rec, entity);
+    }
+};
+
+template<>
+struct RecordTraits<mbbiRecord> {
+    static constexpr long initStatus = 0;
+    static constexpr long processStatus = 0; //!< Convert RVAL to VAL
+    static inline void update(mbbiRecord* rec, const Provider::Entity& entity)
+    {
+        rec->rval = entity.getField<int>("VAL", 0);
+        copyDesc(rec, entity);
+    }
+};
+
+template<>
+struct RecordTraits<mbbiDirectRecord> {
+    static constexpr long initStatus = 0;
+    static constexpr long processStatus = 0; //!< Convert RVAL to VAL
+    static inline void update(mbbiDirectRecord* rec, const Provider::Entity& entity)
+    {
+        rec->rval = entity.getField<int>("VAL", 0);
+        if (rec->mask)
+            rec->rval &= rec->mask;
+        copyDesc(rec, entity);
+    }
+};
+
+template<>
+struct RecordTraits<biRecord> {
+    static constexpr long initStatus = 0;
+    static constexpr long processStatus = 0; //!< Convert RVAL to VAL
+    static inline void update(biRecord* rec, const Provider::Entity& entity)
+    {
+        rec->rval = entity.getField<int>("VAL", 0);
+        if (rec->mask)
+            rec->rval &= rec->mask;
+        copyDesc(rec, entity);
+    }
+};
+
+template<>
+struct RecordTraits<waveformRecord> {
+    static constexpr long initStatus = 0;
+    static constexpr long processStatus = 0;
+    static inline void update(waveformRecord* rec, const Provider::Entity& entity)
+    {
+        auto it = entity.find("VAL");
+        if (it == entity.end())
+            return;
+        if (rec->ftvl == menuFtypeDOUBLE) {
+            auto values = std::get_if<std::vector<double>>(&it->second);
+            if (values) {
+                size_t n = std::min<size_t>(values->size(), rec->nelm);
+                std::copy(values->begin(), values->begin() + n, reinterpret_cast<double*>(rec->bptr));
+                rec->nord = n;
+            }
+        } else {
+            auto values = std::get_if<std::vector<std::string>>(&it->second);
+            if (values) {
+                size_t n = std::min<size_t>(values->size(), rec->nelm);
+                auto buffer = reinterpret_cast<char*>(rec->bptr);
+                for (size_t i = 0; i < n; i++)
+                    common::copy((*values)[i], buffer + i * MAX_STRING_SIZE, MAX_STRING_SIZE);
+                rec->nord = n;
+            }
         }
+    }
+};
 
-        return 0;
+template<>
+struct RecordTraits<aoRecord> {
+    static constexpr long initStatus = 2;    //!< Keep VAL from database
+    static constexpr long processStatus = 0;
+    static inline Provider::Variant value(aoRecord* rec)
+    {
+        return rec->oval;
     }
+    static inline void update(aoRecord* rec, const Provider::Entity& entity)
+    {
+        rec->rbv = entity.getNumber("VAL", rec->rbv);
+        copyEgu(rec, entity);
+        copyDesc(rec, entity);
+    }
+};
 
-    // This is the second pass, we got new value now update the record
-    rec->pact = 0;
+template<>
+struct RecordTraits<longoutRecord> {
+    static constexpr long initStatus = 0;
+    static constexpr long processStatus = 0;
+    static inline Provider::Variant value(longoutRecord* rec)
+    {
+        return (int)rec->val;
+    }
+    static inline void update(longoutRecord* rec, const Provider::Entity& entity)
+    {
+        copyEgu(rec, entity);
+        copyDesc(rec, entity);
+    }
+};
 
-    rec->val = ctx->entity.getField<double>("VAL", rec->val);
-    rec->rval = rec->val;
+template<>
+struct RecordTraits<mbboRecord> {
+    static constexpr long initStatus = 2;    //!< Keep VAL from database
+    static constexpr long processStatus = 0;
+    static inline Provider::Variant value(mbboRecord* rec)
+    {
+        return (int)rec->rval;
+    }
+    static inline void update(mbboRecord* rec, const Provider::Entity& entity)
+    {
+        rec->rbv = entity.getField<int>("VAL", rec->rbv);
+        copyDesc(rec, entity);
+    }
+};
 
-    auto sevr = ctx->entity.getField<int>("SEVR", epicsSevNone);
-    auto stat = ctx->entity.getField<int>("STAT", epicsAlarmNone);
-    (void)recGblSetSevr(rec, stat, sevr);
+template<>
+struct RecordTraits<boRecord> {
+    static constexpr long initStatus = 2;    //!< Keep VAL from database
+    static constexpr long processStatus = 0;
+    static inline Provider::Variant value(boRecord* rec)
+    {
+        return (int)rec->rval;
+    }
+    static inline void update(boRecord* rec, const Provider::Entity& entity)
+    {
+        rec->rbv = entity.getField<int>("VAL", rec->rbv);
+        copyDesc(rec, entity);
+    }
+};
 
-    if (rec->egu[0] == 0)
-        common::copy(ctx->entity.getField<std::string>("EGU", ""), rec->egu, sizeof(rec->egu));
-    if (rec->desc[0] == 0)
-        common::copy(ctx->entity.getField<std::string>("DESC", ""), rec->desc, sizeof(rec->desc));
+template<typename T>
+long initRecord(T* rec, const char* address)
+{
+    auto link = dispatcher::parseLink(address);
+    if (link.conn < 0) {
+        if (rec->tpro == 1) {
+            LOG_ERROR("invalid record link or no connection");
+        }
+        rec->dpvt = nullptr;
+        return -1;
+    }
+    void* buffer = callocMustSucceed(1, sizeof(IpmiRecord), "ipmi::initGeneric");
+    IpmiRecord* ctx = new (buffer) IpmiRecord;
+    ctx->link = std::move(link);
+    rec->dpvt = ctx;
+    return RecordTraits<T>::initStatus;
+}
 
-    return 0;
+template<typename T>
+long initInpRecord(T* rec)
+{
+    return initRecord(rec, rec->inp.value.instio.string);
 }
 
-static long processStringinRecord(stringinRecord* rec)
+template<typename T>
+long initOutRecord(T* rec)
 {
-    IpmiRecord* ctx = reinterpret_cast<IpmiRecord*>(rec->dpvt);
+    return initRecord(rec, rec->out.value.instio.string);
+}
 
-    if (rec->pact == 0) {
-        rec->pact = 1;
+static long initWaveformRecord(waveformRecord* rec)
+{
+    // Sensor values and severities are delivered as doubles, names as strings
+    if (rec->ftvl != menuFtypeDOUBLE && rec->ftvl != menuFtypeSTRING) {
+        LOG_ERROR("%s: FTVL must be DOUBLE or STRING", rec->name);
+        rec->dpvt = nullptr;
+        return -1;
+    }
+    return initInpRecord(rec);
+}
 
-        std::function<void()> cb = std::bind(callbackRequestProcessCallback, &ctx->callback, rec->prio, rec);
-        if (dispatcher::scheduleGet(rec->inp.value.instio.string, cb, ctx->entity) == false) {
-            // Keep PACT=1 to prevent further processing
-            recGblSetSevr(rec, epicsAlarmUDF, epicsSevInvalid);
-            return -1;
-        }
+template<typename T>
+long getIointInfo(int /*cmd*/, T* rec, IOSCANPVT* io)
+{
+    IpmiRecord* ctx = reinterpret_cast<IpmiRecord*>(rec->dpvt);
+    if (ctx == nullptr)
+        return -1;
 
-        return 0;
+    // Provider only notifies about changes, record reads the value as usual
+    if (!ctx->subscribed) {
+        if (!ctx->ioscan)
+            scanIoInit(&ctx->ioscan);
+        IOSCANPVT ioscan = ctx->ioscan;
+        if (dispatcher::subscribe(ctx->link, [ioscan]() { scanIoRequest(ioscan); }) == false)
+            return -1;
+        ctx->subscribed = true;
     }
 
-    // This is the second pass, we got new value now update the record
-    rec->pact = 0;
+    *io = ctx->ioscan;
+    return 0;
+}
 
-    common::copy(ctx->entity.getField<std::string>("VAL", rec->val), rec->val, sizeof(rec->val));
+template<typename T>
+inline bool getCached(T* /*rec*/, IpmiRecord* ctx, std::false_type /*write*/)
+{
+    return dispatcher::getCached(ctx->link, ctx->entity);
+}
 
-    auto sevr = ctx->entity.getField<int>("SEVR", epicsSevNone);
-    auto stat = ctx->entity.getField<int>("STAT", epicsAlarmNone);
-    (void)recGblSetSevr(rec, stat, sevr);
+template<typename T>
+inline bool getCached(T* /*rec*/, IpmiRecord* /*ctx*/, std::true_type /*write*/)
+{
+    return false;
+}
 
-    if (rec->desc[0] == 0)
-        common::copy(ctx->entity.getField<std::string>("DESC", ""), rec->desc, sizeof(rec->desc));
+template<typename T>
+inline bool scheduleTask(T* /*rec*/, IpmiRecord* ctx, const std::function<void()>& cb, std::false_type /*write*/)
+{
+    return dispatcher::scheduleGet(ctx->link, cb, ctx->entity);
+}
 
-    return 0;
+template<typename T>
+inline bool scheduleTask(T* rec, IpmiRecord* ctx, const std::function<void()>& cb, std::true_type /*write*/)
+{
+    // Only what was read back after this write is relevant
+    ctx->entity.clear();
+    return dispatcher::scheduleSet(ctx->link, cb, ctx->entity, RecordTraits<T>::value(rec));
 }
 
-static long processMbbiRecord(mbbiRecord* rec)
+/**
+ * @brief Two pass processing, first pass schedules the task and second one completes the record.
+ *
+ * Reads with a fresh value in provider cache complete in the first pass.
+ */
+template<typename T, bool Write>
+long processRecord(T* rec)
 {
     IpmiRecord* ctx = reinterpret_cast<IpmiRecord*>(rec->dpvt);
+    if (ctx == nullptr) {
+        // Keep PACT=1 to prevent further processing
+        rec->pact = 1;
+        recGblSetSevr(rec, epicsAlarmUDF, epicsSevInvalid);
+        return -1;
+    }
 
-    if (rec->pact == 0) {
+    if (rec->pact == 0 && !getCached(rec, ctx, std::integral_constant<bool, Write>())) {
         rec->pact = 1;
 
         std::function<void()> cb = std::bind(callbackRequestProcessCallback, &ctx->callback, rec->prio, rec);
-        if (dispatcher::scheduleGet(rec->inp.value.instio.string, cb, ctx->entity) == false) {
+        if (scheduleTask(rec, ctx, cb, std::integral_constant<bool, Write>()) == false) {
             // Keep PACT=1 to prevent further processing
-            recGblSetSevr(rec, epicsAlarmUDF, epicsSevInvalid);
+            recGblSetSevr(rec, (Write ? epicsAlarmWrite : epicsAlarmUDF), epicsSevInvalid);
             return -1;
         }
 
         return 0;
     }
 
-    // This is the second pass, we got new value now update the record
+    // This is the second pass or value was cached, we got new value now update the record
     rec->pact = 0;
 
-    rec->rval  = ctx->entity.getField<int>("VAL", 0);
+    RecordTraits<T>::update(rec, ctx->entity);
+
+    // Record support leaves time alone, it's for device support to set
+    if (rec->tse == epicsTimeEventDeviceTime && ctx->entity.time.secPastEpoch != 0)
+        rec->time = ctx->entity.time;
 
     auto sevr = ctx->entity.getField<int>("SEVR", epicsSevNone);
     auto stat = ctx->entity.getField<int>("STAT", epicsAlarmNone);
     (void)recGblSetSevr(rec, stat, sevr);
 
-    if (rec->desc[0] == 0)
-        common::copy(ctx->entity.getField<std::string>("DESC", ""), rec->desc, sizeof(rec->desc));
+    return RecordTraits<T>::processStatus;
+}
 
-    return 0;
+template<typename T>
+long processInpRecord(T* rec)
+{
+    return processRecord<T, false>(rec);
+}
+
+template<typename T>
+long processOutRecord(T* rec)
+{
+    return processRecord<T, true>(rec);
 }
 
 extern "C" {
@@ -163,12 +396,65 @@ struct {
    NULL,                                // report
    NULL,                                // once-per-IOC initialization
    (DEVSUPFUN)initInpRecord<aiRecord>,  // once-per-record initialization
-   NULL,                                // get_ioint_info
-   (DEVSUPFUN)processAiRecord,
+   (DEVSUPFUN)getIointInfo<aiRecord>,   // get_ioint_info
+   (DEVSUPFUN)processInpRecord<aiRecord>,
    NULL                                 // special_linconv
 };
 epicsExportAddress(dset, devEpicsIpmiAi);
 
+struct {
+   long            number;
+   DEVSUPFUN       report;
+   DEVSUPFUN       init;
+   DEVSUPFUN       init_record;
+   DEVSUPFUN       get_ioint_info;
+   DEVSUPFUN       write_ao;
+   DEVSUPFUN       special_linconv;
+} devEpicsIpmiAo = {
+   6, // number
+   NULL,                                // report
+   NULL,                                // once-per-IOC initialization
+   (DEVSUPFUN)initOutRecord<aoRecord>,  // once-per-record initialization
+   NULL,                                // get_ioint_info
+   (DEVSUPFUN)processOutRecord<aoRecord>,
+   NULL                                 // special_linconv
+};
+epicsExportAddress(dset, devEpicsIpmiAo);
+
+struct {
+   long            number;
+   DEVSUPFUN       report;
+   DEVSUPFUN       init;
+   DEVSUPFUN       init_record;
+   DEVSUPFUN       get_ioint_info;
+   DEVSUPFUN       read_longin;
+} devEpicsIpmiLongin = {
+   5, // number
+   NULL,                                    // report
+   NULL,                                    // once-per-IOC initialization
+   (DEVSUPFUN)initInpRecord<longinRecord>,  // once-per-record initialization
+   (DEVSUPFUN)getIointInfo<longinRecord>,   // get_ioint_info
+   (DEVSUPFUN)processInpRecord<longinRecord>
+};
+epicsExportAddress(dset, devEpicsIpmiLongin);
+
+struct {
+   long            number;
+   DEVSUPFUN       report;
+   DEVSUPFUN       init;
+   DEVSUPFUN       init_record;
+   DEVSUPFUN       get_ioint_info;
+   DEVSUPFUN       write_longout;
+} devEpicsIpmiLongout = {
+   5, // number
+   NULL,                                    // report
+   NULL,                                    // once-per-IOC initialization
+   (DEVSUPFUN)initOutRecord<longoutRecord>, // once-per-record initialization
+   NULL,                                    // get_ioint_info
+   (DEVSUPFUN)processOutRecord<longoutRecord>
+};
+epicsExportAddress(dset, devEpicsIpmiLongout);
+
 struct {
    long            number;
    DEVSUPFUN       report;
@@ -182,8 +468,8 @@ struct {
    NULL, // report
    NULL, // init
    (DEVSUPFUN)initInpRecord<stringinRecord>,
-   NULL, // get_ioint_info
-   (DEVSUPFUN)processStringinRecord,
+   (DEVSUPFUN)getIointInfo<stringinRecord>, // get_ioint_info
+   (DEVSUPFUN)processInpRecord<stringinRecord>,
    NULL  // special_linconv
 };
 epicsExportAddress(dset, devEpicsIpmiStringin);
@@ -201,10 +487,97 @@ struct {
    NULL,                                  // report
    NULL,                                  // once-per-IOC initialization
    (DEVSUPFUN)initInpRecord<mbbiRecord>,  // once-per-record initialization
-   NULL,                                  // get_ioint_info
-   (DEVSUPFUN)processMbbiRecord,
+   (DEVSUPFUN)getIointInfo<mbbiRecord>,   // get_ioint_info
+   (DEVSUPFUN)processInpRecord<mbbiRecord>,
    NULL                                   // special_linconv
 };
 epicsExportAddress(dset, devEpicsIpmiMbbi);
 
+struct {
+   long            number;
+   DEVSUPFUN       report;
+   DEVSUPFUN       init;
+   DEVSUPFUN       init_record;
+   DEVSUPFUN       get_ioint_info;
+   DEVSUPFUN       write_mbbo;
+} devEpicsIpmiMbbo = {
+   5, // number
+   NULL,                                  // report
+   NULL,                                  // once-per-IOC initialization
+   (DEVSUPFUN)initOutRecord<mbboRecord>,  // once-per-record initialization
+   NULL,                                  // get_ioint_info
+   (DEVSUPFUN)processOutRecord<mbboRecord>
+};
+epicsExportAddress(dset, devEpicsIpmiMbbo);
+
+struct {
+   long            number;
+   DEVSUPFUN       report;
+   DEVSUPFUN       init;
+   DEVSUPFUN       init_record;
+   DEVSUPFUN       get_ioint_info;
+   DEVSUPFUN       read_mbbi;
+   DEVSUPFUN       special_linconv;
+} devEpicsIpmiMbbiDirect = {
+   6, // number
+   NULL,                                        // report
+   NULL,                                        // once-per-IOC initialization
+   (DEVSUPFUN)initInpRecord<mbbiDirectRecord>,  // once-per-record initialization
+   (DEVSUPFUN)getIointInfo<mbbiDirectRecord>,   // get_ioint_info
+   (DEVSUPFUN)processInpRecord<mbbiDirectRecord>,
+   NULL                                         // special_linconv
+};
+epicsExportAddress(dset, devEpicsIpmiMbbiDirect);
+
+struct {
+   long            number;
+   DEVSUPFUN       report;
+   DEVSUPFUN       init;
+   DEVSUPFUN       init_record;
+   DEVSUPFUN       get_ioint_info;
+   DEVSUPFUN       read_bi;
+} devEpicsIpmiBi = {
+   5, // number
+   NULL,                                // report
+   NULL,                                // once-per-IOC initialization
+   (DEVSUPFUN)initInpRecord<biRecord>,  // once-per-record initialization
+   (DEVSUPFUN)getIointInfo<biRecord>,   // get_ioint_info
+   (DEVSUPFUN)processInpRecord<biRecord>
+};
+epicsExportAddress(dset, devEpicsIpmiBi);
+
+struct {
+   long            number;
+   DEVSUPFUN       report;
+   DEVSUPFUN       init;
+   DEVSUPFUN       init_record;
+   DEVSUPFUN       get_ioint_info;
+   DEVSUPFUN       write_bo;
+} devEpicsIpmiBo = {
+   5, // number
+   NULL,                                // report
+   NULL,                                // once-per-IOC initialization
+   (DEVSUPFUN)initOutRecord<boRecord>,  // once-per-record initialization
+   NULL,                                // get_ioint_info
+   (DEVSUPFUN)processOutRecord<boRecord>
+};
+epicsExportAddress(dset, devEpicsIpmiBo);
+
+struct {
+   long            number;
+   DEVSUPFUN       report;
+   DEVSUPFUN       init;
+   DEVSUPFUN       init_record;
+   DEVSUPFUN       get_ioint_info;
+   DEVSUPFUN       read_wf;
+} devEpicsIpmiWaveform = {
+   5, // number
+   NULL,                                    // report
+   NULL,                                    // once-per-IOC initialization
+   (DEVSUPFUN)initWaveformRecord,           // once-per-record initialization
+   (DEVSUPFUN)getIointInfo<waveformRecord>, // get_ioint_info
+   (DEVSUPFUN)processInpRecord<waveformRecord>
+};
+epicsExportAddress(dset, devEpicsIpmiWaveform);
+
 }; // extern "C"
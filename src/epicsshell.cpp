@@ -11,11 +11,34 @@
 #include "common.h"
 #include "dispatcher.h"
 
+#include <fstream>
 #include <map>
+#include <sstream>
 
 #include <epicsExport.h>
+#include <epicsTime.h>
 #include <iocsh.h>
 
+static const std::vector<std::string> authTypes  = { "none", "plain", "md2", "md5" };
+static const std::vector<std::string> protocols  = { "lan_2.0", "lan" };
+static const std::vector<std::string> privLevels = { "user", "operator", "admin" };
+
+/**
+ * @brief Select one of the valid options or default one when value not specified.
+ * @return false when value is not one of the options
+ */
+static bool selectOption(const char* value, const std::vector<std::string>& options, const std::string& what, std::string& selected)
+{
+    if (value && *value) {
+        if (!common::contains(options, value)) {
+            printf("ERROR: Invalid %s '%s', choose from '%s'\n", what.c_str(), value, common::merge(options, "','").c_str());
+            return false;
+        }
+        selected = value;
+    }
+    return true;
+}
+
 // ipmiConnect(conn_id, host_name, [username], [password], [protocol], [privlevel])
 static const iocshArg ipmiConnectArg0 = { "connection id",  iocshArgString };
 static const iocshArg ipmiConnectArg1 = { "host name",      iocshArgString };
@@ -46,36 +69,121 @@ extern "C" void ipmiConnectCallFunc(const iocshArgBuf* args) {
     std::string username = (args[2].sval ? args[2].sval : "");
     std::string password = (args[3].sval ? args[3].sval : "");
 
-    static std::vector<std::string> authTypes = { "none", "plain", "md2", "md5" };
     std::string authType = "none";
-    if (args[4].sval && common::contains(authTypes, args[4].sval)) {
-        authType = args[4].sval;
-    } else if (args[4].sval) {
-        printf("ERROR: Invalid auth type '%s', choose from '%s'\n", args[4].sval, common::merge(authTypes, "',").c_str());
+    if (!selectOption(args[4].sval, authTypes, "auth type", authType))
         return;
-    }
 
-    static std::vector<std::string> protocols = { "lan_2.0", "lan" };
     std::string protocol = "lan";
-    if (args[5].sval && common::contains(protocols, args[5].sval)) {
-        protocol = args[5].sval;
-    } else if (args[5].sval) {
-        printf("ERROR: Invalid protocol '%s', choose from '%s'\n", args[5].sval, common::merge(protocols, "','").c_str());
+    if (!selectOption(args[5].sval, protocols, "protocol", protocol))
         return;
-    }
 
-    static std::vector<std::string> privLevels = { "user", "operator", "admin" };
     std::string privLevel = "operator";
-    if (args[6].sval && common::contains(privLevels, args[6].sval)) {
-        privLevel = args[6].sval;
-    } else if (args[6].sval) {
-        printf("ERROR: Invalid privilege level '%s', choose from '%s\n", args[6].sval, common::merge(privLevels, "','").c_str());
+    if (!selectOption(args[6].sval, privLevels, "privilege level", privLevel))
         return;
-    }
 
     dispatcher::connect(conn_id, hostname, username, password, authType, protocol, privLevel);
 }
 
+// ipmiConnectFile(inventory_file, [parallel])
+static const iocshArg ipmiConnectFileArg0 = { "inventory file", iocshArgString };
+static const iocshArg ipmiConnectFileArg1 = { "parallel",       iocshArgInt };
+static const iocshArg* ipmiConnectFileArgs[] = {
+    &ipmiConnectFileArg0,
+    &ipmiConnectFileArg1,
+};
+static const iocshFuncDef ipmiConnectFileFuncDef = { "ipmiConnectFile", 2, ipmiConnectFileArgs };
+
+static std::string trim(const std::string& s)
+{
+    auto start = s.find_first_not_of(" \t\r\n");
+    if (start == std::string::npos)
+        return "";
+    auto end = s.find_last_not_of(" \t\r\n");
+    return s.substr(start, end - start + 1);
+}
+
+/*
+ * Inventory file is in CSV format, one connection per line:
+ * <conn id>,<hostname>,[username],[password],[authtype],[protocol],[privlevel]
+ * Empty lines and lines starting with '#' are ignored, empty optional
+ * fields select the same defaults as ipmiConnect.
+ */
+static bool parseInventory(const std::string& path, std::vector<dispatcher::ConnectParams>& connections)
+{
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        printf("ERROR: Can't open inventory file '%s'\n", path.c_str());
+        return false;
+    }
+
+    std::string line;
+    unsigned lineNum = 0;
+    while (std::getline(file, line)) {
+        lineNum++;
+        line = trim(line);
+        if (line.empty() || line[0] == '#')
+            continue;
+
+        // common::split() merges consecutive delimiters, but empty fields are valid here
+        std::vector<std::string> fields;
+        std::istringstream ss(line);
+        std::string field;
+        while (std::getline(ss, field, ','))
+            fields.push_back(trim(field));
+        fields.resize(7);
+
+        dispatcher::ConnectParams params;
+        params.conn_id   = fields[0];
+        params.hostname  = fields[1];
+        params.username  = fields[2];
+        params.password  = fields[3];
+        params.authtype  = "none";
+        params.protocol  = "lan";
+        params.privlevel = "operator";
+        if (params.conn_id.empty() || params.hostname.empty()) {
+            printf("ERROR: %s:%u: missing connection id or hostname\n", path.c_str(), lineNum);
+            return false;
+        }
+        if (!selectOption(fields[4].c_str(), authTypes,  "auth type",       params.authtype) ||
+            !selectOption(fields[5].c_str(), protocols,  "protocol",        params.protocol) ||
+            !selectOption(fields[6].c_str(), privLevels, "privilege level", params.privlevel)) {
+            printf("ERROR: %s:%u: invalid connection parameters\n", path.c_str(), lineNum);
+            return false;
+        }
+        connections.emplace_back(std::move(params));
+    }
+    return true;
+}
+
+extern "C" void ipmiConnectFileCallFunc(const iocshArgBuf* args) {
+    if (!args[0].sval) {
+        printf("Usage: ipmiConnectFile <inventory file> [parallel]\n");
+        return;
+    }
+
+    std::vector<dispatcher::ConnectParams> connections;
+    if (!parseInventory(args[0].sval, connections))
+        return;
+
+    unsigned parallel = (args[1].ival > 0 ? args[1].ival : 16);
+
+    auto start = epicsTime::getCurrent();
+    auto results = dispatcher::connect(connections, parallel);
+    double elapsed = epicsTime::getCurrent() - start;
+
+    unsigned succeeded = 0;
+    printf("%-16s %-24s %-7s %9s\n", "Connection", "Host", "Status", "Latency");
+    for (size_t i = 0; i < results.size(); i++) {
+        auto& conn = connections[i];
+        auto& result = results[i];
+        printf("%-16s %-24s %-7s %8.3fs %s\n", conn.conn_id.c_str(), conn.hostname.c_str(),
+               (result.success ? "OK" : "FAILED"), result.latency, result.error.c_str());
+        if (result.success)
+            succeeded++;
+    }
+    printf("Connected %u of %zu hosts in %.3fs\n", succeeded, results.size(), elapsed);
+}
+
 // ipmiScan(conn_id, [types])
 static const iocshArg ipmiScanArg0 = { "connection id",     iocshArgString };
 static const iocshArg ipmiScanArg1 = { "type",              iocshArgString };
@@ -95,10 +203,20 @@ static const iocshFuncDef ipmiScanFuncDef = { "ipmiScan", 6, ipmiScanArgs };
 
 extern "C" void ipmiScanCallFunc(const iocshArgBuf* args) {
     if (!args[0].sval) {
-        printf("Usage: ipmiScan <conn id> [types]\n");
+        printf("Usage: ipmiScan <conn id> [types] [metadata]\n");
         return;
     }
 
+    // Optional 'metadata' keyword anywhere after connection id skips reading values
+    auto mode = Provider::ScanMode::FULL;
+    std::vector<const char*> typeArgs;
+    for (int i = 1; i <= 5; i++) {
+        if (args[i].sval && std::string(args[i].sval) == "metadata")
+            mode = Provider::ScanMode::METADATA;
+        else if (args[i].sval)
+            typeArgs.push_back(args[i].sval);
+    }
+
     std::map<std::string, dispatcher::EntityType> validTypes = {
         { "sensor",         dispatcher::EntityType::SENSOR },
         { "fru",            dispatcher::EntityType::FRU },
@@ -106,31 +224,29 @@ extern "C" void ipmiScanCallFunc(const iocshArgBuf* args) {
     };
 
     std::vector<dispatcher::EntityType> types;
-    if (!args[1].sval) {
+    if (typeArgs.empty()) {
         for (auto& it: validTypes) {
             types.push_back(it.second);
         }
     } else {
         // Check user selection
-        for (int i = 1; i <= 5; i++) {
-            if (args[i].sval) {
-                bool found = false;
-                for (auto& it: validTypes) {
-                    if (it.first == args[i].sval) {
-                        types.push_back(it.second);
-                        found = true;
-                        break;
-                    }
+        for (auto& arg: typeArgs) {
+            bool found = false;
+            for (auto& it: validTypes) {
+                if (it.first == arg) {
+                    types.push_back(it.second);
+                    found = true;
+                    break;
                 }
-                if (!found)
-                    printf("ERROR: Unknown entity type '%s'", args[i].sval);
             }
+            if (!found)
+                printf("ERROR: Unknown entity type '%s'", arg);
         }
         if (types.empty())
             return;
     }
 
-    dispatcher::scan(args[0].sval, types);
+    dispatcher::scan(args[0].sval, types, mode);
 }
 
 // ipmiDumpDb(conn_id, db_file)
@@ -153,14 +269,87 @@ extern "C" void ipmiDumpDbCallFunc(const iocshArgBuf* args) {
     dispatcher::printDb(args[0].sval, args[1].sval, args[2].sval ? args[2].sval : "");
 }
 
+// ipmiSetOption(conn_id, name, value)
+static const iocshArg ipmiSetOptionArg0 = { "connection id",     iocshArgString };
+static const iocshArg ipmiSetOptionArg1 = { "option name",       iocshArgString };
+static const iocshArg ipmiSetOptionArg2 = { "option value",      iocshArgString };
+static const iocshArg* ipmiSetOptionArgs[] = {
+    &ipmiSetOptionArg0,
+    &ipmiSetOptionArg1,
+    &ipmiSetOptionArg2,
+};
+static const iocshFuncDef ipmiSetOptionFuncDef = { "ipmiSetOption", 3, ipmiSetOptionArgs };
+
+extern "C" void ipmiSetOptionCallFunc(const iocshArgBuf* args) {
+    if (!args[0].sval || !args[1].sval || !args[2].sval) {
+        printf("Usage: ipmiSetOption <conn id> <name> <value>\n");
+        printf("Options:\n");
+        printf("  fru_ttl             Seconds before cached FRU inventory is read again, 0 means never (default 0),\n");
+        printf("                      corrupted inventories are read again after at most 30 seconds\n");
+        printf("  discovery_sessions  Max concurrent sessions for FRU and LED discovery (default 4)\n");
+        printf("  hotswap_period      Seconds between checks for inserted or removed modules, 0 disables (default 5)\n");
+        printf("  led_period          Seconds between polls of LEDs in I/O Intr records, 0 disables (default 5)\n");
+        printf("  write_delay         Seconds writes wait to be merged with other writes to the same sensor (default 0.01)\n");
+        printf("  control_interval    Minimum seconds between control commands to the same FRU (default 1)\n");
+        printf("  cache_ttl_<kind>    Seconds values are answered from cache, kind is sensor, fru or picmg_led (default 0)\n");
+        printf("  poll_period_<kind>  Seconds between I/O Intr scans of sensor or fru records, spread over the period (default 0),\n");
+        printf("                      records override it with POLL=<seconds> at the end of link\n");
+        printf("  poll_max_period_<kind> Longest seconds between scans, period adapts to value changes when longer than poll_period (default 0)\n");
+        return;
+    }
+
+    dispatcher::setOption(args[0].sval, args[1].sval, args[2].sval);
+}
+
+// ipmiFlushCache(conn_id)
+static const iocshArg ipmiFlushCacheArg0 = { "connection id",     iocshArgString };
+static const iocshArg* ipmiFlushCacheArgs[] = {
+    &ipmiFlushCacheArg0,
+};
+static const iocshFuncDef ipmiFlushCacheFuncDef = { "ipmiFlushCache", 1, ipmiFlushCacheArgs };
+
+extern "C" void ipmiFlushCacheCallFunc(const iocshArgBuf* args) {
+    if (!args[0].sval) {
+        printf("Usage: ipmiFlushCache <conn id>\n");
+        return;
+    }
+
+    dispatcher::invalidateCache(args[0].sval);
+}
+
+// ipmiStats(conn_id, reset)
+static const iocshArg ipmiStatsArg0 = { "connection id",     iocshArgString };
+static const iocshArg ipmiStatsArg1 = { "reset",             iocshArgInt };
+static const iocshArg* ipmiStatsArgs[] = {
+    &ipmiStatsArg0,
+    &ipmiStatsArg1,
+};
+static const iocshFuncDef ipmiStatsFuncDef = { "ipmiStats", 2, ipmiStatsArgs };
+
+extern "C" void ipmiStatsCallFunc(const iocshArgBuf* args) {
+    if (!args[0].sval) {
+        printf("Usage: ipmiStats <conn id> [reset]\n");
+        printf("Queue delays are in seconds, non-zero reset clears statistics after printing\n");
+        return;
+    }
+
+    auto stats = dispatcher::getStats(args[0].sval, args[1].ival != 0);
+    for (auto& stat: stats)
+        printf("  %-20s %g\n", stat.first.c_str(), stat.second);
+}
+
 static void epicsipmiRegistrar ()
 {
     static bool initialized  = false;
     if (!initialized) {
         initialized = false;
         iocshRegister(&ipmiConnectFuncDef, ipmiConnectCallFunc);
+        iocshRegister(&ipmiConnectFileFuncDef, ipmiConnectFileCallFunc);
         iocshRegister(&ipmiScanFuncDef,    ipmiScanCallFunc);
         iocshRegister(&ipmiDumpDbFuncDef,  ipmiDumpDbCallFunc);
+        iocshRegister(&ipmiSetOptionFuncDef, ipmiSetOptionCallFunc);
+        iocshRegister(&ipmiFlushCacheFuncDef, ipmiFlushCacheCallFunc);
+        iocshRegister(&ipmiStatsFuncDef, ipmiStatsCallFunc);
     }
 }
 
@@ -10,6 +10,20 @@
 
 #include "freeipmiprovider.h"
 
+#include <alarm.h> // from EPICS
+#include <epicsThread.h>
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+
+extern "C" {
+    static void discoveryThread(void* ctx)
+    {
+        (*reinterpret_cast<std::function<void()>*>(ctx))();
+    }
+};
+
 FreeIpmiProvider::FreeIpmiProvider(const std::string& conn_id, const std::string& hostname,
                                    const std::string& username, const std::string& password,
                                    const std::string& authtype, const std::string& protocol,
@@ -43,13 +57,18 @@ FreeIpmiProvider::FreeIpmiProvider(const std::string& conn_id, const std::string
 
     // TODO: parametrize
     m_sdrCachePath = "/tmp/ipmi_sdr_" + conn_id + ".cache";
+    m_fruCachePath = "/tmp/ipmi_fru_" + conn_id;
 
     // TODO: automatic connection management
     connect();
+
+    // Only start checking for hot-swap events once fully connected
+    updateHousekeepingPeriod();
 }
 
 FreeIpmiProvider::~FreeIpmiProvider()
 {
+    // Housekeeping must not run on partially destroyed object, wait for it
     if (stopThread() == false)
         LOG_WARN("Processing thread did not stop");
 
@@ -63,48 +82,59 @@ FreeIpmiProvider::~FreeIpmiProvider()
     if (m_ctx.sensors) {
         ipmi_sensor_read_ctx_destroy(m_ctx.sensors);
     }
-    if (m_ctx.fru) {
-        ipmi_fru_ctx_destroy(m_ctx.fru);
-    }
 }
 
-void FreeIpmiProvider::connect()
+ipmi_ctx_t FreeIpmiProvider::openSession() const
 {
     const char* username_ = (m_username.empty() ? nullptr : m_username.c_str());
     const char* password_ = (m_password.empty() ? nullptr : m_password.c_str());
 
+    ipmi_ctx_t ipmi = ipmi_ctx_create();
+    if (!ipmi)
+        throw std::runtime_error("can't create IPMI context");
+
+    int connected;
+    if (m_protocol == "lan_2.0") {
+        connected = ipmi_ctx_open_outofband_2_0(
+                        ipmi, m_hostname.c_str(), username_, password_,
+                        m_k_g, m_k_g_len, m_privLevel, m_cipherSuiteId,
+                        m_sessionTimeout, m_retransmissionTimeout, m_workaroundFlags, m_flags);
+    } else {
+        connected = ipmi_ctx_open_outofband(
+                        ipmi, m_hostname.c_str(), username_, password_,
+                        m_authType, m_privLevel,
+                        m_sessionTimeout, m_retransmissionTimeout, m_workaroundFlags, m_flags);
+    }
+    if (connected < 0) {
+        std::string error = ipmi_ctx_errormsg(ipmi);
+        ipmi_ctx_destroy(ipmi);
+        throw std::runtime_error("can't connect - " + error);
+    }
+
+    return ipmi;
+}
+
+void FreeIpmiProvider::connect()
+{
     if (m_ctx.sdr) {
         ipmi_sdr_ctx_destroy(m_ctx.sdr);
+        m_ctx.sdr = nullptr;
     }
 
     if (m_ctx.ipmi) {
         ipmi_ctx_close(m_ctx.ipmi);
         ipmi_ctx_destroy(m_ctx.ipmi);
+        m_ctx.ipmi = nullptr;
     }
-    m_ctx.ipmi = ipmi_ctx_create();
-    if (!m_ctx.ipmi)
-        throw std::runtime_error("can't create IPMI context");
 
     m_ctx.sdr = ipmi_sdr_ctx_create();
     if (!m_ctx.sdr)
         throw std::runtime_error("can't create IPMI SDR context");
 
-    int connected;
-    if (m_protocol == "lan_2.0") {
-        connected = ipmi_ctx_open_outofband_2_0(
-                        m_ctx.ipmi, m_hostname.c_str(), username_, password_,
-                        m_k_g, m_k_g_len, m_privLevel, m_cipherSuiteId,
-                        m_sessionTimeout, m_retransmissionTimeout, m_workaroundFlags, m_flags);
-    } else {
-        connected = ipmi_ctx_open_outofband(
-                        m_ctx.ipmi, m_hostname.c_str(), username_, password_,
-                        m_authType, m_privLevel,
-                        m_sessionTimeout, m_retransmissionTimeout, m_workaroundFlags, m_flags);
-    }
-    if (connected < 0)
-        throw std::runtime_error("can't connect - " + std::string(ipmi_ctx_errormsg(m_ctx.ipmi)));
+    m_ctx.ipmi = openSession();
 
-    openSdrCache();
+    openSdrCache(m_ctx.sdr);
+    buildSdrCatalog(m_ctx.sdr, m_sdrCatalog);
 
     if (m_ctx.sensors)
         ipmi_sensor_read_ctx_destroy(m_ctx.sensors);
@@ -112,12 +142,6 @@ void FreeIpmiProvider::connect()
     if (!m_ctx.sensors)
         throw std::runtime_error("can't create IPMI sensor context");
 
-    if (m_ctx.fru)
-        ipmi_fru_ctx_destroy(m_ctx.fru);
-    m_ctx.fru = ipmi_fru_ctx_create(m_ctx.ipmi);
-    if (!m_ctx.fru)
-        throw std::runtime_error("can't create IPMI FRU context");
-
     int sensorReadFlags = 0;
     sensorReadFlags |= IPMI_SENSOR_READ_FLAGS_BRIDGE_SENSORS;
     /* Don't error out, if this fails we can still continue */
@@ -125,41 +149,158 @@ void FreeIpmiProvider::connect()
         LOG_WARN("can't set sensor read flags - %s", ipmi_sensor_read_ctx_errormsg(m_ctx.sensors));
 
     m_connected = true;
+
+    // Topology survives reconnects as long as SDR doesn't change,
+    // session timing out while building it leaves us disconnected
+    if (m_topology.fingerprint != m_sdrCatalog.fingerprint) {
+        buildTopology(m_ctx.ipmi);
+        resolvePendingLeds();
+    }
 }
 
-void FreeIpmiProvider::openSdrCache()
+/*
+ * Most of the discovery time is spent waiting for bridged responses from
+ * IPMB controllers. Each worker opens its own session and picks the next
+ * unprocessed IPMB target, calling thread works on the main session.
+ */
+void FreeIpmiProvider::discover(ipmi_ctx_t ipmi, const SdrCatalog& catalog, const std::vector<size_t>& frus,
+                                const std::string& what, const std::function<void(ipmi_ctx_t, size_t)>& job)
 {
-    if (ipmi_sdr_cache_open(m_ctx.sdr, m_ctx.ipmi, m_sdrCachePath.c_str()) < 0) {
-        switch (ipmi_sdr_ctx_errnum(m_ctx.sdr)) {
+    // Group FRUs by IPMB target, requests to the same controller are not worth parallelizing
+    std::vector<std::vector<size_t>> groups;
+    std::map<std::pair<uint8_t,uint8_t>, size_t> targets;
+    for (auto i: frus) {
+        auto target = std::make_pair(catalog.frus[i].address.deviceAddr, catalog.frus[i].address.channel);
+        auto it = targets.find(target);
+        if (it == targets.end()) {
+            it = targets.emplace(target, groups.size()).first;
+            groups.emplace_back();
+        }
+        groups[it->second].push_back(i);
+    }
+    if (groups.empty())
+        return;
+
+    struct {
+        size_t next{0};         //!< Index of next group to be processed
+        unsigned running{0};    //!< Number of worker threads still running
+        double busy{0.0};       //!< Sum of time spent on individual groups
+        epicsMutex mutex;
+        epicsEvent done;
+    } work;
+
+    auto processGroups = [&](ipmi_ctx_t ipmi_) {
+        while (true) {
+            work.mutex.lock();
+            size_t group = work.next++;
+            work.mutex.unlock();
+            if (group >= groups.size())
+                break;
+
+            auto start = epicsTime::getCurrent();
+            for (auto i: groups[group])
+                job(ipmi_, i);
+            double elapsed = epicsTime::getCurrent() - start;
+
+            work.mutex.lock();
+            work.busy += elapsed;
+            work.mutex.unlock();
+        }
+    };
+
+    std::function<void()> worker = [&]() {
+        ipmi_ctx_t ipmi_ = nullptr;
+        try {
+            ipmi_ = openSession();
+            processGroups(ipmi_);
+        } catch (std::runtime_error& e) {
+            LOG_DEBUG("discovery session failed - %s", e.what());
+        }
+        if (ipmi_) {
+            ipmi_ctx_close(ipmi_);
+            ipmi_ctx_destroy(ipmi_);
+        }
+
+        work.mutex.lock();
+        bool last = (--work.running == 0);
+        work.mutex.unlock();
+        if (last)
+            work.done.signal();
+    };
+
+    auto start = epicsTime::getCurrent();
+
+    unsigned nWorkers = std::min<size_t>(m_discoverySessions, groups.size()) - 1;
+    work.mutex.lock();
+    for (unsigned i = 0; i < nWorkers; i++) {
+        auto name = "ipmiDiscover" + std::to_string(i);
+        if (epicsThreadCreate(name.c_str(), epicsThreadPriorityLow, epicsThreadGetStackSize(epicsThreadStackBig),
+                              (EPICSTHREADFUNC)&discoveryThread, &worker) != nullptr) {
+            work.running++;
+        }
+    }
+    bool started = (work.running > 0);
+    unsigned sessions = work.running + 1;
+    work.mutex.unlock();
+
+    processGroups(ipmi);
+    if (started)
+        work.done.wait();
+
+    // Speedup is an estimate, serial discovery is assumed to take as long as
+    // the summed time of all groups, it's not measured. Rescans happen often,
+    // keep it out of the IOC log by default.
+    double elapsed = epicsTime::getCurrent() - start;
+    LOG_DEBUG("%s discovery of %zu FRU devices on %zu IPMB targets took %.3fs using %u sessions, %.1fx estimated speedup over serial",
+             what.c_str(), frus.size(), groups.size(), elapsed, sessions, (elapsed > 0.0 ? work.busy / elapsed : 1.0));
+}
+
+bool FreeIpmiProvider::openSdrCache(ipmi_sdr_ctx_t sdr)
+{
+    bool created = false;
+    if (ipmi_sdr_cache_open(sdr, m_ctx.ipmi, m_sdrCachePath.c_str()) < 0) {
+        switch (ipmi_sdr_ctx_errnum(sdr)) {
         case IPMI_SDR_ERR_CACHE_OUT_OF_DATE:
         case IPMI_SDR_ERR_CACHE_INVALID:
             LOG_INFO("deleting out of date or invalid SDR cache file " + m_sdrCachePath);
-            (void)ipmi_sdr_cache_delete(m_ctx.sdr, m_sdrCachePath.c_str());
+            (void)ipmi_sdr_cache_delete(sdr, m_sdrCachePath.c_str());
             // fall thru
         case IPMI_SDR_ERR_CACHE_READ_CACHE_DOES_NOT_EXIST:
             LOG_INFO("creating new SDR cache file " + m_sdrCachePath);
-            (void)ipmi_sdr_cache_create(m_ctx.sdr, m_ctx.ipmi, m_sdrCachePath.c_str(), IPMI_SDR_CACHE_CREATE_FLAGS_DEFAULT, nullptr, nullptr);
+            (void)ipmi_sdr_cache_create(sdr, m_ctx.ipmi, m_sdrCachePath.c_str(), IPMI_SDR_CACHE_CREATE_FLAGS_DEFAULT, nullptr, nullptr);
             break;
         default:
             throw std::runtime_error("can't open SDR cache - " + std::string(ipmi_ctx_errormsg(m_ctx.ipmi)));
         }
 
-        if (ipmi_sdr_cache_open(m_ctx.sdr, m_ctx.ipmi, m_sdrCachePath.c_str()) < 0)
+        if (ipmi_sdr_cache_open(sdr, m_ctx.ipmi, m_sdrCachePath.c_str()) < 0)
             throw std::runtime_error("can't open SDR cache - " + std::string(ipmi_ctx_errormsg(m_ctx.ipmi)));
+        created = true;
     }
+    return created;
 }
 
-std::vector<FreeIpmiProvider::Entity> FreeIpmiProvider::getSensors()
+std::vector<FreeIpmiProvider::Entity> FreeIpmiProvider::getSensors(ScanMode mode)
 {
     common::ScopedLock lock(m_apiMutex);
     if (!m_connected)
         connect();
-    return getSensors(m_ctx.sdr, m_ctx.sensors);
+    auto entities = getSensors(m_ctx.ipmi, m_ctx.sdr, m_ctx.sensors, m_sdrCatalog, mode);
+    // Scan skips entities that failed, dead session shows in the last command
+    disconnectOnTimeout(m_ctx.ipmi);
+    return entities;
 }
 
-FreeIpmiProvider::Entity FreeIpmiProvider::getEntity(const std::string& address)
+bool FreeIpmiProvider::disconnectOnTimeout(ipmi_ctx_t ipmi)
+{
+    if (ipmi != m_ctx.ipmi || ipmi_ctx_errnum(ipmi) != IPMI_ERR_SESSION_TIMEOUT)
+        return false;
+    m_connected = false;
+    return true;
+}
+
+void FreeIpmiProvider::reconnectIfDue()
 {
-    common::ScopedLock lock(m_apiMutex);
     if (!m_connected) {
         if ((epicsTime::getCurrent() - m_nextReconnect) < 1.0)
             throw std::runtime_error("Not connected");
@@ -167,7 +308,10 @@ FreeIpmiProvider::Entity FreeIpmiProvider::getEntity(const std::string& address)
         m_nextReconnect = epicsTime::getCurrent() + 1.0;
         connect();
     }
+}
 
+FreeIpmiProvider::Entity FreeIpmiProvider::getEntity(const std::string& address)
+{
     // First token in address is the entity type, like 'SENSOR', 'FRU' etc.
     // Rest is type specific
     auto tokens = common::split(address, ' ', 1);
@@ -177,47 +321,428 @@ FreeIpmiProvider::Entity FreeIpmiProvider::getEntity(const std::string& address)
     auto type = std::move(tokens.at(0));
     auto rest = std::move(tokens.at(1));
 
-    if (type == "SENSOR") {
-        return getSensor(m_ctx.sdr, m_ctx.sensors, SensorAddress(rest));
-    } else if (type == "FRU") {
-        return getFru(m_ctx.ipmi, m_ctx.sdr, m_ctx.fru, FruAddress(rest));
-    } else if (type == "PICMG_LED") {
-        return getPicmgLed(m_ctx.ipmi, PicmgLedAddress(rest));
-    } else {
+    // Sensor sets take API lock for one sensor at a time
+    if (type == "SENSORS")
+        return getSensorSet(address, rest);
+
+    common::ScopedLock lock(m_apiMutex);
+    reconnectIfDue();
+
+    try {
+        if (type == "SENSOR") {
+            SensorAddress sensorAddr(rest);
+            if (sensorAddr.getThreshold() >= 0)
+                return readSensorThreshold(sensorAddr);
+            return selectSensorField(readSensor(sensorAddr), sensorAddr.field);
+        } else if (type == "FRU") {
+            FruAddress fruAddr(rest);
+            resolveTarget(fruAddr.site, fruAddr.route, fruAddr.deviceAddr, fruAddr.channel, fruAddr.fruId);
+            checkPresent(fruAddr.deviceAddr, fruAddr.channel, fruAddr.fruId);
+            return getFru(m_ctx.ipmi, m_sdrCatalog, fruAddr);
+        } else if (type == "PICMG_LED") {
+            PicmgLedAddress ledAddr(rest);
+            resolveTarget(ledAddr.site, ledAddr.route, ledAddr.deviceAddr, ledAddr.channel, ledAddr.fruId);
+            checkPresent(ledAddr.deviceAddr, ledAddr.channel, ledAddr.fruId);
+            return getPicmgLed(m_ctx.ipmi, ledAddr);
+        }
+    } catch (Provider::comm_error&) {
+        disconnectOnTimeout(m_ctx.ipmi);
+        throw;
+    }
+    throw Provider::syntax_error("Invalid address '" + address + "'");
+}
+
+std::string FreeIpmiProvider::getGroup(const std::string& address)
+{
+    auto tokens = common::split(address, ' ', 1);
+    if (tokens.size() != 2 || tokens[0] != "SENSOR")
+        return "";
+
+    common::ScopedLock lock(m_apiMutex);
+    try {
+        SensorAddress sensorAddr(tokens[1]);
+        resolveSensor(sensorAddr);
+
+        auto it = m_sdrCatalog.sensorIndex.find(sensorAddr.get());
+        if (it == m_sdrCatalog.sensorIndex.end())
+            return "";
+
+        auto& sensor = m_sdrCatalog.sensors[it->second];
+        return sensor.address.route.get() + std::to_string(sensor.address.ownerId) + ":" + std::to_string(sensor.address.channel) +
+               " " + std::to_string(sensor.entityId) + "." + std::to_string(sensor.entityInstance);
+    } catch (std::runtime_error&) {
+        // Error is reported when entity is read
+        return "";
+    }
+}
+
+std::vector<FreeIpmiProvider::Entity> FreeIpmiProvider::getEntities(const std::vector<std::string>& addresses)
+{
+    common::ScopedLock lock(m_apiMutex);
+    epicsTimeStamp snapshot = epicsTime::getCurrent();
+
+    std::vector<Entity> entities(addresses.size());
+    std::map<std::string, Entity> sensors;  // Sensors read so far, records of different fields share them
+    std::string failed;
+    for (size_t i = 0; i < addresses.size(); i++) {
+        collectEntity(entities[i], [&]() -> Entity {
+            if (!failed.empty())
+                throw Provider::comm_error(failed);
+
+            auto tokens = common::split(addresses[i], ' ', 1);
+            if (tokens.size() != 2 || tokens[0] != "SENSOR")
+                return getEntity(addresses[i]);
+
+            SensorAddress sensorAddr(tokens[1]);
+            if (sensorAddr.getThreshold() >= 0)
+                return getEntity(addresses[i]);
+            resolveSensor(sensorAddr);
+            auto it = sensors.find(sensorAddr.get());
+            if (it == sensors.end()) {
+                // Only transport failure dooms the rest of the group, sensor
+                // that is busy or can't provide reading fails on its own
+                try {
+                    it = sensors.emplace(sensorAddr.get(), readSensor(sensorAddr)).first;
+                } catch (Provider::comm_error& e) {
+                    disconnectOnTimeout(m_ctx.ipmi);
+                    failed = e.what();
+                    throw;
+                }
+            }
+            return selectSensorField(it->second, sensorAddr.field);
+        });
+        entities[i].time = snapshot;
+    }
+    return entities;
+}
+
+std::vector<FreeIpmiProvider::Entity> FreeIpmiProvider::setEntities(const std::vector<std::string>& addresses, const std::vector<Variant>& values)
+{
+    common::ScopedLock lock(m_apiMutex);
+
+    // Threshold writes are collected per sensor, the latest value of each threshold wins
+    std::vector<std::pair<SensorAddress, std::map<int,double>>> sensors;
+    std::map<std::string, size_t> sensorIndex;
+    std::vector<std::pair<int, std::string>> slots(addresses.size(), std::make_pair(-1, std::string()));
+
+    std::vector<Entity> entities(addresses.size());
+    for (size_t i = 0; i < addresses.size(); i++) {
+        collectEntity(entities[i], [&]() -> Entity {
+            if (!m_connected)
+                throw Provider::comm_error("Not connected");
+
+            auto tokens = common::split(addresses[i], ' ', 1);
+            if (tokens.size() != 2 || tokens[0] != "SENSOR")
+                return setEntity(addresses[i], values[i]);
+
+            SensorAddress sensorAddr(tokens[1]);
+            int threshold = sensorAddr.getThreshold();
+            if (threshold < 0)
+                throw Provider::syntax_error("Writing not supported for '" + addresses[i] + "'");
+
+            auto number = std::get_if<double>(&values[i]);
+            auto integer = std::get_if<int>(&values[i]);
+            if (!number && !integer)
+                throw Provider::syntax_error("Invalid value for '" + addresses[i] + "'");
+
+            resolveSensor(sensorAddr);
+            auto it = sensorIndex.emplace(sensorAddr.get(), sensors.size());
+            if (it.second)
+                sensors.emplace_back(sensorAddr, std::map<int,double>());
+            sensors[it.first->second].second[threshold] = (number ? *number : *integer);
+            slots[i] = std::make_pair(it.first->second, sensorAddr.field);
+            return Entity();
+        });
+    }
+
+    for (size_t j = 0; j < sensors.size(); j++) {
+        Entity readback;
+        collectEntity(readback, [&]() {
+            try {
+                return writeSensorThresholds(sensors[j].first, sensors[j].second);
+            } catch (Provider::comm_error&) {
+                disconnectOnTimeout(m_ctx.ipmi);
+                throw;
+            }
+        });
+
+        for (size_t i = 0; i < addresses.size(); i++) {
+            if (slots[i].first != (int)j)
+                continue;
+
+            auto& entity = entities[i];
+            auto it = readback.find(slots[i].second);
+            if (readback.find("SEVR") != readback.end()) {
+                entity["SEVR"] = readback["SEVR"];
+                entity["STAT"] = readback["STAT"];
+            } else if (it == readback.end()) {
+                entity["SEVR"] = (int)epicsSevInvalid;
+                entity["STAT"] = (int)epicsAlarmWrite;
+            } else {
+                entity["VAL"] = it->second;
+            }
+            if (readback.find("EGU") != readback.end())
+                entity["EGU"] = readback["EGU"];
+        }
+    }
+    return entities;
+}
+
+FreeIpmiProvider::Entity FreeIpmiProvider::setEntity(const std::string& address, const Variant& value)
+{
+    common::ScopedLock lock(m_apiMutex);
+    if (!m_connected)
+        throw Provider::comm_error("Not connected");
+
+    auto tokens = common::split(address, ' ', 1);
+    if (tokens.size() != 2)
         throw Provider::syntax_error("Invalid address '" + address + "'");
+
+    auto type = std::move(tokens.at(0));
+    auto rest = std::move(tokens.at(1));
+
+    if (type == "SENSOR")
+        return setEntities({ address }, { value }).at(0);
+
+    auto control = std::get_if<int>(&value);
+    if (!control)
+        throw Provider::syntax_error("Invalid value for '" + address + "'");
+
+    // Only commands that took effect count towards the rate limit
+    try {
+        if (type == "CHASSIS") {
+            if (rest != "CONTROL")
+                throw Provider::syntax_error("Invalid address '" + address + "'");
+            FruTarget target(IPMI_SLAVE_ADDRESS_BMC, 0, 0);
+            checkControlRate(target, address);
+            auto entity = setChassisControl(m_ctx.ipmi, *control);
+            m_controlTimes[target] = epicsTime::getCurrent();
+            return entity;
+        } else if (type == "PICMG_FRU") {
+            PicmgFruAddress fruAddr(rest);
+            resolveTarget(fruAddr.site, fruAddr.route, fruAddr.deviceAddr, fruAddr.channel, fruAddr.fruId);
+            checkPresent(fruAddr.deviceAddr, fruAddr.channel, fruAddr.fruId);
+            FruTarget target(fruAddr.deviceAddr, fruAddr.channel, fruAddr.fruId);
+            checkControlRate(target, address);
+            auto entity = setPicmgFruActivation(m_ctx.ipmi, fruAddr, *control);
+            m_controlTimes[target] = epicsTime::getCurrent();
+            return entity;
+        } else if (type == "PICMG_LED") {
+            PicmgLedAddress ledAddr(rest);
+            resolveTarget(ledAddr.site, ledAddr.route, ledAddr.deviceAddr, ledAddr.channel, ledAddr.fruId);
+            checkPresent(ledAddr.deviceAddr, ledAddr.channel, ledAddr.fruId);
+            FruTarget target(ledAddr.deviceAddr, ledAddr.channel, ledAddr.fruId);
+            checkControlRate(target, address);
+            auto entity = setPicmgLed(m_ctx.ipmi, ledAddr, *control);
+            m_controlTimes[target] = epicsTime::getCurrent();
+            return entity;
+        }
+    } catch (Provider::comm_error&) {
+        disconnectOnTimeout(m_ctx.ipmi);
+        throw;
     }
+    throw Provider::syntax_error("Writing not supported for '" + address + "'");
 }
 
-std::vector<FreeIpmiProvider::Entity> FreeIpmiProvider::getFrus()
+bool FreeIpmiProvider::canMergeWrite(const std::string& address)
+{
+    return (address.compare(0, 7, "SENSOR ") == 0);
+}
+
+void FreeIpmiProvider::checkControlRate(const FruTarget& target, const std::string& address) const
+{
+    auto it = m_controlTimes.find(target);
+    if (it != m_controlTimes.end() && (epicsTime::getCurrent() - it->second) < m_controlInterval)
+        throw Provider::process_error("Control '" + address + "' rejected, previous command to FRU too recent");
+}
+
+void FreeIpmiProvider::updateHousekeepingPeriod()
+{
+    double period = std::max(m_hotswapPeriod, m_ledPeriod);
+    if (m_hotswapPeriod > 0.0)
+        period = std::min(period, m_hotswapPeriod);
+    if (m_ledPeriod > 0.0)
+        period = std::min(period, m_ledPeriod);
+
+    auto now = epicsTime::getCurrent();
+    m_nextHotswap = now + m_hotswapPeriod;
+    m_nextLedPoll = now + m_ledPeriod;
+    setHousekeepingPeriod(period);
+}
+
+/*
+ * Each step takes API lock for as short as it can, hot-swap sensors and
+ * LEDs are polled one device at a time. SDR is only read again when its
+ * timestamps changed, that's the only step holding lock for long.
+ * Housekeeping runs at the shorter period, steps due within half of it
+ * are run now rather than a whole period late.
+ */
+void FreeIpmiProvider::housekeeping()
+{
+    bool hotswapDue;
+    bool ledsDue;
+    {
+        common::ScopedLock lock(m_apiMutex);
+        auto now = epicsTime::getCurrent();
+        double slack = 0.5 * getHousekeepingPeriod();
+        hotswapDue = (m_hotswapPeriod > 0.0 && (m_nextHotswap - now) <= slack);
+        ledsDue = (m_ledPeriod > 0.0 && (m_nextLedPoll - now) <= slack);
+        if (hotswapDue)
+            m_nextHotswap = now + m_hotswapPeriod;
+        if (ledsDue)
+            m_nextLedPoll = now + m_ledPeriod;
+    }
+
+    // Presence first, there's no point polling LEDs of removed modules
+    if (hotswapDue)
+        updateHotSwapStates();
+    if (ledsDue)
+        pollPicmgLeds();
+    if (!hotswapDue)
+        return;
+
+    common::ScopedLock lock(m_apiMutex);
+    if (m_connected)
+        refreshSdr();
+    if (m_connected && m_topology.fingerprint != m_sdrCatalog.fingerprint) {
+        buildTopology(m_ctx.ipmi);
+        resolvePendingLeds();
+    }
+}
+
+std::vector<FreeIpmiProvider::Entity> FreeIpmiProvider::getFrus(ScanMode mode)
 {
     common::ScopedLock lock(m_apiMutex);
     if (!m_connected)
         connect();
-    return getFrus(m_ctx.ipmi, m_ctx.sdr, m_ctx.fru);
+    auto entities = getFrus(m_ctx.ipmi, m_sdrCatalog, mode);
+    // Scan skips entities that failed, dead session shows in the last command
+    disconnectOnTimeout(m_ctx.ipmi);
+    return entities;
 }
 
-std::vector<FreeIpmiProvider::Entity> FreeIpmiProvider::getPicmgLeds()
+std::vector<FreeIpmiProvider::Entity> FreeIpmiProvider::getPicmgLeds(ScanMode mode)
 {
     common::ScopedLock lock(m_apiMutex);
     if (!m_connected)
         connect();
-    return getPicmgLeds(m_ctx.ipmi, m_ctx.sdr);
+    auto entities = getPicmgLeds(m_ctx.ipmi, m_sdrCatalog, mode);
+    // Scan skips entities that failed, dead session shows in the last command
+    disconnectOnTimeout(m_ctx.ipmi);
+    return entities;
+}
+
+void FreeIpmiProvider::setOption(const std::string& name, const std::string& value)
+{
+    common::ScopedLock lock(m_apiMutex);
+    if (name == "fru_ttl") {
+        m_fruCacheTtl = parseNonNegative(name, value);
+    } else if (name == "discovery_sessions") {
+        m_discoverySessions = parseInteger(name, value, 1);
+    } else if (name == "hotswap_period") {
+        m_hotswapPeriod = parseNonNegative(name, value);
+        updateHousekeepingPeriod();
+    } else if (name == "led_period") {
+        m_ledPeriod = parseNonNegative(name, value);
+        updateHousekeepingPeriod();
+    } else if (name == "write_delay") {
+        setWriteDelay(parseNonNegative(name, value));
+    } else if (name == "control_interval") {
+        m_controlInterval = parseNonNegative(name, value);
+    } else {
+        Provider::setOption(name, value);
+    }
 }
 
-FreeIpmiProvider::IpmbBridgeScoped::IpmbBridgeScoped(ipmi_ctx_t ipmi_, uint8_t slaveAddress, uint8_t channel)
+void FreeIpmiProvider::invalidateCache()
+{
+    common::ScopedLock lock(m_apiMutex);
+    m_fruCache.clear();
+    // Images on disk would be reused for as long as FRU header is the same
+    for (auto& fru: m_sdrCatalog.frus)
+        (void)std::remove(getFruCachePath(fru.address).c_str());
+    Provider::invalidateCache();
+}
+
+void FreeIpmiProvider::subscribe(const std::string& address, const std::function<void()>& cb, double period)
+{
+    auto tokens = common::split(address, ' ', 1);
+    if (tokens.size() != 2 || tokens[0] != "PICMG_LED")
+        return Provider::subscribe(address, cb, period);
+
+    PicmgLedAddress ledAddr(tokens[1]);
+
+    common::ScopedLock lock(m_apiMutex);
+    try {
+        resolveTarget(ledAddr.site, ledAddr.route, ledAddr.deviceAddr, ledAddr.channel);
+    } catch (Provider::absent_error&) {
+        // Site may get populated later, topology rebuild picks it up
+        LOG_DEBUG("Site '%s' has no controller yet, LED %u watched once it does", ledAddr.site.c_str(), ledAddr.ledId);
+        m_pendingLeds.emplace_back(ledAddr, cb);
+        return;
+    }
+    m_ledPolls[getLedKey(ledAddr)].callbacks.push_back(cb);
+}
+
+/*
+ * Route prefix is '<transit addr>:<transit channel>/', only present when
+ * request needs to go through transit controller.
+ */
+std::string FreeIpmiProvider::IpmbRoute::parse(const std::string& address)
+{
+    auto tokens = common::split(address, '/', 1);
+    if (tokens.size() != 2)
+        return address;
+
+    auto transit = common::split(tokens[0], ':');
+    if (transit.size() != 2)
+        throw Provider::syntax_error("Invalid transit route");
+    try {
+        transitAddr    = std::stoi(transit[0]) & 0xFF;
+        transitChannel = std::stoi(transit[1]) & 0xFF;
+    } catch (std::invalid_argument) {
+        throw Provider::syntax_error("Invalid transit route");
+    }
+    return tokens[1];
+}
+
+std::string FreeIpmiProvider::IpmbRoute::get() const
+{
+    if (!isTransit())
+        return "";
+    return std::to_string(transitAddr) + ":" + std::to_string(transitChannel) + "/";
+}
+
+bool FreeIpmiProvider::IpmbRoute::operator==(const IpmbRoute& other) const
+{
+    return (transitAddr == other.transitAddr && transitChannel == other.transitChannel);
+}
+
+FreeIpmiProvider::IpmbBridgeScoped::IpmbBridgeScoped(ipmi_ctx_t ipmi_, uint8_t slaveAddress_, uint8_t channel_)
+    : IpmbBridgeScoped(ipmi_, slaveAddress_, channel_, IpmbRoute())
+{}
+
+FreeIpmiProvider::IpmbBridgeScoped::IpmbBridgeScoped(ipmi_ctx_t ipmi_, uint8_t slaveAddress_, uint8_t channel_, const IpmbRoute& route_)
     : ipmi(ipmi_)
+    , route(route_)
+    , slaveAddress(slaveAddress_)
+    , channel(channel_)
 {
-    uint8_t channel_;
-    uint8_t slaveAddress_;
-    if (ipmi_ctx_get_target(ipmi, &channel_, &slaveAddress_) < 0) {
+    // FreeIPMI bridges to transit controller, requests for target get encapsulated
+    uint8_t bridgeAddress = (route.isTransit() ? route.transitAddr : slaveAddress);
+    uint8_t bridgeChannel = (route.isTransit() ? route.transitChannel : channel);
+
+    uint8_t currentChannel;
+    uint8_t currentAddress;
+    if (ipmi_ctx_get_target(ipmi, &currentChannel, &currentAddress) < 0) {
         //throw Provider::process_error("Failed to get IPMI target address - " + std::string(ipmi_ctx_errormsg(ipmi)));
         return;
     }
 
-    if (channel_ == channel && slaveAddress_ == slaveAddress)
+    if (currentChannel == bridgeChannel && currentAddress == bridgeAddress)
         return;
 
-    if (ipmi_ctx_set_target(ipmi, &channel, &slaveAddress) < 0) {
+    if (ipmi_ctx_set_target(ipmi, &bridgeChannel, &bridgeAddress) < 0) {
         //throw Provider::process_error("Failed to set IPMI target address - " + std::string(ipmi_ctx_errormsg(ipmi)));
         return;
     }
@@ -240,3 +765,106 @@ void FreeIpmiProvider::IpmbBridgeScoped::close()
         }
     }
 }
+
+/*
+ * Request for target is wrapped in Send Message command with tracking to the
+ * transit controller, which forwards it on target channel and returns target's
+ * response either embedded in Send Message response or through its receive
+ * message queue. Layouts are described in IPMI 2.0 spec, sections 22.6, 22.7
+ * and 6.13.
+ */
+int FreeIpmiProvider::IpmbBridgeScoped::cmdRaw(uint8_t lun, uint8_t netfn, const uint8_t* rq, size_t rqLen, uint8_t* rs, size_t rsLen)
+{
+    error.clear();
+
+    if (!route.isTransit())
+        return ipmi_cmd_raw(ipmi, lun, netfn, rq, rqLen, rs, rsLen);
+
+    static std::atomic<uint8_t> sequence{0};
+    auto checksum = [](const uint8_t* data, size_t len) {
+        uint8_t sum = 0;
+        for (size_t i = 0; i < len; i++)
+            sum += data[i];
+        return (uint8_t)-sum;
+    };
+
+    std::vector<uint8_t> msg;
+    msg.push_back(IPMI_CMD_SEND_MESSAGE);
+    msg.push_back(0x40 | (channel & 0x0F));                 // track request
+    msg.push_back(slaveAddress);                            // rsSA
+    msg.push_back((netfn << 2) | (lun & 0x3));
+    msg.push_back(checksum(&msg[2], 2));
+    uint8_t rqSeq = sequence++ & 0x3F;
+    msg.push_back(route.transitAddr);                       // rqSA, transit controller receives response
+    msg.push_back(rqSeq << 2);                              // rqSeq, rqLUN 0
+    msg.insert(msg.end(), rq, rq + rqLen);
+    msg.push_back(checksum(&msg[5], msg.size() - 5));
+
+    uint8_t buf[256];
+    int len = ipmi_cmd_raw(ipmi, IPMI_BMC_IPMB_LUN_BMC, IPMI_NET_FN_APP_RQ, msg.data(), msg.size(), buf, sizeof(buf));
+    if (len < 0)
+        return -1;
+    if (len < 2 || buf[0] != IPMI_CMD_SEND_MESSAGE || buf[1] != 0) {
+        error = "transit controller rejected request";
+        return -1;
+    }
+
+    // Encapsulated IPMB response: rqSA, netFn/rqLUN, checksum, rsSA, rqSeq/rsLUN, cmd, completion code, data, checksum.
+    // Receive queue may still hold responses to earlier requests that timed
+    // out, only accept the one answering this request.
+    auto matches = [&](const uint8_t* frame, size_t frameLen) {
+        return (frameLen >= 8 &&
+                frame[0] == route.transitAddr &&
+                (frame[1] >> 2) == (netfn | 1) &&
+                frame[3] == slaveAddress &&
+                (frame[4] >> 2) == rqSeq &&
+                frame[5] == rq[0] &&
+                checksum(frame + 3, frameLen - 3) == 0);
+    };
+
+    const uint8_t* frame = buf + 2;
+    size_t frameLen = len - 2;
+    if (frameLen > 0 && !matches(frame, frameLen)) {
+        LOG_DEBUG("Discarding unmatched embedded response from transit controller");
+        frameLen = 0;
+    }
+
+    // Response not embedded, pick it up from transit controller's queue
+    for (int retry = 0; frameLen == 0 && retry < 5; retry++) {
+        uint8_t getMsg[] = { IPMI_CMD_GET_MESSAGE };
+        len = ipmi_cmd_raw(ipmi, IPMI_BMC_IPMB_LUN_BMC, IPMI_NET_FN_APP_RQ, getMsg, sizeof(getMsg), buf, sizeof(buf));
+        if (len < 0)
+            return -1;
+        if (len >= 2 && buf[1] == 0x80) {
+            // Message queue empty
+            epicsThreadSleep(0.02);
+            continue;
+        }
+        if (len < 3 || buf[1] != 0)
+            break;
+        if (!matches(buf + 3, len - 3)) {
+            // Stale response to an earlier request, drop it and keep reading
+            LOG_DEBUG("Discarding unmatched response from transit controller queue");
+            continue;
+        }
+        frame = buf + 3;
+        frameLen = len - 3;
+    }
+
+    if (frameLen == 0) {
+        error = "no matching response from transit controller";
+        return -1;
+    }
+
+    size_t n = std::min(frameLen - 7, rsLen - 1);
+    rs[0] = frame[5];
+    memcpy(rs + 1, frame + 6, n);
+    return 1 + n;
+}
+
+std::string FreeIpmiProvider::IpmbBridgeScoped::errormsg() const
+{
+    if (!error.empty())
+        return error;
+    return ipmi_ctx_errormsg(ipmi);
+}
@@ -15,7 +15,11 @@
 
 #include <epicsTime.h>
 
+#include <functional>
+#include <map>
+#include <memory>
 #include <string>
+#include <tuple>
 #include <vector>
 
 #include <freeipmi/freeipmi.h>
@@ -27,7 +31,6 @@ class FreeIpmiProvider : public Provider
             ipmi_ctx_t ipmi{nullptr};
             ipmi_sdr_ctx_t sdr{nullptr};
             ipmi_sensor_read_ctx_t sensors{nullptr};
-            ipmi_fru_ctx_t fru{nullptr};
         } m_ctx;
 
         int m_sessionTimeout{IPMI_SESSION_TIMEOUT_DEFAULT};
@@ -44,14 +47,124 @@ class FreeIpmiProvider : public Provider
         int m_privLevel;
         std::string m_protocol;
         std::string m_sdrCachePath;
+        std::string m_fruCachePath;     //!< FRU image cache files prefix
         epicsMutex m_apiMutex;          //!< Serializes all external interfaces
         bool m_connected{false};
         epicsTime m_nextReconnect;
 
+        struct {
+            std::map<std::string, std::vector<Entity>> leds;    //!< PICMG LED entities by FRU device address
+        } m_scanCache;                  //!< Results of previous scans used by METADATA scan mode
+
+        /**
+         * @brief FRU device inventory, read and decoded all at once.
+         */
+        struct FruInventory {
+            epicsTime updated;                              //!< Time when inventory was read from device
+            std::vector<Entity> entities;                   //!< All non-empty fields in the form returned by scan
+            std::map<std::string, Variant> fields;          //!< Field values by "AREA SUBAREA"
+            bool complete{true};                            //!< Image decoded without skipping corrupted parts
+        };
+        std::map<std::string, FruInventory> m_fruCache;    //!< FRU inventories by FRU device address
+        unsigned m_discoverySessions{4};    //!< Maximum number of sessions used for FRU and LED discovery
+        double m_fruCacheTtl{0.0};      //!< Time in seconds after which FRU inventory is read again, 0 means never
+
+        typedef std::tuple<uint8_t,uint8_t,uint8_t> FruTarget; //!< FRU device address, channel and FRU id
+        std::map<FruTarget, uint8_t> m_hotswapStates;   //!< Last known PICMG M-state of hot-swappable FRUs
+        std::map<FruTarget, epicsTime> m_controlTimes;  //!< When FRU was last sent a control command
+        double m_controlInterval{1.0};  //!< Minimum time in seconds between control commands to the same FRU
+        double m_hotswapPeriod{5.0};    //!< Seconds between hot-swap and SDR change checks, 0 disables them
+        double m_ledPeriod{5.0};        //!< Seconds between polls of watched LEDs, 0 disables them
+        epicsTime m_nextHotswap;        //!< When hot-swap check is due next
+        epicsTime m_nextLedPoll;        //!< When watched LEDs are due next
+
         typedef common::buffer<uint8_t, IPMI_SDR_MAX_RECORD_LENGTH> SdrRecord;
-        typedef common::buffer<uint8_t, IPMI_FRU_AREA_SIZE_MAX+1> FruArea;
+        typedef std::vector<uint8_t> FruImage;
+
+        /**
+         * @brief Decoded FRU image, fields point into the image and are only valid as long as the image.
+         *
+         * Layout of FRU image is described in IPMI Platform Management FRU
+         * Information Storage Definition.
+         */
+        struct FruView {
+            struct Field {
+                const uint8_t* data{nullptr};
+                uint8_t typeLength{0};          //!< Type/length byte preceding the data
+                std::string decode() const;
+            };
+            struct InfoArea {
+                std::string name;               //!< Area name used in addresses, ie. CHASSIS
+                std::string label;              //!< Short area name used in record names, ie. Chas
+                std::string desc;               //!< Area name used in record descriptions, ie. Chassis
+                std::vector<std::pair<std::string, Field>> fields;  //!< Fields by subarea name, in image order
+                int chassisType{-1};            //!< Chassis type, only in chassis info area
+                int mfgTime{-1};                //!< Minutes since 1996-01-01, only in board info area
+            };
+            struct Record {
+                uint8_t type;
+                const uint8_t* data{nullptr};
+                uint8_t length{0};
+            };
+            std::vector<InfoArea> areas;        //!< Chassis, board and product info areas present in image
+            std::vector<Record> records;        //!< Multi records, in image order
+            bool complete{true};                //!< No area or record was skipped as corrupted
+        };
+
+    public:
+        /**
+         * @brief Path to IPMB controller that is not directly reachable from BMC.
+         *
+         * Controllers on a sub-bus of another controller, like AMC MMCs on
+         * carrier's IPMB-L, are double bridged through transit controller.
+         * In record links the route is an optional '<transit addr>:<transit channel>/'
+         * prefix of the entity address.
+         */
+        struct IpmbRoute {
+            uint8_t transitAddr{0};     //!< Transit controller slave address, 0 when target is bridged directly
+            uint8_t transitChannel{0};  //!< Transit controller channel as seen from BMC
+
+            bool isTransit() const { return transitAddr != 0; };
+            std::string parse(const std::string& address);
+            std::string get() const;
+            bool operator==(const IpmbRoute& other) const;
+        };
+
+        /**
+         * @brief Establishes and managed IPMB bridge if necessary depending on the address.
+         *
+         * Single bridging is done by FreeIPMI, requests routed through transit
+         * controller are encapsulated in Send Message command by cmdRaw().
+         */
+        class IpmbBridgeScoped {
+            private:
+                bool bridged{false};
+                ipmi_ctx_t ipmi{nullptr};
+                IpmbRoute route;
+                uint8_t slaveAddress{0};
+                uint8_t channel{0};
+                std::string error;
+            public:
+                IpmbBridgeScoped(ipmi_ctx_t ipmi, uint8_t slaveAddress, uint8_t channel);
+                IpmbBridgeScoped(ipmi_ctx_t ipmi, uint8_t slaveAddress, uint8_t channel, const IpmbRoute& route);
+                ~IpmbBridgeScoped();
+                void close();
+
+                /**
+                 * @brief Send raw request to bridged controller.
+                 * @param rq request starting with command byte
+                 * @param rs response buffer, response starts with command byte and completion code
+                 * @return response length or -1 on failure, see errormsg()
+                 */
+                int cmdRaw(uint8_t lun, uint8_t netfn, const uint8_t* rq, size_t rqLen, uint8_t* rs, size_t rsLen);
+                std::string errormsg() const;
+        };
 
+    private:
         struct SensorAddress {
+            IpmbRoute route;
+            std::string site;           //!< Physical site of owner, resolved through topology
+            std::string field;          //!< Sensor entity field record reads instead of VAL, empty for VAL
             uint8_t ownerId{0};
             uint8_t ownerLun{0};
             uint8_t channel;
@@ -61,10 +174,13 @@ class FreeIpmiProvider : public Provider
             SensorAddress(ipmi_sdr_ctx_t sdr, const SdrRecord& record);
             std::string get() const;
             bool compare(const SensorAddress& other);
+            int getThreshold() const;   //!< Index of threshold field in Set/Get Sensor Thresholds, -1 when field is not a threshold
         };
 
         struct FruAddress {
             // Supports only FRUs that can be accessed via read/write command to mgmt ctrl
+            IpmbRoute route;
+            std::string site;           //!< Physical site of controller, resolved through topology
             uint8_t deviceAddr;
             uint8_t fruId;
             uint8_t lun;
@@ -76,10 +192,13 @@ class FreeIpmiProvider : public Provider
             FruAddress(const std::string& address);
             FruAddress(ipmi_sdr_ctx_t sdr, const SdrRecord& record);
             std::string get() const;
+            std::string getDevice() const;
             bool compare(const FruAddress& other, bool checkArea=true, bool checkSubarea=true) const;
         };
 
         struct PicmgLedAddress {
+            IpmbRoute route;
+            std::string site;           //!< Physical site of controller, resolved through topology
             uint8_t deviceAddr;
             uint8_t channel;
             uint8_t fruId;
@@ -92,18 +211,117 @@ class FreeIpmiProvider : public Provider
             bool compare(const PicmgLedAddress& other) const;
         };
 
+        struct PicmgFruAddress {
+            IpmbRoute route;
+            std::string site;           //!< Physical site of controller, resolved through topology
+            uint8_t deviceAddr;
+            uint8_t channel;
+            uint8_t fruId;
+            std::string control;        //!< Controlled FRU function, ACTIVATION
+
+            PicmgFruAddress(const std::string& address);
+            std::string get() const;
+        };
+
         /**
-         * @brief Establishes and managed IPMB bridge if necessary depending on the address.
+         * @brief PICMG LED watched by background poller.
          */
-        class IpmbBridgeScoped {
-        private:
-                bool bridged{false};
-                ipmi_ctx_t ipmi{nullptr};
-            public:
-                IpmbBridgeScoped(ipmi_ctx_t ipmi, uint8_t slaveAddress, uint8_t channel);
-                ~IpmbBridgeScoped();
-                void close();
+        struct PicmgLedPoll {
+            std::vector<std::function<void()>> callbacks;   //!< Called when LED state changes
+            bool valid{false};          //!< Last poll succeeded and value is current
+            uint32_t state{0};          //!< Local and override state packed for comparison
+            int value{0};               //!< Color LED is showing, as returned in VAL
+            epicsTime updated;          //!< Time of last successful poll
+        };
+        /**
+         * @brief Values, severities and names of sensors matching SENSORS selector from one pass.
+         */
+        struct SensorSet {
+            unsigned seq{0};                    //!< Tells consecutive reads apart
+            epicsTimeStamp time;                //!< When pass started
+            std::vector<double> values;
+            std::vector<double> severities;
+            std::vector<std::string> names;
         };
+        std::map<std::string, SensorSet> m_sensorSets;      //!< Last pass by selector
+        std::map<std::string, unsigned> m_sensorSetsSeen;   //!< Last pass returned to each address
+        unsigned m_sensorSetSeq{0};
+
+        typedef std::tuple<uint8_t,uint8_t,uint8_t,uint8_t,uint8_t,uint8_t> PicmgLedKey; //!< Transit address and channel, device address, channel, FRU id and LED id
+        std::map<PicmgLedKey, PicmgLedPoll> m_ledPolls; //!< Watched LEDs, ordered so that LEDs of same IPMB target are adjacent
+        std::vector<std::pair<PicmgLedAddress, std::function<void()>>> m_pendingLeds; //!< Watched LEDs in sites not populated yet
+
+        /**
+         * @brief SDR records of interest classified in a single pass over SDR.
+         *
+         * Catalog is built every time SDR cache is (re)opened and consumed
+         * by all functions that would otherwise need to walk the SDR.
+         */
+        struct SdrCatalog {
+            struct Sensor {
+                SdrRecord record;
+                SensorAddress address;
+                uint8_t entityId;
+                uint8_t entityInstance;
+                uint8_t sensorType;
+            };
+            struct Fru {
+                SdrRecord record;
+                FruAddress address;
+                std::string name;
+                std::string desc;
+                uint8_t entityId;
+                uint8_t entityInstance;
+            };
+            struct HotSwap {
+                size_t sensor;                      //!< Index into sensors
+                FruTarget target;                   //!< FRU whose M-state the sensor reports
+            };
+
+            std::vector<Sensor> sensors;            //!< Full and compact sensor records, in SDR order
+            std::vector<Fru> frus;                  //!< Logical FRU device locator records, in SDR order
+            std::vector<SdrRecord> controllers;     //!< Management controller device locator records
+            std::vector<SdrRecord> entityAssocs;    //!< Entity association records
+            std::map<std::string, size_t> sensorIndex;  //!< Index into sensors by SensorAddress::get()
+            std::map<std::string, size_t> fruIndex;     //!< Index into frus by FruAddress::getDevice()
+            std::map<std::pair<uint8_t,uint8_t>,std::string> fruNames; //!< FRU name by entity id and instance
+            std::vector<HotSwap> hotswap;           //!< PICMG hot-swap sensors
+            std::map<std::pair<uint8_t,uint8_t>, size_t> hotswapIndex; //!< Index into hotswap by entity id and instance
+            std::map<std::pair<uint8_t,uint8_t>, IpmbRoute> routes;   //!< Transit routes by controller address and channel
+
+            /**
+             * @brief Get learned route to controller, empty route when it's bridged directly.
+             */
+            IpmbRoute findRoute(uint8_t address, uint8_t channel) const;
+            uint32_t fingerprint{2166136261u};      //!< Hash of all cataloged records, changes when SDR changes
+        };
+        SdrCatalog m_sdrCatalog;
+
+        /**
+         * @brief Where IPMB controllers are physically located, built once per SDR.
+         *
+         * Controllers come from MC device locator records, their sites from
+         * PICMG Get Address Info. Sites are named by type and number, ie.
+         * slot4 or fan1, AMC sites are qualified with carrier site as in slot4.amc2.
+         */
+        struct Topology {
+            struct Controller {
+                IpmbRoute route;
+                uint8_t deviceAddr;             //!< Slave address in 8-bit form
+                uint8_t channel;
+                uint8_t capabilities;           //!< Device support bits from MC device locator
+                std::vector<uint8_t> fruIds;    //!< FRU devices provided by controller
+                std::string site;               //!< Site name, empty when unknown
+            };
+            std::vector<Controller> controllers;
+            std::map<std::string, size_t> siteIndex;    //!< Index into controllers by site name
+            std::map<std::pair<uint8_t,uint8_t>, size_t> controllerIndex; //!< Index into controllers by address and channel
+            uint32_t fingerprint{0};                    //!< Fingerprint of SDR catalog topology was built from
+
+            const Controller* find(uint8_t address, uint8_t channel) const;
+            const Controller* findSite(const std::string& site) const;
+        };
+        Topology m_topology;
 
     public:
 
@@ -130,21 +348,58 @@ class FreeIpmiProvider : public Provider
 
         /**
          * @brief Scans for all sensors in the connected IPMI device.
+         * @param mode METADATA builds sensors from SDR only without reading their values
          * @return A list of sensors
          */
-        std::vector<Entity> getSensors() override;
+        std::vector<Entity> getSensors(ScanMode mode) override;
 
         /**
          * @brief Scans for all FRUs in the connected IPMI device.
+         * @param mode METADATA returns previously read FRUs when available
          * @return A list of FRUs
          */
-        std::vector<Entity> getFrus() override;
+        std::vector<Entity> getFrus(ScanMode mode) override;
 
         /**
          * @brief Scans for all PICMG LEDs in the connected IPMI device.
+         * @param mode METADATA uses cached LED properties and doesn't read LED states
          * @return A list of LEDs
          */
-        std::vector<Entity> getPicmgLeds() override;
+        std::vector<Entity> getPicmgLeds(ScanMode mode) override;
+
+        /**
+         * @brief Set FreeIPMI provider option.
+         *
+         * Supported options:
+         * - fru_ttl seconds after which cached FRU inventory is read again, 0 disables expiry
+         *   of complete inventories, corrupted ones expire after at most 30 seconds
+         * - discovery_sessions maximum number of concurrent sessions for FRU and LED discovery
+         * - hotswap_period seconds between hot-swap and SDR change checks, 0 disables checking
+         * - led_period seconds between polls of LEDs watched by I/O Intr records, 0 disables polling
+         * - write_delay seconds sensor threshold writes wait to be merged with others
+         * - control_interval minimum seconds between control commands to the same FRU
+         * - cache_ttl_<kind> seconds values of sensor, fru or picmg_led entities are served from cache
+         * - poll_period_<kind> seconds between I/O Intr scans of sensor or fru entities, spread over the period,
+         *   default for records without POLL=<seconds> at the end of their link
+         * - poll_max_period_<kind> longest seconds between I/O Intr scans when adapting to value changes
+         * @exception syntax_error when option is not supported or value is invalid
+         */
+        void setOption(const std::string& name, const std::string& value) override;
+
+        /**
+         * @brief Drop cached FRU inventories, their images on disk and entity values.
+         */
+        void invalidateCache() override;
+
+        /**
+         * @brief Watch entity for changes, PICMG LEDs natively, others through periodic polls.
+         *
+         * Watched LEDs are polled in housekeeping, all LEDs behind the
+         * same IPMB target at once, cb is only called when LED state changes.
+         * Other entities are handed to Provider::subscribe(), LEDs ignore period.
+         * @exception syntax_error for unsupported entities
+         */
+        void subscribe(const std::string& address, const std::function<void()>& cb, double period=0.0) override;
 
     private:
         /**
@@ -153,11 +408,45 @@ class FreeIpmiProvider : public Provider
          */
         void connect();
 
+        /**
+         * @brief Reconnect when disconnected, at most once a second. Requires API lock.
+         * @exception runtime_error when not connected
+         */
+        void reconnectIfDue();
+
+        /**
+         * @brief Mark provider disconnected when last command on main session timed out. Requires API lock.
+         * @param ipmi session the failed command was sent on, worker sessions are ignored
+         * @return true when session is gone
+         */
+        bool disconnectOnTimeout(ipmi_ctx_t ipmi);
+
+        /**
+         * @brief Create new IPMI context and open session with the device.
+         * @return IPMI context, caller must close and destroy it
+         * @exception std::runtime_error when can't connect
+         */
+        ipmi_ctx_t openSession() const;
+
+        /**
+         * @brief Run job for selected FRU devices, concurrently for different IPMB targets.
+         * @param ipmi main session, used by calling thread
+         * @param frus indexes of selected FRU devices in catalog
+         * @param what name of the discovery, for logging
+         * @param job function called exactly once for every selected FRU device, from any thread
+         *
+         * FRU devices behind the same IPMB target are processed serially in the
+         * order they were selected. Up to discovery_sessions sessions are used.
+         */
+        void discover(ipmi_ctx_t ipmi, const SdrCatalog& catalog, const std::vector<size_t>& frus,
+                      const std::string& what, const std::function<void(ipmi_ctx_t, size_t)>& job);
+
         /**
          * @brief Opens or creates SDR cache, needs file on disk.
-         * @return
+         * @param sdr context to open cache with
+         * @return true when cache file was (re)created from device SDR
          */
-        void openSdrCache();
+        bool openSdrCache(ipmi_sdr_ctx_t sdr);
 
         /**
          * @brief Based on the address, determine IPMI entity type and retrieve its current value.
@@ -166,39 +455,152 @@ class FreeIpmiProvider : public Provider
          */
         Entity getEntity(const std::string& address) override;
 
+        /**
+         * @brief Sensors of the same entity behind the same IPMB target form a group.
+         */
+        std::string getGroup(const std::string& address) override;
+
+        /**
+         * @brief Read sensors of one group back to back as one snapshot.
+         *
+         * All entities carry the time when the group read started, records
+         * with TSE=-2 of one board get the same timestamp. When IPMB target
+         * doesn't respond, the rest of the group fails without waiting for
+         * each sensor to time out.
+         */
+        std::vector<Entity> getEntities(const std::vector<std::string>& addresses) override;
+
+        /**
+         * @brief Write values pending at the same time.
+         *
+         * Threshold writes to the same sensor are sent as one Set Sensor
+         * Thresholds command and confirmed by reading thresholds back.
+         */
+        std::vector<Entity> setEntities(const std::vector<std::string>& addresses, const std::vector<Variant>& values) override;
+
+        /**
+         * @brief Send control command, like chassis power or PICMG FRU activation.
+         *
+         * Commands to the same FRU are at least control_interval apart,
+         * the ones coming in sooner are rejected.
+         */
+        Entity setEntity(const std::string& address, const Variant& value) override;
+
+        /**
+         * @brief Only sensor threshold writes are merged, controls go out immediately.
+         */
+        bool canMergeWrite(const std::string& address) override;
+
+        /**
+         * @brief Reject control command to target when previous successful one was too recent.
+         * @exception process_error when control_interval didn't pass yet
+         */
+        void checkControlRate(const FruTarget& target, const std::string& address) const;
+
+        /**
+         * @brief Check for inserted or removed modules and refresh their data, poll watched LEDs.
+         *
+         * Runs at the shorter of hotswap_period and led_period, each step
+         * only when its own period elapsed.
+         */
+        void housekeeping() override;
+
+        /**
+         * @brief Set housekeeping period from hot-swap and LED periods.
+         */
+        void updateHousekeepingPeriod();
+
+        // *** SDR functionality implemented in ipmisdr.cpp file ***
+
+        static void buildSdrCatalog(ipmi_sdr_ctx_t sdr, SdrCatalog& catalog);
+        static void assocEntityNames(const SdrCatalog& catalog, std::map<std::pair<uint8_t,uint8_t>,std::string>& names);
+        static void assocHotSwapSensors(SdrCatalog& catalog);
+        static void learnRoutes(SdrCatalog& catalog);
+
+        // *** Hot-swap functionality implemented in ipmihotswap.cpp file ***
+
+        void refreshSdr();
+        void updateHotSwapStates();
+        static int getHotSwapState(ipmi_ctx_t ipmi, const SdrCatalog::Sensor& sensor);
+        void invalidateFruTarget(const SdrCatalog& catalog, const FruTarget& target, bool removed);
+        bool isPresent(uint8_t deviceAddr, uint8_t channel, uint8_t fruId) const;
+        void checkPresent(uint8_t deviceAddr, uint8_t channel, uint8_t fruId) const;
+        void checkPresent(const SdrCatalog& catalog, const SensorAddress& address) const;
+
         // *** SENSOR functinality implemented in ipmisensor.cpp file ***
 
-        static Entity getSensor(ipmi_sdr_ctx_t sdr, ipmi_sensor_read_ctx_t sensors, const SensorAddress& address);
-        static Entity getSensor(ipmi_sdr_ctx_t sdr, ipmi_sensor_read_ctx_t sensors, const SdrRecord& record);
-        static std::vector<Entity> getSensors(ipmi_sdr_ctx_t sdr, ipmi_sensor_read_ctx_t sensors);
+        static Entity getSensor(ipmi_ctx_t ipmi, ipmi_sdr_ctx_t sdr, ipmi_sensor_read_ctx_t sensors, const SdrCatalog& catalog, const SensorAddress& address);
+        static Entity getSensor(ipmi_ctx_t ipmi, ipmi_sdr_ctx_t sdr, ipmi_sensor_read_ctx_t sensors, const SdrCatalog::Sensor& sensor);
+        static int readTransitSensor(ipmi_ctx_t ipmi, ipmi_sdr_ctx_t sdr, const SdrCatalog::Sensor& sensor, uint8_t& readingRaw, double& reading, uint16_t& eventMask, int& errnum);
+        static Entity getSensorMetadata(ipmi_sdr_ctx_t sdr, const SdrRecord& record);
+        static std::vector<Entity> getSensors(ipmi_ctx_t ipmi, ipmi_sdr_ctx_t sdr, ipmi_sensor_read_ctx_t sensors, const SdrCatalog& catalog, ScanMode mode);
+        Entity getSensorSet(const std::string& address, const std::string& selector);
+        SensorSet readSensorSet(const std::string& selector);
+        Entity readSensor(SensorAddress& address);
+        void resolveSensor(SensorAddress& address) const;
+        static Entity selectSensorField(const Entity& sensor, const std::string& field);
+        static std::vector<Entity> getSensorThresholdOutputs(ipmi_sdr_ctx_t sdr, const SdrCatalog::Sensor& sensor);
+        static std::vector<int> getSensorThresholds(ipmi_ctx_t ipmi, const SdrCatalog::Sensor& sensor);
+        static void setSensorThresholds(ipmi_ctx_t ipmi, const SdrCatalog::Sensor& sensor, uint8_t mask, const std::vector<uint8_t>& thresholds);
+        static double decodeThreshold(ipmi_sdr_ctx_t sdr, const SdrCatalog::Sensor& sensor, uint8_t raw);
+        static uint8_t encodeThreshold(ipmi_sdr_ctx_t sdr, const SdrCatalog::Sensor& sensor, double value);
+        const SdrCatalog::Sensor& findThresholdSensor(SensorAddress& address);
+        Entity readSensorThreshold(SensorAddress& address);
+        Entity writeSensorThresholds(SensorAddress& address, const std::map<int,double>& thresholds);
         static std::string getSensorName(ipmi_sdr_ctx_t sdr, const SdrRecord& record);
         static std::string getSensorDesc(ipmi_sdr_ctx_t sdr, const SdrRecord& record);
         static std::string getSensorUnits(ipmi_sdr_ctx_t sdr, const SdrRecord& record);
 
         // *** FRU functionality implemented in ipmifru.cpp file ***
 
-        static Entity getFru(ipmi_ctx_t ipmi, ipmi_sdr_ctx_t sdr, ipmi_fru_ctx_t fru, const FruAddress& address);
-        static std::vector<Entity> getFrus(ipmi_ctx_t ipmi, ipmi_sdr_ctx_t sdr, ipmi_fru_ctx_t fru);
-        static std::map<std::pair<uint8_t,uint8_t>,std::string> getFruEntityNameAssoc(ipmi_sdr_ctx_t sdr);
-        static std::vector<Entity> getFruAreas(ipmi_fru_ctx_t fru, const FruAddress& address, const Entity& tmpl);
-        static std::string getFruField(ipmi_fru_ctx_t fru, const ipmi_fru_field_t& field, uint8_t languageCode);
+        Entity getFru(ipmi_ctx_t ipmi, const SdrCatalog& catalog, const FruAddress& address);
+        const FruInventory& getFruInventory(ipmi_ctx_t ipmi, const SdrCatalog& catalog, const FruAddress& address, bool refresh);
+        const FruInventory* findFruInventory(const std::string& device) const;
+        FruInventory readFruInventory(ipmi_ctx_t ipmi, const SdrCatalog& catalog, const SdrCatalog::Fru& entry) const;
+        std::vector<Entity> getFrus(ipmi_ctx_t ipmi, const SdrCatalog& catalog, ScanMode mode);
+        static std::vector<Entity> getFruAreas(const FruAddress& address, const Entity& tmpl, const FruImage& image, bool& complete);
+        FruImage getFruImage(IpmbBridgeScoped& target, const SdrCatalog& catalog, const FruAddress& address) const;
+        std::string getFruCachePath(const FruAddress& address) const;
+        static FruImage readFruImage(IpmbBridgeScoped& target, uint8_t fruId, bool byWords, size_t size, const FruImage& header);
+        static size_t getFruInventorySize(IpmbBridgeScoped& target, uint8_t fruId, bool& byWords);
+        static void readFruData(IpmbBridgeScoped& target, uint8_t fruId, bool byWords, size_t offset, uint8_t* data, size_t count);
+        static bool loadFruImage(const std::string& path, uint32_t fingerprint, FruImage& image);
+        static void saveFruImage(const std::string& path, uint32_t fingerprint, const FruImage& image);
         static std::string getFruName(ipmi_sdr_ctx_t sdr, const SdrRecord& record);
         static std::string getFruDesc(ipmi_sdr_ctx_t sdr, const SdrRecord& record);
         static bool isFruLogical(ipmi_sdr_ctx_t sdr, const SdrRecord& record);
 
-        // These are called from getFru() and are high-level functions that in turn call getFru*Subarea() functions
-        static std::vector<Entity> getFruChassis(ipmi_fru_ctx_t fru, const FruAddress& address, const Entity& deviceName, const FruArea& fruArea);
-        static std::vector<Entity> getFruBoard(  ipmi_fru_ctx_t fru, const FruAddress& address, const Entity& deviceName, const FruArea& fruArea);
-        static std::vector<Entity> getFruProduct(ipmi_fru_ctx_t fru, const FruAddress& address, const Entity& deviceName, const FruArea& fruArea);
+        // FRU image decoder, walks the image once and validates all checksums
+        static FruView decodeFruImage(const FruImage& image);
+        static std::vector<Entity> getFruInfoArea(const FruView::InfoArea& area, const FruAddress& address, const Entity& tmpl);
+        static std::vector<Entity> getFruRecord(const FruView::Record& record, const FruAddress& address, const Entity& tmpl);
 
-        // Functions that parse individual FRU subareas and return only VAL field in the entity
-        static std::string getFruChassisSubarea(ipmi_fru_ctx_t fru, const FruArea& area, const std::string& subarea);
-        static std::string getFruBoardSubarea(  ipmi_fru_ctx_t fru, const FruArea& area, const std::string& subarea);
-        static std::string getFruProductSubarea(ipmi_fru_ctx_t fru, const FruArea& area, const std::string& subarea);
+        // *** Chassis functionality implemented in ipmichassis.cpp file ***
+
+        static Entity setChassisControl(ipmi_ctx_t ipmi, int control);
 
         // *** PICMG functionality implemented in ipmipicmg.cpp file ***
-        std::vector<FreeIpmiProvider::Entity> getPicmgLeds(ipmi_ctx_t ipmi, ipmi_sdr_ctx_t sdr);
-        std::vector<FreeIpmiProvider::Entity> getPicmgLeds(ipmi_ctx_t ipmi, const FruAddress& address, const std::string& namePrefix);
-        FreeIpmiProvider::Entity getPicmgLedFull(ipmi_ctx_t ipmi, const PicmgLedAddress& address, const std::string& namePrefix);
+        std::vector<FreeIpmiProvider::Entity> getPicmgLeds(ipmi_ctx_t ipmi, const SdrCatalog& catalog, ScanMode mode);
+        std::vector<FreeIpmiProvider::Entity> getPicmgLeds(ipmi_ctx_t ipmi, const FruAddress& address, const std::string& namePrefix, ScanMode mode);
+        FreeIpmiProvider::Entity getPicmgLedFull(ipmi_ctx_t ipmi, const PicmgLedAddress& address, const std::string& namePrefix, ScanMode mode);
         FreeIpmiProvider::Entity getPicmgLed(ipmi_ctx_t ipmi, const PicmgLedAddress& address);
+        static Entity setPicmgLed(ipmi_ctx_t ipmi, const PicmgLedAddress& address, int value);
+        static Entity setPicmgFruActivation(ipmi_ctx_t ipmi, const PicmgFruAddress& address, int value);
+        void pollPicmgLeds();
+        static PicmgLedKey getLedKey(const PicmgLedAddress& address);
+
+        /**
+         * @brief Move watched LEDs whose site got populated to the poll list.
+         *
+         * Requires API lock, called after topology is (re)built.
+         */
+        void resolvePendingLeds();
+        void buildTopology(ipmi_ctx_t ipmi);
+
+        /**
+         * @brief Fill in controller address from site, or learned route when there's no explicit one.
+         * @param fruId when >= 0, controller in site must provide this FRU
+         * @exception absent_error when site is empty
+         */
+        void resolveTarget(const std::string& site, IpmbRoute& route, uint8_t& deviceAddr, uint8_t& channel, int fruId=-1) const;
 };
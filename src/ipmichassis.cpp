@@ -0,0 +1,38 @@
+/* ipmichassis.cpp
+ *
+ * Copyright (c) 2026 Oak Ridge National Laboratory.
+ * All rights reserved.
+ * See file LICENSE that is included with this distribution.
+ *
+ * @author agent
+ * @date Oct 2026
+ */
+
+#include "freeipmiprovider.h"
+
+/*
+ * Chassis Control request is described in IPMI 2.0 spec, section 28.3.
+ * Control is 0 power down, 1 power up, 2 power cycle, 3 hard reset,
+ * 4 diagnostic interrupt and 5 soft shutdown through ACPI.
+ */
+FreeIpmiProvider::Entity FreeIpmiProvider::setChassisControl(ipmi_ctx_t ipmi, int control)
+{
+    if (control < IPMI_CHASSIS_CONTROL_POWER_DOWN || control > IPMI_CHASSIS_CONTROL_INITIATE_SOFT_SHUTDOWN)
+        throw Provider::syntax_error("Invalid chassis control " + std::to_string(control));
+
+    uint8_t rq[] = { IPMI_CMD_CHASSIS_CONTROL, (uint8_t)control };
+    uint8_t rs[16];
+
+    IpmbBridgeScoped bmc(ipmi, IPMI_SLAVE_ADDRESS_BMC, 0);
+    int len = bmc.cmdRaw(IPMI_BMC_IPMB_LUN_BMC, IPMI_NET_FN_CHASSIS_RQ, rq, sizeof(rq), rs, sizeof(rs));
+    if (len < 0)
+        throw Provider::comm_error("failed to send chassis control - " + bmc.errormsg());
+    if (len < 2 || rs[0] != rq[0])
+        throw Provider::process_error("failed to decode chassis control response");
+    if (rs[1] != 0)
+        throw Provider::process_error("chassis control rejected, completion code " + std::to_string(rs[1]));
+
+    Entity entity;
+    entity["VAL"] = control;
+    return entity;
+}
@@ -10,118 +10,94 @@
 
 #include "freeipmiprovider.h"
 
-Provider::Entity FreeIpmiProvider::getFru(ipmi_ctx_t ipmi, ipmi_sdr_ctx_t sdr, ipmi_fru_ctx_t fru, const FruAddress& address)
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+static const size_t FRU_COMMON_HEADER_LENGTH = 8;
+static const size_t FRU_READ_CHUNK = 16;       //!< Bytes read at once, small enough for bridged requests
+static const double FRU_INCOMPLETE_TTL = 30.0;  //!< Seconds before partially decoded FRU inventory is read again
+
+/**
+ * @brief Verify FRU common header format version and checksum, IPMI FRU spec section 8.
+ */
+static bool isFruHeaderValid(const uint8_t* header)
 {
-    // Find FRU Device Locator entry in SDR that matches selected device id
-    if (ipmi_sdr_cache_first(sdr) < 0)
-        throw std::runtime_error("failed to rewind SDR cache - " + std::string(ipmi_sdr_ctx_errormsg(sdr)));
-
-    // Iterate through SDR until a record is found
-    bool found = false;
-    do {
-        uint8_t recordType;
-        if (ipmi_sdr_parse_record_id_and_type(sdr, NULL, 0, NULL, &recordType) < 0) {
-            LOG_WARN("Failed to parse SDR record type - %s, skipping", ipmi_sdr_ctx_errormsg(sdr));
-            continue;
-        }
+    uint8_t checksum = 0;
+    for (size_t i = 0; i < FRU_COMMON_HEADER_LENGTH; i++)
+        checksum += header[i];
+    return (checksum == 0 && (header[0] & 0x0F) == 0x01);
+}
 
-        if (recordType != IPMI_SDR_FORMAT_FRU_DEVICE_LOCATOR_RECORD)
-            continue;
+Provider::Entity FreeIpmiProvider::getFru(ipmi_ctx_t ipmi, const SdrCatalog& catalog, const FruAddress& address)
+{
+    auto& inventory = getFruInventory(ipmi, catalog, address, false);
 
-        SdrRecord record;
-        record.size = ipmi_sdr_cache_record_read(sdr, record.data, record.max_size);
-        if (record.size < 0) {
-            LOG_DEBUG("Failed to read SDR record - %s, skipping", ipmi_sdr_ctx_errormsg(sdr));
-            continue;
-        }
+    auto it = inventory.fields.find(address.area + " " + address.subarea);
+    if (it == inventory.fields.end())
+        throw Provider::process_error("FRU area not found");
 
-//        if (isFruLogical(sdr, record) == false)
-//            continue;
+    Entity entity;
+    entity["VAL"] = it->second;
+    return entity;
+}
 
-        try {
-            FruAddress tmp(sdr, record);
-            if (address.compare(tmp, false, false)) {
-                found = true;
-                break;
-            }
-        } catch (Provider::process_error& e) {
-            LOG_DEBUG("%s", e.what());
-            continue;
-        }
-    } while (ipmi_sdr_cache_next(sdr) == 1);
-    if (!found)
+const FreeIpmiProvider::FruInventory& FreeIpmiProvider::getFruInventory(ipmi_ctx_t ipmi, const SdrCatalog& catalog, const FruAddress& address, bool refresh)
+{
+    // Only FRUs with FRU Device Locator entry in SDR are supported
+    auto device = address.getDevice();
+    auto index = catalog.fruIndex.find(device);
+    if (index == catalog.fruIndex.end())
         throw Provider::process_error("FRU not found");
 
-    IpmbBridgeScoped bridge(ipmi, address.deviceAddr, address.channel);
-
-    if (ipmi_fru_open_device_id(fru, address.fruId) < 0)
-        throw std::runtime_error("Failed to open FRU device - " + std::string(ipmi_fru_ctx_errormsg(fru)));
-
-    if (ipmi_fru_first(fru) < 0) {
-        ipmi_fru_close_device_id(fru);
-        throw std::runtime_error("Failed to rewind FRU - " + std::string(ipmi_fru_ctx_errormsg(fru)));
-    }
-
-    std::string error;
-    std::string subarea;
-    do {
-        unsigned int areaType = 0;
-        FruArea buffer;
-
-        if (ipmi_fru_read_data_area(fru, &areaType, &buffer.size, buffer.data, buffer.max_size-1) < 0)
-            continue;
-        if (buffer.size == 0)
-            continue;
-
-        try {
-            switch (areaType) {
-            case IPMI_FRU_AREA_TYPE_CHASSIS_INFO_AREA:
-                if (address.area == "CHASSIS")
-                    subarea = getFruChassisSubarea(fru, buffer, address.subarea);
-                break;
-            case IPMI_FRU_AREA_TYPE_BOARD_INFO_AREA:
-                if (address.area == "BOARD")
-                    subarea = getFruBoardSubarea(fru, buffer, address.subarea);
-                break;
-            case IPMI_FRU_AREA_TYPE_PRODUCT_INFO_AREA:
-                if (address.area == "PRODUCT")
-                    subarea = getFruProductSubarea(fru, buffer, address.subarea);
-                break;
-            case IPMI_FRU_AREA_TYPE_MULTIRECORD_POWER_SUPPLY_INFORMATION:
-                break;
-            case IPMI_FRU_AREA_TYPE_MULTIRECORD_DC_OUTPUT:
-                break;
-            case IPMI_FRU_AREA_TYPE_MULTIRECORD_DC_LOAD:
-            case IPMI_FRU_AREA_TYPE_MULTIRECORD_EXTENDED_DC_LOAD:
-                break;
-            case IPMI_FRU_AREA_TYPE_MULTIRECORD_MANAGEMENT_ACCESS_RECORD:
-                break;
-            case IPMI_FRU_AREA_TYPE_MULTIRECORD_BASE_COMPATABILITY_RECORD:
-                break;
-            case IPMI_FRU_AREA_TYPE_MULTIRECORD_EXTENDED_COMPATABILITY_RECORD:
-                break;
-            case IPMI_FRU_AREA_TYPE_MULTIRECORD_OEM:
-                break;
-            default:
-                break;
-            }
-        } catch (std::runtime_error e) {
-            error = e.what();
-            break;
-        }
-
-    } while (subarea.empty() && ipmi_fru_next(fru) == 1);
+    auto cached = findFruInventory(device);
+    if (cached && !refresh)
+        return *cached;
 
-    ipmi_fru_close_device_id(fru);
+    auto& slot = m_fruCache[device];
+    slot = readFruInventory(ipmi, catalog, catalog.frus[index->second]);
+    return slot;
+}
 
-    if (!error.empty())
-        throw Provider::process_error(error);
-    if (subarea.empty())
-        throw Provider::process_error("FRU area not found");
+const FreeIpmiProvider::FruInventory* FreeIpmiProvider::findFruInventory(const std::string& device) const
+{
+    auto it = m_fruCache.find(device);
+    if (it == m_fruCache.end())
+        return nullptr;
+    // Corrupted areas may have been a transient read error, don't keep them forever
+    double ttl = m_fruCacheTtl;
+    if (!it->second.complete)
+        ttl = (ttl > 0.0 ? std::min(ttl, FRU_INCOMPLETE_TTL) : FRU_INCOMPLETE_TTL);
+    if (ttl > 0.0 && (epicsTime::getCurrent() - it->second.updated) >= ttl)
+        return nullptr;
+    return &it->second;
+}
 
-    Entity entity;
-    entity["VAL"] = subarea;
-    return entity;
+FreeIpmiProvider::FruInventory FreeIpmiProvider::readFruInventory(ipmi_ctx_t ipmi, const SdrCatalog& catalog, const SdrCatalog::Fru& entry) const
+{
+    Entity tmpl;
+    tmpl["NAME"] = entry.name;
+    tmpl["DESC"] = entry.desc;
+
+    IpmbBridgeScoped bridge(ipmi, entry.address.deviceAddr, entry.address.channel, entry.address.route);
+
+    FruInventory inventory;
+    inventory.updated = epicsTime::getCurrent();
+    inventory.entities = getFruAreas(entry.address, tmpl, getFruImage(bridge, catalog, entry.address), inventory.complete);
+    if (!inventory.complete) {
+        // Next read should come from device, not from the same image on disk
+        (void)std::remove(getFruCachePath(entry.address).c_str());
+    }
+    for (auto& entity: inventory.entities) {
+        // INP is in the form 'FRU <device> <area> <subarea>'
+        auto inp = common::split(entity.getField<std::string>("INP", ""), ' ');
+        if (inp.size() == 4)
+            inventory.fields[inp[2] + " " + inp[3]] = entity["VAL"];
+    }
+    return inventory;
 }
 
 std::string FreeIpmiProvider::getFruName(ipmi_sdr_ctx_t sdr, const FreeIpmiProvider::SdrRecord& record)
@@ -166,404 +142,535 @@ std::string FreeIpmiProvider::getFruDesc(ipmi_sdr_ctx_t sdr, const FreeIpmiProvi
     return deviceDesc;
 }
 
-std::vector<FreeIpmiProvider::Entity> FreeIpmiProvider::getFrus(ipmi_ctx_t ipmi, ipmi_sdr_ctx_t sdr, ipmi_fru_ctx_t fru)
+std::vector<FreeIpmiProvider::Entity> FreeIpmiProvider::getFrus(ipmi_ctx_t ipmi, const SdrCatalog& catalog, ScanMode mode)
 {
-    std::vector<Entity> entities;
-
-    if (ipmi_sdr_cache_first(sdr) < 0)
-        throw std::runtime_error("failed to rewind SDR cache - " + std::string(ipmi_sdr_ctx_errormsg(sdr)));
-
-    do {
-        uint8_t recordType;
-        if (ipmi_sdr_parse_record_id_and_type(sdr, NULL, 0, NULL, &recordType) < 0) {
-            LOG_DEBUG("Failed to parse SDR record type - %s, skipping", ipmi_sdr_ctx_errormsg(sdr));
-            continue;
-        }
-
-        if (recordType != IPMI_SDR_FORMAT_FRU_DEVICE_LOCATOR_RECORD)
-            continue;
-
-        SdrRecord record;
-        record.size = ipmi_sdr_cache_record_read(sdr, record.data, record.max_size);
-        if (record.size < 0) {
-            LOG_DEBUG("Failed to read SDR record - %s, skipping", ipmi_sdr_ctx_errormsg(sdr));
-            continue;
-        }
-
-        FruAddress address;
-        Entity tmpl;
-        try {
-            address = FruAddress(sdr, record);
-            tmpl["NAME"] = getFruName(sdr, record);
-            tmpl["DESC"] = getFruDesc(sdr, record);
-        } catch (std::runtime_error& e) {
-            LOG_DEBUG(std::string(e.what()) + ", skipping");
+    // FRU inventory rarely changes, METADATA mode avoids reading it again
+    std::vector<size_t> selected;
+    for (size_t i = 0; i < catalog.frus.size(); i++) {
+        auto& address = catalog.frus[i].address;
+        if (!isPresent(address.deviceAddr, address.channel, address.fruId))
             continue;
-        }
+        if (mode == ScanMode::FULL || !findFruInventory(address.getDevice()))
+            selected.push_back(i);
+    }
 
-        IpmbBridgeScoped bridge(ipmi, address.deviceAddr, address.channel);
+    // Each job only touches its own slot, cache is updated afterwards
+    std::vector<std::unique_ptr<FruInventory>> inventories(catalog.frus.size());
+    discover(ipmi, catalog, selected, "FRU", [&](ipmi_ctx_t ipmi_, size_t i) {
         try {
-            auto tmp = getFruAreas(fru, address, tmpl);
-            for (auto& e: tmp)
-                entities.emplace_back( std::move(e) );
+            inventories[i].reset(new FruInventory(readFruInventory(ipmi_, catalog, catalog.frus[i])));
         } catch (std::runtime_error& e) {
             LOG_DEBUG(std::string(e.what()) + ", skipping");
         }
+    });
 
-    } while (ipmi_sdr_cache_next(sdr) == 1);
+    std::vector<Entity> entities;
+    for (auto i: selected) {
+        if (inventories[i])
+            m_fruCache[catalog.frus[i].address.getDevice()] = std::move(*inventories[i]);
+    }
+    for (size_t i = 0; i < catalog.frus.size(); i++) {
+        bool failed = (mode == ScanMode::FULL && !inventories[i]);
+        auto inventory = findFruInventory(catalog.frus[i].address.getDevice());
+        if (inventory && !failed)
+            entities.insert(entities.end(), inventory->entities.begin(), inventory->entities.end());
+    }
 
     return entities;
 }
 
-std::map<std::pair<uint8_t,uint8_t>,std::string> FreeIpmiProvider::getFruEntityNameAssoc(ipmi_sdr_ctx_t sdr)
+/*
+ * FRU images are cached on disk and reused for as long as FRU common header
+ * on device matches the cached one and SDR did not change. That takes two
+ * short requests per FRU device instead of reading entire EEPROM.
+ */
+FreeIpmiProvider::FruImage FreeIpmiProvider::getFruImage(IpmbBridgeScoped& target, const SdrCatalog& catalog, const FruAddress& address) const
 {
-    std::map<std::pair<uint8_t,uint8_t>,std::string> names;
+    bool byWords = false;
+    size_t size = getFruInventorySize(target, address.fruId, byWords);
+    if (size < FRU_COMMON_HEADER_LENGTH)
+        throw Provider::process_error("FRU inventory area too small");
+
+    FruImage header(FRU_COMMON_HEADER_LENGTH);
+    readFruData(target, address.fruId, byWords, 0, header.data(), header.size());
+    if (!isFruHeaderValid(header.data()))
+        throw Provider::process_error("Invalid FRU common header");
+
+    auto path = getFruCachePath(address);
+
+    FruImage image;
+    if (loadFruImage(path, catalog.fingerprint, image) && std::equal(header.begin(), header.end(), image.begin()))
+        return image;
+
+    LOG_DEBUG("reading FRU image " + address.getDevice());
+    image = readFruImage(target, address.fruId, byWords, size, header);
+    saveFruImage(path, catalog.fingerprint, image);
+    return image;
+}
 
-    if (ipmi_sdr_cache_first(sdr) < 0)
-        throw std::runtime_error("failed to rewind SDR cache - " + std::string(ipmi_sdr_ctx_errormsg(sdr)));
+/*
+ * File name is derived from the same device address as in-memory cache, FRUs
+ * with same address behind different channels or transit controllers must
+ * not share the image.
+ */
+std::string FreeIpmiProvider::getFruCachePath(const FruAddress& address) const
+{
+    auto device = address.getDevice();
+    std::replace(device.begin(), device.end(), ':', '_');
+    std::replace(device.begin(), device.end(), '/', '_');
+    return m_fruCachePath + "_" + device + ".cache";
+}
 
-    do {
-        uint8_t recordType;
-        if (ipmi_sdr_parse_record_id_and_type(sdr, NULL, 0, NULL, &recordType) < 0) {
-            LOG_DEBUG("Failed to parse SDR record type - %s, skipping", ipmi_sdr_ctx_errormsg(sdr));
-            continue;
+/*
+ * Reads FRU image only up to the end of the last area, FRU EEPROMs are
+ * typically much larger than data they hold. Area layout is described in
+ * IPMI FRU spec, sections 8 to 16.
+ */
+FreeIpmiProvider::FruImage FreeIpmiProvider::readFruImage(IpmbBridgeScoped& target, uint8_t fruId, bool byWords, size_t size, const FruImage& header)
+{
+    FruImage image(header);
+
+    // Make sure image holds at least length bytes, read in whole chunks
+    auto ensure = [&](size_t length) {
+        if (length > size)
+            throw Provider::process_error("FRU area exceeds FRU inventory size");
+        if (length > image.size()) {
+            size_t offset = image.size();
+            length = std::min(size, std::max(length, offset + FRU_READ_CHUNK));
+            image.resize(length);
+            readFruData(target, fruId, byWords, offset, image.data() + offset, length - offset);
         }
+    };
 
-        if (recordType == IPMI_SDR_FORMAT_FRU_DEVICE_LOCATOR_RECORD) {
-            SdrRecord record;
-            record.size = ipmi_sdr_cache_record_read(sdr, record.data, record.max_size);
-            if (record.size < 0) {
-                LOG_DEBUG("Failed to read SDR record - %s, skipping", ipmi_sdr_ctx_errormsg(sdr));
-                continue;
-            }
-
-            uint8_t entityId;
-            uint8_t entityInstance;
-            if (ipmi_sdr_parse_fru_entity_id_and_instance(sdr, record.data, record.size, &entityId, &entityInstance) < 0) {
-                LOG_DEBUG("Failed to read SDR entity info - %s, skipping", ipmi_sdr_ctx_errormsg(sdr));
-                continue;
-            }
-
-            try {
-                auto key = std::make_pair(entityId, entityInstance);
-                names[key] = getFruName(sdr, record);
-            } catch (std::runtime_error& e) {
-                LOG_DEBUG(std::string(e.what()) + ", skipping");
-                //pass
-            }
-            continue;
-        }
-        if (recordType == IPMI_SDR_FORMAT_ENTITY_ASSOCIATION_RECORD) {
-            // TODO:
+    // Chassis, board and product info areas have their length in second byte
+    for (size_t i = 2; i <= 4; i++) {
+        if (header[i] == 0)
             continue;
+        size_t offset = header[i] * 8;
+        ensure(offset + 2);
+        ensure(offset + image[offset + 1] * 8);
+    }
+
+    // Multi records are chained, each has 5 byte header with data length in third byte
+    if (header[5] != 0) {
+        size_t offset = header[5] * 8;
+        bool last = false;
+        while (!last) {
+            ensure(offset + 5);
+            last = (image[offset + 1] & 0x80);
+            offset += 5 + image[offset + 2];
+            ensure(offset);
         }
-    } while (ipmi_sdr_cache_next(sdr) == 1);
+    }
+
+    // Internal use area has no length, it extends to the next area
+    if (header[1] != 0)
+        ensure(std::min(size, header[1] * 8 + FRU_READ_CHUNK));
 
-    return names;
+    return image;
 }
 
-std::vector<Provider::Entity> FreeIpmiProvider::getFruAreas(ipmi_fru_ctx_t fru, const FruAddress& address, const Provider::Entity& tmpl)
+/*
+ * FRU commands are sent raw so that they can be routed through transit
+ * controller, layouts are described in IPMI 2.0 spec, sections 34.1 and 34.2.
+ */
+size_t FreeIpmiProvider::getFruInventorySize(IpmbBridgeScoped& target, uint8_t fruId, bool& byWords)
 {
-    if (ipmi_fru_open_device_id(fru, address.fruId) < 0)
-        throw std::runtime_error("Failed to open FRU device - " + std::string(ipmi_fru_ctx_errormsg(fru)));
+    uint8_t rq[] = { IPMI_CMD_GET_FRU_INVENTORY_AREA_INFO, fruId };
+    uint8_t rs[16];
+    int len = target.cmdRaw(IPMI_BMC_IPMB_LUN_BMC, IPMI_NET_FN_STORAGE_RQ, rq, sizeof(rq), rs, sizeof(rs));
+    if (len < 0)
+        throw Provider::comm_error("Failed to get FRU inventory area info - " + target.errormsg());
+    if (len < 5 || rs[0] != rq[0] || rs[1] != 0)
+        throw Provider::process_error("Failed to get FRU inventory area info - invalid response");
+
+    byWords = (rs[4] & 0x1);
+    return (rs[2] | (rs[3] << 8));
+}
 
-    if (ipmi_fru_first(fru) < 0) {
-        ipmi_fru_close_device_id(fru);
-        throw std::runtime_error("Failed to rewind FRU - " + std::string(ipmi_fru_ctx_errormsg(fru)));
+void FreeIpmiProvider::readFruData(IpmbBridgeScoped& target, uint8_t fruId, bool byWords, size_t offset, uint8_t* data, size_t count)
+{
+    size_t unit = (byWords ? 2 : 1);
+    while (count > 0) {
+        size_t chunk = std::min(count, FRU_READ_CHUNK);
+        size_t unitOffset = offset / unit;
+        uint8_t rq[] = { IPMI_CMD_READ_FRU_DATA, fruId, (uint8_t)(unitOffset & 0xFF), (uint8_t)(unitOffset >> 8), (uint8_t)std::max(chunk / unit, (size_t)1) };
+        uint8_t rs[FRU_READ_CHUNK + 8];
+        int len = target.cmdRaw(IPMI_BMC_IPMB_LUN_BMC, IPMI_NET_FN_STORAGE_RQ, rq, sizeof(rq), rs, sizeof(rs));
+        if (len < 0)
+            throw Provider::comm_error("Failed to read FRU data - " + target.errormsg());
+        if (len < 3 || rs[0] != rq[0] || rs[1] != 0)
+            throw Provider::process_error("Failed to read FRU data - invalid response");
+
+        // Count returned is in bytes, data follows
+        size_t n = std::min<size_t>({ (size_t)rs[2], (size_t)len - 3, count });
+        if (n == 0)
+            throw Provider::process_error("Failed to read FRU data - no data returned");
+
+        memcpy(data, rs + 3, n);
+        data   += n;
+        offset += n;
+        count  -= n;
     }
+}
 
-    std::vector<Entity> entities;
-    do {
-        unsigned int areaType = 0;
-        FruArea buffer;
-
-        if (ipmi_fru_read_data_area(fru, &areaType, &buffer.size, buffer.data, buffer.max_size-1) < 0) {
-            // Silently? skip it
-            continue;
-        }
-
-        if (buffer.size == 0)
-            continue;
+bool FreeIpmiProvider::loadFruImage(const std::string& path, uint32_t fingerprint, FruImage& image)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file.good())
+        return false;
 
-        try {
-            std::vector<Entity> tmp;
-            switch (areaType) {
-            case IPMI_FRU_AREA_TYPE_CHASSIS_INFO_AREA:
-                tmp = getFruChassis(fru, address, tmpl, buffer);
-                break;
-            case IPMI_FRU_AREA_TYPE_BOARD_INFO_AREA:
-                tmp = getFruBoard(fru, address, tmpl, buffer);
-                break;
-            case IPMI_FRU_AREA_TYPE_PRODUCT_INFO_AREA:
-                tmp = getFruProduct(fru, address, tmpl, buffer);
-                break;
-            case IPMI_FRU_AREA_TYPE_MULTIRECORD_POWER_SUPPLY_INFORMATION:
-                break;
-            case IPMI_FRU_AREA_TYPE_MULTIRECORD_DC_OUTPUT:
-                break;
-            case IPMI_FRU_AREA_TYPE_MULTIRECORD_DC_LOAD:
-            case IPMI_FRU_AREA_TYPE_MULTIRECORD_EXTENDED_DC_LOAD:
-                break;
-            case IPMI_FRU_AREA_TYPE_MULTIRECORD_MANAGEMENT_ACCESS_RECORD:
-                break;
-            case IPMI_FRU_AREA_TYPE_MULTIRECORD_BASE_COMPATABILITY_RECORD:
-                break;
-            case IPMI_FRU_AREA_TYPE_MULTIRECORD_EXTENDED_COMPATABILITY_RECORD:
-                break;
-            case IPMI_FRU_AREA_TYPE_MULTIRECORD_OEM:
-                break;
-            default:
-                break;
-            }
+    char magic[4];
+    uint32_t fingerprint_;
+    file.read(magic, sizeof(magic));
+    file.read(reinterpret_cast<char*>(&fingerprint_), sizeof(fingerprint_));
+    if (!file.good() || memcmp(magic, "EFRU", sizeof(magic)) != 0)
+        return false;
+    if (fingerprint_ != fingerprint) {
+        LOG_DEBUG("SDR changed, ignoring FRU cache file " + path);
+        return false;
+    }
 
-            for (const auto& e: tmp)
-                entities.emplace_back( std::move(e) );
+    image.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    return (image.size() >= FRU_COMMON_HEADER_LENGTH && isFruHeaderValid(image.data()));
+}
 
-        } catch (std::runtime_error e) {
-            LOG_DEBUG(std::string(e.what()) + ", skipping");
+void FreeIpmiProvider::saveFruImage(const std::string& path, uint32_t fingerprint, const FruImage& image)
+{
+    // Write to temporary file first so that readers never see partial file
+    auto tmpPath = path + ".tmp";
+    {
+        std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+        file.write("EFRU", 4);
+        file.write(reinterpret_cast<const char*>(&fingerprint), sizeof(fingerprint));
+        file.write(reinterpret_cast<const char*>(image.data()), image.size());
+        if (!file.good()) {
+            LOG_WARN("failed to write FRU cache file " + tmpPath);
+            return;
         }
+    }
+    if (std::rename(tmpPath.c_str(), path.c_str()) != 0)
+        LOG_WARN("failed to write FRU cache file %s - %s", path.c_str(), strerror(errno));
+}
 
-    } while (ipmi_fru_next(fru) == 1);
-
-    ipmi_fru_close_device_id(fru);
+std::vector<Provider::Entity> FreeIpmiProvider::getFruAreas(const FruAddress& address, const Provider::Entity& tmpl, const FruImage& image, bool& complete)
+{
+    auto view = decodeFruImage(image);
+    complete = view.complete;
 
+    std::vector<Entity> entities;
+    for (auto& area: view.areas) {
+        auto tmp = getFruInfoArea(area, address, tmpl);
+        entities.insert(entities.end(), tmp.begin(), tmp.end());
+    }
+    for (auto& record: view.records) {
+        auto tmp = getFruRecord(record, address, tmpl);
+        entities.insert(entities.end(), tmp.begin(), tmp.end());
+    }
     return entities;
 }
 
-std::string FreeIpmiProvider::getFruField(ipmi_fru_ctx_t fru, const ipmi_fru_field_t& field, uint8_t languageCode)
+/*
+ * Type/length byte encoding is described in FRU spec section 13.
+ */
+std::string FreeIpmiProvider::FruView::Field::decode() const
 {
-    char strbuf[IPMI_FRU_AREA_STRING_MAX + 1] = {0};
-    unsigned int strbuflen = IPMI_FRU_AREA_STRING_MAX;
-
-    if (!field.type_length_field_length)
-        return "";
-
-    if (ipmi_fru_type_length_field_to_string(fru,
-                                             field.type_length_field,
-                                             field.type_length_field_length,
-                                             languageCode,
-                                             strbuf,
-                                             &strbuflen) < 0)
-        return "";
+    static const char bcdPlus[] = "0123456789 -.???";
+
+    size_t length = (typeLength & 0x3F);
+    std::string str;
+    switch (typeLength >> 6) {
+    case 0: // binary
+        for (size_t i = 0; i < length; i++) {
+            char buf[4];
+            snprintf(buf, sizeof(buf), (i == 0 ? "%02X" : " %02X"), data[i]);
+            str += buf;
+        }
+        break;
+    case 1: // BCD plus
+        for (size_t i = 0; i < length; i++) {
+            str += bcdPlus[data[i] >> 4];
+            str += bcdPlus[data[i] & 0xF];
+        }
+        break;
+    case 2: // 6-bit ASCII, packed LSB first
+        for (size_t bit = 0; bit + 6 <= length * 8; bit += 6) {
+            unsigned value = (data[bit / 8] >> (bit % 8));
+            if ((bit % 8) > 2)
+                value |= (data[bit / 8 + 1] << (8 - bit % 8));
+            str += (char)((value & 0x3F) + 0x20);
+        }
+        break;
+    default: // 8-bit ASCII + Latin 1, Unicode languages not supported
+        str.assign(reinterpret_cast<const char*>(data), length);
+        break;
+    }
 
-    return std::string(strbuf);
+    // Fields are often padded
+    while (!str.empty() && (str.back() == ' ' || str.back() == '\0'))
+        str.pop_back();
+    return str;
 }
 
-std::vector<Provider::Entity> FreeIpmiProvider::getFruChassis(ipmi_fru_ctx_t fru, const FruAddress& address, const Entity& tmpl, const FruArea& fruArea)
+FreeIpmiProvider::FruView FreeIpmiProvider::decodeFruImage(const FruImage& image)
 {
-    static const size_t IPMI_FRU_CUSTOM_FIELDS = 64;
+    static const size_t FRU_MULTIRECORD_HEADER_LENGTH = 5;
+    static const std::vector<std::vector<std::string>> infoFields = {
+        { "PartNum", "SerialNum" },
+        { "Manufacturer", "Product", "SerialNum", "PartNum", "FileId" },
+        { "Manufacturer", "Product", "Model", "Version", "SerialNum", "AssetTag", "FileId" },
+    };
+    static const std::vector<std::vector<std::string>> infoNames = {
+        { "CHASSIS", "Chas",  "Chassis" },
+        { "BOARD",   "Board", "Board" },
+        { "PRODUCT", "Prod",  "Product" },
+    };
 
-    std::vector<Entity> entities;
+    if (image.size() < FRU_COMMON_HEADER_LENGTH || !isFruHeaderValid(image.data()))
+        throw Provider::process_error("Invalid FRU common header");
 
-    std::list<std::string> subareas = { "Type", "PartNum", "SerialNum" };
-    for (size_t i = 0; i < IPMI_FRU_CUSTOM_FIELDS; i++) {
-        subareas.emplace_back( "Field" + std::to_string(i) );
-    }
+    auto checksum = [&](size_t offset, size_t length) {
+        uint8_t sum = 0;
+        for (size_t i = offset; i < offset + length; i++)
+            sum += image[i];
+        return sum;
+    };
 
-    // We'll modify subarea in each iteration, but we only need it for the address string
-    FruAddress addr = address;
-    addr.area = "CHASSIS";
+    FruView view;
 
-    // Yes this is not the most efficient way of doing it,
-    // but getFruChassis() is invoked rarely so we trade performance for cleaner code.
-    for (auto& subarea: subareas) {
-        try {
-            auto SUBAREA = common::to_upper(subarea);
-            auto value = getFruChassisSubarea(fru, fruArea, SUBAREA);
-            if (!value.empty()) {
-                addr.subarea = SUBAREA;
-
-                Entity entity = tmpl;
-                entity["VAL"] = value;
-                entity["NAME"] = tmpl.getField<std::string>("NAME", "") + ":Chas:" + subarea;
-                entity["DESC"] = tmpl.getField<std::string>("DESC", "") + " Chassis " + subarea;
-                entity["INP"] = "FRU " + addr.get();
-                entities.emplace_back( std::move(entity) );
-            }
-        } catch (...) {
-            // pass
+    // Chassis, board and product info areas, header bytes 2 to 4
+    for (size_t i = 0; i < 3; i++) {
+        size_t offset = image[i + 2] * 8;
+        if (offset == 0)
+            continue;
+        if (offset + 2 > image.size() || offset + image[offset + 1] * 8 > image.size() || image[offset + 1] == 0) {
+            LOG_DEBUG("FRU " + infoNames[i][0] + " area exceeds FRU image, skipping");
+            view.complete = false;
+            continue;
+        }
+        size_t length = image[offset + 1] * 8;
+        if (checksum(offset, length) != 0) {
+            LOG_DEBUG("Invalid FRU " + infoNames[i][0] + " area checksum, skipping");
+            view.complete = false;
+            continue;
         }
+
+        FruView::InfoArea area;
+        area.name = infoNames[i][0];
+        area.label = infoNames[i][1];
+        area.desc = infoNames[i][2];
+
+        // Fixed fields before variable ones
+        size_t pos = offset + 2;
+        if (i == 0) {
+            area.chassisType = image[pos];
+            pos += 1;
+        } else if (i == 1) {
+            area.mfgTime = image[pos + 1] | (image[pos + 2] << 8) | (image[pos + 3] << 16);
+            pos += 4;
+        } else {
+            pos += 1;
+        }
+
+        // Variable length fields until end marker, predefined ones first
+        size_t end = offset + length - 1;
+        size_t custom = 0;
+        while (pos < end && image[pos] != 0xC1) {
+            FruView::Field field;
+            field.typeLength = image[pos];
+            field.data = &image[pos + 1];
+            pos += 1 + (field.typeLength & 0x3F);
+            if (pos > end)
+                break;
+
+            size_t n = area.fields.size();
+            auto& names = infoFields[i];
+            auto name = (n < names.size() ? names[n] : "Field" + std::to_string(custom++));
+            area.fields.emplace_back(name, field);
+        }
+        view.areas.emplace_back(std::move(area));
     }
-    return entities;
-}
 
-std::string FreeIpmiProvider::getFruChassisSubarea(ipmi_fru_ctx_t fru, const FruArea& area, const std::string& subarea)
-{
-    static const size_t IPMI_FRU_CUSTOM_FIELDS = 64;
-    uint8_t type;
-    ipmi_fru_field_t partNum;
-    ipmi_fru_field_t serialNum;
-    ipmi_fru_field_t customFields[IPMI_FRU_CUSTOM_FIELDS];
+    // Multi record area, chained records until end of list flag
+    size_t offset = image[5] * 8;
+    bool last = (offset == 0);
+    while (!last) {
+        if (offset + FRU_MULTIRECORD_HEADER_LENGTH > image.size() || checksum(offset, FRU_MULTIRECORD_HEADER_LENGTH) != 0) {
+            LOG_DEBUG("Invalid FRU multi record header, skipping the rest");
+            view.complete = false;
+            break;
+        }
 
-    if (ipmi_fru_chassis_info_area(fru, area.data, area.size, &type, &partNum, &serialNum, customFields, IPMI_FRU_CUSTOM_FIELDS) < 0)
-        throw Provider::process_error("Failed to parse FRU chassis info - " + std::string(ipmi_fru_ctx_errormsg(fru)));
-    if (!IPMI_FRU_CHASSIS_TYPE_VALID(type))
-        type = IPMI_FRU_CHASSIS_TYPE_UNKNOWN;
+        FruView::Record record;
+        record.type   = image[offset];
+        record.length = image[offset + 2];
+        last = (image[offset + 1] & 0x80);
+        offset += FRU_MULTIRECORD_HEADER_LENGTH;
+        if (offset + record.length > image.size()) {
+            LOG_DEBUG("FRU multi record exceeds FRU image, skipping the rest");
+            view.complete = false;
+            break;
+        }
 
-    Entity entity;
-    if (subarea == "TYPE")      return ipmi_fru_chassis_types[type];
-    if (subarea == "PARTNUM")   return getFruField(fru, partNum,   IPMI_FRU_LANGUAGE_CODE_ENGLISH);
-    if (subarea == "SERIALNUM") return getFruField(fru, serialNum, IPMI_FRU_LANGUAGE_CODE_ENGLISH);
-    if (subarea.find("FIELD") == 0) {
-        std::string tmp = subarea;
-        tmp.erase(0, 5);
-        size_t i = std::stol(tmp);
-        if (i < IPMI_FRU_CUSTOM_FIELDS)
-            return getFruField(fru, customFields[i], IPMI_FRU_LANGUAGE_CODE_ENGLISH);
+        record.data = &image[offset];
+        if (((checksum(offset, record.length) + image[offset - 2]) & 0xFF) == 0) {
+            view.records.emplace_back(record);
+        } else {
+            LOG_DEBUG("Invalid FRU multi record checksum, skipping");
+            view.complete = false;
+        }
+        offset += record.length;
     }
-    throw Provider::syntax_error("Invalid FRU chassis area " + subarea);
+
+    return view;
 }
 
-std::vector<Provider::Entity> FreeIpmiProvider::getFruBoard(ipmi_fru_ctx_t fru, const FruAddress& address, const Entity& tmpl, const FruArea& fruArea)
+std::vector<Provider::Entity> FreeIpmiProvider::getFruInfoArea(const FruView::InfoArea& area, const FruAddress& address, const Entity& tmpl)
 {
-    static const size_t IPMI_FRU_CUSTOM_FIELDS = 64;
-
     std::vector<Entity> entities;
+    FruAddress addr = address;
+    addr.area = area.name;
+
+    auto add = [&](const std::string& subarea, const std::string& value) {
+        if (value.empty())
+            return;
+        addr.subarea = common::to_upper(subarea);
+
+        Entity entity = tmpl;
+        entity["VAL"] = value;
+        entity["NAME"] = tmpl.getField<std::string>("NAME", "") + ":" + area.label + ":" + subarea;
+        entity["DESC"] = tmpl.getField<std::string>("DESC", "") + " " + area.desc + " " + subarea;
+        entity["INP"] = "FRU " + addr.get();
+        entities.emplace_back( std::move(entity) );
+    };
 
-    std::list<std::string> subareas = { "DateTime", "Manufacturer", "Product", "PartNum", "SerialNum", "FileId" };
-    for (size_t i = 0; i < IPMI_FRU_CUSTOM_FIELDS; i++) {
-        subareas.emplace_back( "Field" + std::to_string(i) );
+    if (area.chassisType >= 0) {
+        uint8_t type = area.chassisType;
+        if (!IPMI_FRU_CHASSIS_TYPE_VALID(type))
+            type = IPMI_FRU_CHASSIS_TYPE_UNKNOWN;
+        add("Type", ipmi_fru_chassis_types[type]);
     }
 
-    // We'll modify subarea in each iteration, but we only need it for the address string
-    FruAddress addr = address;
-    addr.area = "BOARD";
-
-    // Yes this is not the most efficient way of doing it,
-    // but getFruChassis() is invoked rarely so we trade performance for cleaner code.
-    for (auto& subarea: subareas) {
-        try {
-            auto SUBAREA = common::to_upper(subarea);
-            auto value = getFruBoardSubarea(fru, fruArea, SUBAREA);
-            if (!value.empty()) {
-                addr.subarea = SUBAREA;
-
-                Entity entity = tmpl;
-                entity["VAL"] = value;
-                entity["NAME"] = tmpl.getField<std::string>("NAME", "") +  + ":Board:" + subarea;
-                entity["DESC"] = tmpl.getField<std::string>("DESC", "") +  + " Board " + subarea;
-                entity["INP"] = "FRU " + addr.get();
-                entities.emplace_back( std::move(entity) );
-            }
-        } catch (...) {
-            // pass
+    if (area.mfgTime >= 0) {
+        // Board manufacturing time is in minutes since 1996-01-01 00:00 UTC
+        static const uint32_t FRU_MFG_TIME_EPOCH = 820454400;
+        if (area.mfgTime == 0) {
+            add("DateTime", "unspecified");
+        } else {
+            char buf[64] = { 0 };
+            int flags = IPMI_TIMESTAMP_FLAG_UTC_TO_LOCALTIME | IPMI_TIMESTAMP_FLAG_DEFAULT;
+            if (ipmi_timestamp_string(FRU_MFG_TIME_EPOCH + area.mfgTime * 60, common::getUtcOffset(), flags, "%D - %T", buf, sizeof(buf)-1) < 0)
+                add("DateTime", "invalid");
+            else
+                add("DateTime", buf);
         }
     }
+
+    for (auto& field: area.fields)
+        add(field.first, field.second.decode());
+
     return entities;
 }
 
-std::string FreeIpmiProvider::getFruBoardSubarea(ipmi_fru_ctx_t fru, const FruArea& area, const std::string& subarea)
+/*
+ * Multi record formats are described in FRU spec section 18.
+ */
+std::vector<Provider::Entity> FreeIpmiProvider::getFruRecord(const FruView::Record& record, const FruAddress& address, const Entity& tmpl)
 {
-    static const size_t IPMI_FRU_CUSTOM_FIELDS = 64;
-    static const size_t IPMI_FRU_BOARD_STR_BUFLEN = 1024;
-
-    uint8_t langCode;
-    uint32_t dateTime;
-    ipmi_fru_field_t manufacturer;
-    ipmi_fru_field_t product;
-    ipmi_fru_field_t serialNum;
-    ipmi_fru_field_t partNum;
-    ipmi_fru_field_t fruFileId;
-    ipmi_fru_field_t customFields[IPMI_FRU_CUSTOM_FIELDS];
-
-    if (ipmi_fru_board_info_area(fru, area.data, area.size, &langCode, &dateTime, &manufacturer, &product, &serialNum, &partNum, &fruFileId, customFields, IPMI_FRU_CUSTOM_FIELDS) < 0)
-        throw Provider::process_error("Failed to parse FRU chassis info - " + std::string(ipmi_fru_ctx_errormsg(fru)));
-
-    if (subarea == "MANUFACTURER") return getFruField(fru, manufacturer, langCode);
-    if (subarea == "PRODUCT")      return getFruField(fru, product,      langCode);
-    if (subarea == "SERIALNUM")    return getFruField(fru, serialNum,    langCode);
-    if (subarea == "PARTNUM")      return getFruField(fru, partNum,      langCode);
-    if (subarea == "FILEID")       return getFruField(fru, fruFileId,    langCode);
-    if (subarea == "DATETIME") {
-        char buf[IPMI_FRU_BOARD_STR_BUFLEN + 1] = { 0 };
-        int flags = IPMI_TIMESTAMP_FLAG_UTC_TO_LOCALTIME | IPMI_TIMESTAMP_FLAG_DEFAULT;
-        if (dateTime != IPMI_FRU_MFG_DATE_TIME_UNSPECIFIED)
-            return "unspecified";
-        if (ipmi_timestamp_string(dateTime, common::getUtcOffset(), flags, "%D - %T", buf, sizeof(buf)-1) < 0)
-            return "invalid";
-        return buf;
-    }
-    if (subarea.find("FIELD") == 0) {
-        std::string tmp = subarea;
-        tmp.erase(0, 5);
-        size_t i = std::stol(tmp);
-        if (i < IPMI_FRU_CUSTOM_FIELDS)
-            return getFruField(fru, customFields[i], langCode);
-    }
-    throw Provider::syntax_error("Invalid FRU board area " + subarea);
-}
+    static const uint8_t FRU_RECORD_POWER_SUPPLY_INFORMATION = 0x00;
+    static const uint8_t FRU_RECORD_DC_OUTPUT                = 0x01;
+    static const uint8_t FRU_RECORD_DC_LOAD                  = 0x02;
+    static const uint8_t FRU_RECORD_MANAGEMENT_ACCESS        = 0x03;
 
-std::vector<Provider::Entity> FreeIpmiProvider::getFruProduct(ipmi_fru_ctx_t fru, const FruAddress& address, const Entity& tmpl, const FruArea& fruArea)
-{
-    static const size_t IPMI_FRU_CUSTOM_FIELDS = 64;
+    const uint8_t* d = record.data;
+    auto u16 = [&](size_t i) { return (unsigned)(d[i] | (d[i+1] << 8)); };
+    auto s16 = [&](size_t i) { return (int)(int16_t)(d[i] | (d[i+1] << 8)); };
 
     std::vector<Entity> entities;
-
-    std::list<std::string> subareas = { "Manufacturer", "Product", "Model", "Version", "AssetTag", "SerialNum", "FileId" };
-    for (size_t i = 0; i < IPMI_FRU_CUSTOM_FIELDS; i++) {
-        subareas.emplace_back( "Field" + std::to_string(i) );
-    }
-
-    // We'll modify subarea in each iteration, but we only need it for the address string
     FruAddress addr = address;
-    addr.area = "PRODUCT";
+    std::string label;
+
+    auto entity = [&](const std::string& subarea, const std::string& desc) {
+        addr.subarea = common::to_upper(subarea);
+        Entity e = tmpl;
+        e["NAME"] = tmpl.getField<std::string>("NAME", "") + ":" + label + ":" + subarea;
+        e["DESC"] = tmpl.getField<std::string>("DESC", "") + " " + desc;
+        e["INP"] = "FRU " + addr.get();
+        return e;
+    };
+    auto add = [&](const std::string& subarea, const std::string& desc, double value, const std::string& egu, int prec) {
+        Entity e = entity(subarea, desc);
+        e["VAL"] = value;
+        e["EGU"] = egu;
+        e["PREC"] = prec;
+        entities.emplace_back( std::move(e) );
+    };
 
-    // Yes this is not the most efficient way of doing it,
-    // but getFruChassis() is invoked rarely so we trade performance for cleaner code.
-    for (auto& subarea: subareas) {
-        try {
-            auto SUBAREA = common::to_upper(subarea);
-            auto value = getFruProductSubarea(fru, fruArea, SUBAREA);
-            if (!value.empty()) {
-                addr.subarea = SUBAREA;
-
-                Entity entity = tmpl;
-                entity["VAL"] = value;
-                entity["NAME"] = tmpl.getField<std::string>("NAME", "") +  + ":Prod:" + subarea;
-                entity["DESC"] = tmpl.getField<std::string>("DESC", "") +  + " Product " + subarea;
-                entity["INP"] = "FRU " + addr.get();
-                entities.emplace_back( std::move(entity) );
-            }
-        } catch (...) {
-            // pass
+    if (record.type == FRU_RECORD_POWER_SUPPLY_INFORMATION && record.length >= 24) {
+        addr.area = "PSU";
+        label = "PSU";
+        add("Capacity",       "PSU capacity",          u16(0) & 0x0FFF,   "W",  0);
+        if (u16(2) != 0xFFFF)
+            add("PeakVA",     "PSU peak VA",           u16(2),            "VA", 0);
+        if (d[4] != 0xFF)
+            add("InrushCurrent", "PSU inrush current", d[4],              "A",  0);
+        if (d[5] != 0xFF)
+            add("InrushTime", "PSU inrush interval",   d[5],              "ms", 0);
+        add("InVoltLow1",     "PSU input low 1",       u16(6) * 0.01,     "V",  2);
+        add("InVoltHigh1",    "PSU input high 1",      u16(8) * 0.01,     "V",  2);
+        if (u16(10) != 0 || u16(12) != 0) {
+            add("InVoltLow2", "PSU input low 2",       u16(10) * 0.01,    "V",  2);
+            add("InVoltHigh2","PSU input high 2",      u16(12) * 0.01,    "V",  2);
+        }
+        add("InFreqLow",      "PSU input freq low",    d[14],             "Hz", 0);
+        add("InFreqHigh",     "PSU input freq high",   d[15],             "Hz", 0);
+        add("DropoutTime",    "PSU A/C dropout tol",   d[16],             "ms", 0);
+        if (u16(18) != 0xFFFF) {
+            add("PeakWattage","PSU peak wattage",      u16(18) & 0x0FFF,  "W",  0);
+            add("HoldupTime", "PSU peak holdup time",  u16(18) >> 12,     "s",  0);
         }
 
+    } else if (record.type == FRU_RECORD_DC_OUTPUT && record.length >= 13) {
+        auto output = std::to_string(d[0] & 0x0F);
+        addr.area = "DCOUT" + output;
+        label = "DcOut" + output;
+        add("NomVolt",        "DC out " + output + " nominal",   s16(1) * 0.01,  "V",  2);
+        add("MaxNegDev",      "DC out " + output + " max -dev",  s16(3) * 0.01,  "V",  2);
+        add("MaxPosDev",      "DC out " + output + " max +dev",  s16(5) * 0.01,  "V",  2);
+        add("Ripple",         "DC out " + output + " ripple",    u16(7),         "mV", 0);
+        add("MinCurrent",     "DC out " + output + " min curr",  u16(9) * 0.001, "A",  3);
+        add("MaxCurrent",     "DC out " + output + " max curr",  u16(11) * 0.001,"A",  3);
+
+    } else if (record.type == FRU_RECORD_DC_LOAD && record.length >= 13) {
+        auto output = std::to_string(d[0] & 0x0F);
+        addr.area = "DCLOAD" + output;
+        label = "DcLoad" + output;
+        add("NomVolt",        "DC load " + output + " nominal",  s16(1) * 0.01,  "V",  2);
+        add("MinVolt",        "DC load " + output + " min volt", s16(3) * 0.01,  "V",  2);
+        add("MaxVolt",        "DC load " + output + " max volt", s16(5) * 0.01,  "V",  2);
+        add("Ripple",         "DC load " + output + " ripple",   u16(7),         "mV", 0);
+        add("MinCurrent",     "DC load " + output + " min curr", u16(9) * 0.001, "A",  3);
+        add("MaxCurrent",     "DC load " + output + " max curr", u16(11) * 0.001,"A",  3);
+
+    } else if (record.type == FRU_RECORD_MANAGEMENT_ACCESS && record.length >= 2) {
+        static const std::vector<std::string> subareas = {
+            "", "SysUrl", "SysName", "SysPing", "CompUrl", "CompName", "CompPing", "SysUuid"
+        };
+        if (d[0] == 0 || d[0] >= subareas.size())
+            return entities;
+
+        addr.area = "MGMT";
+        label = "Mgmt";
+        FruView::Field field;
+        field.data = &d[1];
+        field.typeLength = (d[0] == 7 ? 0x00 : 0xC0) | std::min<uint8_t>(record.length - 1, 0x3F);
+
+        Entity e = entity(subareas[d[0]], "Mgmt " + subareas[d[0]]);
+        e["VAL"] = field.decode();
+        entities.emplace_back( std::move(e) );
     }
-    return entities;
-}
 
-std::string FreeIpmiProvider::getFruProductSubarea(ipmi_fru_ctx_t fru, const FruArea& area, const std::string& subarea)
-{
-    static const size_t IPMI_FRU_CUSTOM_FIELDS = 64;
-
-    uint8_t langCode;
-    ipmi_fru_field_t manufacturer;
-    ipmi_fru_field_t product;
-    ipmi_fru_field_t model;
-    ipmi_fru_field_t version;
-    ipmi_fru_field_t serialNum;
-    ipmi_fru_field_t assetTag;
-    ipmi_fru_field_t fruFileId;
-    ipmi_fru_field_t customFields[IPMI_FRU_CUSTOM_FIELDS];
-
-    if (ipmi_fru_product_info_area(fru, area.data, area.size, &langCode, &manufacturer, &product, &model, &version, &serialNum, &assetTag, &fruFileId, customFields, IPMI_FRU_CUSTOM_FIELDS) < 0)
-        throw Provider::process_error("Failed to parse FRU chassis info - " + std::string(ipmi_fru_ctx_errormsg(fru)));
-
-    if (subarea == "MANUFACTURER") return getFruField(fru, manufacturer, langCode);
-    if (subarea == "PRODUCT")      return getFruField(fru, product,      langCode);
-    if (subarea == "MODEL")        return getFruField(fru, model,        langCode);
-    if (subarea == "VERSION")      return getFruField(fru, version,      langCode);
-    if (subarea == "SERIALNUM")    return getFruField(fru, serialNum,    langCode);
-    if (subarea == "ASSETTAG")     return getFruField(fru, assetTag,     langCode);
-    if (subarea == "FILEID")       return getFruField(fru, fruFileId,    langCode);
-    if (subarea.find("FIELD") == 0) {
-        std::string tmp = subarea;
-        tmp.erase(0, 5);
-        size_t i = std::stol(tmp);
-        if (i < IPMI_FRU_CUSTOM_FIELDS)
-            return getFruField(fru, customFields[i], langCode);
-    }
-    throw Provider::syntax_error("Invalid FRU product area " + subarea);
+    return entities;
 }
 
 bool FreeIpmiProvider::isFruLogical(ipmi_sdr_ctx_t sdr, const SdrRecord& record)
@@ -603,16 +710,26 @@ bool FreeIpmiProvider::isFruLogical(ipmi_sdr_ctx_t sdr, const SdrRecord& record)
  * ===== FruAddress implementation =====
  *
  * EPICS record link specification for FRU entities
- * @ipmi <conn> FRU <device_addr>:<device_id>:<lun>:<channel> <area> <subarea>
+ * @ipmi <conn> FRU [<transit addr>:<transit channel>/]<device_addr>:<device_id>:<lun>:<channel> <area> <subarea>
+ * @ipmi <conn> FRU <site>:<device_id>:<lun> <area> <subarea>
  * Example:
  * @ipmi IPMI1 FRU 32:12:1:7 CHASSIS SERIALNUM
+ * @ipmi IPMI1 FRU 130:0/114:0:0:7 BOARD SERIALNUM
+ * @ipmi IPMI1 FRU slot4:0:0 BOARD SERIALNUM
  */
 FreeIpmiProvider::FruAddress::FruAddress(const std::string& address)
 {
-    auto sections = common::split(address, ' ', 3);
+    auto sections = common::split(route.parse(address), ' ', 3);
     if (sections.size() != 3)
         throw Provider::syntax_error("Invalid FRU address");
     auto addrspec = common::split(sections[0], ':');
+    // Site replaces device address and channel, they're resolved through topology
+    if (!addrspec.empty() && !addrspec[0].empty() && std::isalpha(addrspec[0][0])) {
+        if (addrspec.size() != 3 || route.isTransit())
+            throw Provider::syntax_error("Invalid FRU address");
+        site = addrspec[0];
+        addrspec = { "0", addrspec[1], addrspec[2], "0" };
+    }
     if (addrspec.size() != 4)
         throw Provider::syntax_error("Invalid FRU address");
 
@@ -649,16 +766,23 @@ FreeIpmiProvider::FruAddress::FruAddress(ipmi_sdr_ctx_t sdr, const SdrRecord& re
 
 std::string FreeIpmiProvider::FruAddress::get() const
 {
-    std::string addrspec;
+    return getDevice() + " " + area + " " + subarea;
+}
+
+std::string FreeIpmiProvider::FruAddress::getDevice() const
+{
+    std::string addrspec = route.get();
     addrspec += std::to_string(deviceAddr) + ":";
     addrspec += std::to_string(fruId) + ":";
     addrspec += std::to_string(lun) + ":";
     addrspec += std::to_string(channel);
-    return addrspec + " " + area + " " + subarea;
+    return addrspec;
 }
 
 bool FreeIpmiProvider::FruAddress::compare(const FruAddress& other, bool checkArea, bool checkSubarea) const
 {
+    if (!(route == other.route))
+        return false;
     if (deviceAddr != other.deviceAddr)
         return false;
     if (fruId != other.fruId)
@@ -0,0 +1,243 @@
+/* ipmihotswap.cpp
+ *
+ * Copyright (c) 2026 Oak Ridge National Laboratory.
+ * All rights reserved.
+ * See file LICENSE that is included with this distribution.
+ *
+ * @author agent
+ * @date Oct 2026
+ */
+
+#include "freeipmiprovider.h"
+
+#include <cstdio>
+#include <set>
+
+/*
+ * PICMG hot-swap sensor reports FRU operational state as discrete reading,
+ * state bit N set means FRU is in state MN. States are described in
+ * PICMG 3.0 specification, section 3.2.4.
+ */
+enum {
+    HOTSWAP_M0_NOT_INSTALLED    = 0,
+    HOTSWAP_M4_ACTIVE           = 4,
+    HOTSWAP_M7_COMM_LOST        = 7,
+};
+
+/*
+ * Opening SDR cache compares SDR repository addition and erase timestamps
+ * with the cached ones and only reads repository again when they changed.
+ * New cache is opened in its own context and only replaces the current one
+ * once it's ready, current one stays usable when anything fails.
+ * Records of FRU devices whose locators did not change are kept.
+ */
+void FreeIpmiProvider::refreshSdr()
+{
+    ipmi_sdr_ctx_t sdr = ipmi_sdr_ctx_create();
+    if (!sdr)
+        throw std::runtime_error("can't create IPMI SDR context");
+
+    SdrCatalog catalog;
+    try {
+        if (!openSdrCache(sdr)) {
+            (void)ipmi_sdr_cache_close(sdr);
+            ipmi_sdr_ctx_destroy(sdr);
+            return;
+        }
+        buildSdrCatalog(sdr, catalog);
+    } catch (...) {
+        (void)ipmi_sdr_cache_close(sdr);
+        ipmi_sdr_ctx_destroy(sdr);
+        throw;
+    }
+
+    std::swap(m_ctx.sdr, sdr);
+    (void)ipmi_sdr_cache_close(sdr);
+    ipmi_sdr_ctx_destroy(sdr);
+
+    if (catalog.fingerprint == m_sdrCatalog.fingerprint)
+        return;
+
+    auto getTargets = [](const SdrCatalog& catalog_) {
+        static const size_t MC_LOCATOR_RECORD_LENGTH = 16;
+        std::set<FruTarget> targets;
+        for (auto& record: catalog_.controllers) {
+            if (record.size >= MC_LOCATOR_RECORD_LENGTH)
+                targets.emplace(record.data[5] & 0xFE, record.data[6] & 0x0F, 0);
+        }
+        for (auto& fru: catalog_.frus)
+            targets.emplace(fru.address.deviceAddr, fru.address.channel, fru.address.fruId);
+        return targets;
+    };
+    auto before = getTargets(m_sdrCatalog);
+    auto after = getTargets(catalog);
+
+    for (auto& target: before) {
+        if (after.find(target) == after.end()) {
+            LOG_INFO("FRU %u:%u on channel %u removed from SDR", std::get<0>(target), std::get<2>(target), std::get<1>(target));
+            m_hotswapStates[target] = HOTSWAP_M0_NOT_INSTALLED;
+            invalidateFruTarget(m_sdrCatalog, target, true);
+        }
+    }
+    for (auto& target: after) {
+        if (before.find(target) == before.end()) {
+            LOG_INFO("FRU %u:%u on channel %u added to SDR", std::get<0>(target), std::get<2>(target), std::get<1>(target));
+            // Hot-swap sensor will tell the actual state if there is one
+            auto state = m_hotswapStates.find(target);
+            if (state != m_hotswapStates.end() && state->second == HOTSWAP_M0_NOT_INSTALLED)
+                m_hotswapStates.erase(state);
+            invalidateFruTarget(catalog, target, true);
+        }
+    }
+
+    // Same FRU device with different locator, ie. replaced with other module type
+    for (auto& fru: m_sdrCatalog.frus) {
+        auto it = catalog.fruIndex.find(fru.address.getDevice());
+        if (it == catalog.fruIndex.end())
+            continue;
+        auto& record = catalog.frus[it->second].record;
+        if (record.size != fru.record.size || !std::equal(record.data, record.data + record.size, fru.record.data))
+            invalidateFruTarget(catalog, FruTarget(fru.address.deviceAddr, fru.address.channel, fru.address.fruId), true);
+    }
+
+    LOG_INFO("SDR changed, now %zu sensors and %zu FRU devices", catalog.sensors.size(), catalog.frus.size());
+    m_sdrCatalog = std::move(catalog);
+}
+
+/*
+ * API lock is taken for one sensor at a time, reads don't wait for all
+ * hot-swap sensors to be checked. Catalog may be rebuilt by a reconnect
+ * in between, index is checked against it every time.
+ */
+void FreeIpmiProvider::updateHotSwapStates()
+{
+    for (size_t i = 0; ; i++) {
+        common::ScopedLock lock(m_apiMutex);
+        if (!m_connected || i >= m_sdrCatalog.hotswap.size())
+            return;
+
+        auto& catalog = m_sdrCatalog;
+        auto& hotswap = catalog.hotswap[i];
+        auto& sensor = catalog.sensors[hotswap.sensor];
+        int state;
+        try {
+            state = getHotSwapState(m_ctx.ipmi, sensor);
+        } catch (Provider::comm_error& e) {
+            if (disconnectOnTimeout(m_ctx.ipmi))
+                return;
+            if ((sensor.address.ownerId << 1) == IPMI_SLAVE_ADDRESS_BMC) {
+                LOG_DEBUG(std::string(e.what()) + ", skipping");
+                continue;
+            }
+            // Bridged controller owning the sensor doesn't respond, most likely it's gone
+            state = HOTSWAP_M7_COMM_LOST;
+        } catch (std::runtime_error& e) {
+            LOG_DEBUG(std::string(e.what()) + ", skipping");
+            continue;
+        }
+        if (state < 0)
+            continue;
+
+        auto it = m_hotswapStates.find(hotswap.target);
+        if (it == m_hotswapStates.end()) {
+            m_hotswapStates[hotswap.target] = state;
+            continue;
+        }
+        if (it->second == state)
+            continue;
+
+        LOG_INFO("FRU %u:%u on channel %u changed state M%u -> M%d",
+                 std::get<0>(hotswap.target), std::get<2>(hotswap.target), std::get<1>(hotswap.target), it->second, state);
+        it->second = state;
+
+        // Data of removed module is stale, re-inserted module might be a different one.
+        // Lost communication says nothing about the module, image on disk is
+        // still validated against FRU header when module comes back.
+        if (state == HOTSWAP_M0_NOT_INSTALLED)
+            invalidateFruTarget(catalog, hotswap.target, true);
+        else if (state == HOTSWAP_M4_ACTIVE || state == HOTSWAP_M7_COMM_LOST)
+            invalidateFruTarget(catalog, hotswap.target, false);
+
+        // Controller that was absent when topology was built has no site yet
+        if (state == HOTSWAP_M4_ACTIVE && std::get<2>(hotswap.target) == 0) {
+            auto controller = m_topology.find(std::get<0>(hotswap.target), std::get<1>(hotswap.target));
+            if (controller && controller->site.empty())
+                m_topology.fingerprint = 0;
+        }
+    }
+}
+
+/*
+ * Get Sensor Reading response layout is described in IPMI 2.0 spec, section 35.14.
+ */
+int FreeIpmiProvider::getHotSwapState(ipmi_ctx_t ipmi, const SdrCatalog::Sensor& sensor)
+{
+    uint8_t rq[] = { IPMI_CMD_GET_SENSOR_READING, sensor.address.sensorNum };
+    uint8_t rs[16];
+
+    // Sensor owner is stored in 7-bit form
+    IpmbBridgeScoped bridge(ipmi, sensor.address.ownerId << 1, sensor.address.channel, sensor.address.route);
+    int len = bridge.cmdRaw(sensor.address.ownerLun, IPMI_NET_FN_SENSOR_EVENT_RQ, rq, sizeof(rq), rs, sizeof(rs));
+    if (len < 0)
+        throw Provider::comm_error("failed to read hot-swap sensor - " + bridge.errormsg());
+    if (len < 5 || rs[0] != rq[0] || rs[1] != 0)
+        throw Provider::process_error("failed to decode hot-swap sensor reading");
+
+    // Reading/state unavailable
+    if (rs[3] & 0x20)
+        return -1;
+
+    for (int state = 0; state < 8; state++) {
+        if (rs[4] & (1 << state))
+            return state;
+    }
+    return -1;
+}
+
+void FreeIpmiProvider::invalidateFruTarget(const SdrCatalog& catalog, const FruTarget& target, bool removed)
+{
+    for (auto& fru: catalog.frus) {
+        if (fru.address.deviceAddr != std::get<0>(target) || fru.address.channel != std::get<1>(target))
+            continue;
+        // Management controller takes all its FRUs along
+        if (std::get<2>(target) != 0 && fru.address.fruId != std::get<2>(target))
+            continue;
+
+        auto device = fru.address.getDevice();
+        m_fruCache.erase(device);
+        m_scanCache.leds.erase(device);
+        if (removed)
+            (void)std::remove(getFruCachePath(fru.address).c_str());
+    }
+}
+
+bool FreeIpmiProvider::isPresent(uint8_t deviceAddr, uint8_t channel, uint8_t fruId) const
+{
+    auto absent = [&](uint8_t fruId_) {
+        auto it = m_hotswapStates.find(FruTarget(deviceAddr, channel, fruId_));
+        return (it != m_hotswapStates.end() && (it->second == HOTSWAP_M0_NOT_INSTALLED || it->second == HOTSWAP_M7_COMM_LOST));
+    };
+    return (!absent(fruId) && !absent(0));
+}
+
+void FreeIpmiProvider::checkPresent(uint8_t deviceAddr, uint8_t channel, uint8_t fruId) const
+{
+    if (!isPresent(deviceAddr, channel, fruId))
+        throw Provider::absent_error("FRU " + std::to_string(deviceAddr) + ":" + std::to_string(fruId) + " on channel " + std::to_string(channel) + " not present");
+}
+
+void FreeIpmiProvider::checkPresent(const SdrCatalog& catalog, const SensorAddress& address) const
+{
+    // Sensors of FRU entity go away with the FRU, hot-swap sensor itself keeps reporting
+    auto it = catalog.sensorIndex.find(address.get());
+    if (it != catalog.sensorIndex.end()) {
+        auto& sensor = catalog.sensors[it->second];
+        auto hotswap = catalog.hotswapIndex.find(std::make_pair(sensor.entityId, sensor.entityInstance));
+        if (hotswap != catalog.hotswapIndex.end() && catalog.hotswap[hotswap->second].sensor != it->second) {
+            auto& target = catalog.hotswap[hotswap->second].target;
+            checkPresent(std::get<0>(target), std::get<1>(target), std::get<2>(target));
+        }
+    }
+
+    checkPresent(address.ownerId << 1, address.channel, 0);
+}
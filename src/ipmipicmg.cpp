@@ -11,10 +11,10 @@
 #include "freeipmiprovider.h"
 
 #include <alarm.h> // from EPICS
+#include <algorithm>
+#include <cctype>
 #include <cmath>
 
-#include <freeipmi/fiid/fiid.h>
-
 #define IPMI_NET_FN_PICMG_RQ IPMI_NET_FN_GROUP_EXTENSION_RQ
 #define IPMI_NET_FN_PICMG_RS IPMI_NET_FN_GROUP_EXTENSION_RS
 
@@ -45,209 +45,273 @@ enum {
     PICMG_BUSED_RESOURCE_CMD                   = 0x17,
 };
 
-class FiidScoped {
-    public:
-        fiid_obj_t raw;
-        FiidScoped(fiid_template_t tmpl)
-        {
-            raw = fiid_obj_create(tmpl);
-            if (!fiid_obj_valid(raw)) {
-                raw = nullptr;
-                return;
-            }
-            fiid_obj_clear(raw);
-        }
-        ~FiidScoped()
-        {
-            if (raw != nullptr) {
-                fiid_obj_destroy(raw);
-            }
-        }
-        fiid_obj_t operator*()
-        {
-            return raw;
-        }
+/*
+ * PICMG commands are encoded directly into small stack buffers and sent with
+ * ipmi_cmd_raw(), responses are decoded in place into typed structures.
+ * Raw request starts with command byte, raw response with command byte and
+ * completion code. Layouts are described in PICMG 3.0 specification, section 3.2.5.
+ */
+namespace picmg {
+
+static const size_t MAX_RESPONSE_LENGTH = 32;
+
+struct AddressInfo {
+    uint8_t hardwareAddr;       //!< Hardware address of the site
+    uint8_t ipmbAddr;           //!< IPMB-0 address of controller in the site
+    uint8_t fruId;
+    uint8_t siteNumber;
+    uint8_t siteType;           //!< 0 ATCA board, 1 power entry, 4 fan tray, 7 AMC, 9 RTM, see Table 3-10
 };
 
-std::vector<FreeIpmiProvider::Entity> FreeIpmiProvider::getPicmgLeds(ipmi_ctx_t ipmi, ipmi_sdr_ctx_t sdr)
-{
-    if (ipmi_sdr_cache_first(sdr) < 0)
-        throw std::runtime_error("failed to rewind SDR cache - " + std::string(ipmi_sdr_ctx_errormsg(sdr)));
+struct LedProperties {
+    uint8_t statusLeds;         //!< Bitmask of supported status LEDs 0-3
+    uint8_t appLedCount;        //!< Number of application specific LEDs starting with id 4
+};
 
-    std::vector<FreeIpmiProvider::Entity> leds;
-    do {
-        uint8_t recordType;
-        if (ipmi_sdr_parse_record_id_and_type(sdr, NULL, 0, NULL, &recordType) < 0) {
-            LOG_DEBUG("Failed to parse SDR record type - %s, skipping", ipmi_sdr_ctx_errormsg(sdr));
-            continue;
-        }
+struct LedCapabilities {
+    uint8_t colors;             //!< Bitmask of supported colors, bit 1 blue to bit 6 white
+    uint8_t localDefault;       //!< Default color in local control state
+    uint8_t overrideDefault;    //!< Default color in override state
+};
 
-        if (recordType != IPMI_SDR_FORMAT_FRU_DEVICE_LOCATOR_RECORD)
-            continue;
+struct LedState {
+    bool localControl;          //!< LED is in local control state
+    bool overrideControl;       //!< LED is in override state
+    bool lampTest;              //!< Lamp test is in progress
+    uint8_t localFunction;      //!< 0 off, 1-250 blinking off duration, 255 on
+    uint8_t localColor;
+    uint8_t overrideFunction;
+    uint8_t overrideColor;
+};
 
-        SdrRecord record;
-        record.size = ipmi_sdr_cache_record_read(sdr, record.data, record.max_size);
-        if (record.size < 0) {
-            LOG_DEBUG("Failed to read SDR record - %s, skipping", ipmi_sdr_ctx_errormsg(sdr));
-            continue;
-        }
+/**
+ * @brief Send PICMG command and validate response.
+ * @param rq request starting with command byte, second byte is set to PICMG identifier
+ * @param rs response buffer, MAX_RESPONSE_LENGTH bytes
+ * @param rsMin minimum valid response length including command, completion code and PICMG identifier
+ * @return response length
+ * @exception Provider::comm_error on transport failure, Provider::process_error on invalid response
+ */
+static size_t send(FreeIpmiProvider::IpmbBridgeScoped& target, uint8_t* rq, size_t rqLen, uint8_t* rs, size_t rsMin, const char* what)
+{
+    rq[1] = IPMI_NET_FN_GROUP_EXTENSION_IDENTIFICATION_PICMG;
+
+    int len = target.cmdRaw(IPMI_BMC_IPMB_LUN_BMC, IPMI_NET_FN_PICMG_RQ, rq, rqLen, rs, MAX_RESPONSE_LENGTH);
+    if (len < 0)
+        throw Provider::comm_error("failed to request " + std::string(what) + " - " + target.errormsg());
+    if (len < 2 || rs[0] != rq[0])
+        throw Provider::process_error("failed to decode " + std::string(what) + " response");
+    if (rs[1] != 0)
+        throw Provider::process_error("failed to decode " + std::string(what) + " response, invalid comp_code " + std::to_string(rs[1]));
+    if ((size_t)len < rsMin || rs[2] != IPMI_NET_FN_GROUP_EXTENSION_IDENTIFICATION_PICMG)
+        throw Provider::process_error("failed to decode " + std::string(what) + " response");
+    return len;
+}
 
-        try {
-            FruAddress fruAddress(sdr, record);
-            auto fruName = getFruName(sdr, record);
-            auto subleds = getPicmgLeds(ipmi, fruAddress, fruName);
-            for (auto& led: subleds) {
-                leds.emplace_back(std::move(led));
-            }
-        } catch (std::runtime_error& e) {
-            LOG_DEBUG(std::string(e.what()) + ", skipping");
-        }
-    } while (ipmi_sdr_cache_next(sdr) == 1);
+static AddressInfo decodeAddressInfo(const uint8_t* rs)
+{
+    AddressInfo info;
+    info.hardwareAddr = rs[3];
+    info.ipmbAddr     = rs[4];
+    info.fruId        = rs[6];
+    info.siteNumber   = rs[7];
+    info.siteType     = rs[8];
+    return info;
+}
 
-    return leds;
+/**
+ * @brief Ask controller, usually shelf manager, about site of controller with given IPMB-0 address.
+ */
+static AddressInfo getAddressInfo(FreeIpmiProvider::IpmbBridgeScoped& target, uint8_t ipmbAddr)
+{
+    uint8_t rq[] = { PICMG_GET_ADDRESS_INFO_CMD, 0, 0, 0x01, ipmbAddr };
+    uint8_t rs[MAX_RESPONSE_LENGTH];
+    send(target, rq, sizeof(rq), rs, 9, "PICMG address info");
+    return decodeAddressInfo(rs);
 }
 
-std::vector<FreeIpmiProvider::Entity> FreeIpmiProvider::getPicmgLeds(ipmi_ctx_t ipmi, const FruAddress& fruAddress, const std::string& namePrefix)
+/**
+ * @brief Ask controller about its own site.
+ */
+static AddressInfo getAddressInfo(FreeIpmiProvider::IpmbBridgeScoped& target)
 {
-    static fiid_template_t tmpl_cmd_get_picmg_led_prop_rq =
-    {
-        { 8, "cmd", FIID_FIELD_REQUIRED | FIID_FIELD_LENGTH_FIXED},
-        { 8, "picmg_id", FIID_FIELD_REQUIRED | FIID_FIELD_LENGTH_FIXED},
-        { 8, "fru_device_id", FIID_FIELD_REQUIRED | FIID_FIELD_LENGTH_FIXED},
-        { 0, "", 0}
-    };
+    uint8_t rq[] = { PICMG_GET_ADDRESS_INFO_CMD, 0 };
+    uint8_t rs[MAX_RESPONSE_LENGTH];
+    send(target, rq, sizeof(rq), rs, 9, "PICMG address info");
+    return decodeAddressInfo(rs);
+}
 
-    static fiid_template_t tmpl_cmd_get_picmg_led_prop_rs =
-    {
-        { 8, "cmd", FIID_FIELD_REQUIRED | FIID_FIELD_LENGTH_FIXED | FIID_FIELD_MAKES_PACKET_SUFFICIENT},
-        { 8, "comp_code", FIID_FIELD_REQUIRED | FIID_FIELD_LENGTH_FIXED | FIID_FIELD_MAKES_PACKET_SUFFICIENT},
-        { 8, "picmg_id", FIID_FIELD_REQUIRED | FIID_FIELD_LENGTH_FIXED},
-        { 4, "status_leds", FIID_FIELD_REQUIRED | FIID_FIELD_LENGTH_FIXED},
-        { 4, "led_reserved", FIID_FIELD_REQUIRED | FIID_FIELD_LENGTH_FIXED},
-        { 8, "app_leds", FIID_FIELD_REQUIRED | FIID_FIELD_LENGTH_FIXED},
-        { 0, "", 0}
+/**
+ * @brief Name site for use in record links, empty for OEM and unknown site types.
+ */
+static std::string getSiteName(const AddressInfo& info)
+{
+    static const std::vector<std::string> types = {
+        "slot", "pem", "shelffru", "shmc", "fan", "filter", "alarm", "amc", "pmc", "rtm"
     };
+    if (info.siteType >= types.size())
+        return "";
+    return types[info.siteType] + std::to_string(info.siteNumber);
+}
+
+static LedProperties getLedProperties(FreeIpmiProvider::IpmbBridgeScoped& target, uint8_t fruId)
+{
+    uint8_t rq[] = { PICMG_GET_FRU_LED_PROPERTIES_CMD, 0, fruId };
+    uint8_t rs[MAX_RESPONSE_LENGTH];
+    send(target, rq, sizeof(rq), rs, 5, "PICMG LED properties");
+
+    LedProperties props;
+    props.statusLeds  = rs[3] & 0x0F;
+    props.appLedCount = rs[4];
+    return props;
+}
+
+static LedCapabilities getLedCapabilities(FreeIpmiProvider::IpmbBridgeScoped& target, uint8_t fruId, uint8_t ledId)
+{
+    uint8_t rq[] = { PICMG_GET_FRU_LED_COLOR_CAPABILITIES_CMD, 0, fruId, ledId };
+    uint8_t rs[MAX_RESPONSE_LENGTH];
+    send(target, rq, sizeof(rq), rs, 6, "PICMG LED capabilities");
+
+    LedCapabilities caps;
+    caps.colors          = rs[3];
+    caps.localDefault    = rs[4] & 0x0F;
+    caps.overrideDefault = rs[5] & 0x0F;
+    return caps;
+}
+
+static LedState getLedState(FreeIpmiProvider::IpmbBridgeScoped& target, uint8_t fruId, uint8_t ledId)
+{
+    uint8_t rq[] = { PICMG_GET_FRU_LED_STATE_CMD, 0, fruId, ledId };
+    uint8_t rs[MAX_RESPONSE_LENGTH];
+    size_t len = send(target, rq, sizeof(rq), rs, 7, "PICMG LED state");
+
+    LedState state{};
+    state.localControl     = (rs[3] & 0x1);
+    state.overrideControl  = (rs[3] & 0x2);
+    state.lampTest         = (rs[3] & 0x4);
+    state.localFunction    = rs[4];
+    state.localColor       = rs[6] & 0x0F;
+
+    // Override fields are only present when override or lamp test is active
+    if (len >= 10) {
+        state.overrideFunction = rs[7];
+        state.overrideColor    = rs[9] & 0x0F;
+    } else {
+        state.overrideControl  = false;
+    }
+    return state;
+}
+
+/**
+ * @brief Pack LED state into a single value for cheap change detection.
+ */
+static uint32_t packLedState(const LedState& state)
+{
+    uint32_t packed = 0;
+    packed |= (state.localControl ? 0x1 : 0) | (state.overrideControl ? 0x2 : 0) | (state.lampTest ? 0x4 : 0);
+    packed |= (uint32_t)state.localFunction << 4;
+    packed |= (uint32_t)state.localColor << 12;
+    if (state.overrideControl) {
+        packed |= (uint32_t)state.overrideFunction << 16;
+        packed |= (uint32_t)state.overrideColor << 24;
+    }
+    return packed;
+}
 
-    FiidScoped obj_cmd_rq(tmpl_cmd_get_picmg_led_prop_rq);
-    FiidScoped obj_cmd_rs(tmpl_cmd_get_picmg_led_prop_rs);
+/**
+ * @brief Determine color LED is currently showing, 0 when off.
+ */
+static int getLedColor(const LedState& state)
+{
+    int color = 0; // off
 
-    if (*obj_cmd_rq == nullptr)
-        throw std::runtime_error("failed to allocate PICMG LED request");
+    // TODO: function < 255 => off-state blinking
+    if (state.localControl && state.localFunction > 0)
+        color = state.localColor;
+    if (state.overrideControl && state.overrideFunction > 0)
+        color = state.overrideColor;
 
-    if (fiid_obj_set(*obj_cmd_rq, "cmd", PICMG_GET_FRU_LED_PROPERTIES_CMD) < 0)
-        throw std::runtime_error("failed to initialize PICMG LED request");
-    if (fiid_obj_set(*obj_cmd_rq, "picmg_id", IPMI_NET_FN_GROUP_EXTENSION_IDENTIFICATION_PICMG) < 0)
-        throw std::runtime_error("failed to initialize PICMG LED request");
-    if (fiid_obj_set(*obj_cmd_rq, "fru_device_id", fruAddress.fruId) < 0)
-        throw std::runtime_error("failed to initialize PICMG LED request");
+    // TODO: lamp test
 
-    if (*obj_cmd_rs == nullptr)
-        throw std::runtime_error("failed to allocate PICMG LED response");
+    return color;
+}
+
+}; // namespace picmg
 
-//ipmi_ctx_set_flags(ipmi, IPMI_FLAGS_DEBUG_DUMP);
-    IpmbBridgeScoped bridge(ipmi, fruAddress.deviceAddr, fruAddress.channel);
-    int ret = ipmi_cmd(ipmi, IPMI_BMC_IPMB_LUN_BMC, IPMI_NET_FN_PICMG_RQ, *obj_cmd_rq, *obj_cmd_rs);
-    if (ret < 0) {
-        std::string e(ipmi_ctx_errormsg(ipmi));
-        throw std::runtime_error("failed to request PICMG LED properties");
+std::vector<FreeIpmiProvider::Entity> FreeIpmiProvider::getPicmgLeds(ipmi_ctx_t ipmi, const SdrCatalog& catalog, ScanMode mode)
+{
+    // LED properties are static, only their state needs to be read
+    std::vector<size_t> selected;
+    for (size_t i = 0; i < catalog.frus.size(); i++) {
+        auto& address = catalog.frus[i].address;
+        if (!isPresent(address.deviceAddr, address.channel, address.fruId))
+            continue;
+        auto cached = m_scanCache.leds.find(address.getDevice());
+        if (mode == ScanMode::FULL || cached == m_scanCache.leds.end() || cached->second.empty())
+            selected.push_back(i);
     }
-    bridge.close();
 
-    uint64_t compCode;
-    if (fiid_obj_get(*obj_cmd_rs, "comp_code", &compCode) < 0)
-        throw std::runtime_error("failed to decode PICMG LED properties response");
-    if (compCode != 0)
-        throw std::runtime_error("failed to decode PICMG LED properties response, invalid comp_code");
+    // Each job only touches its own slot, cache is updated afterwards
+    std::vector<std::unique_ptr<std::vector<Entity>>> results(catalog.frus.size());
+    discover(ipmi, catalog, selected, "PICMG LED", [&](ipmi_ctx_t ipmi_, size_t i) {
+        try {
+            results[i].reset(new std::vector<Entity>(getPicmgLeds(ipmi_, catalog.frus[i].address, catalog.frus[i].name, mode)));
+        } catch (std::runtime_error& e) {
+            LOG_DEBUG(std::string(e.what()) + ", skipping");
+        }
+    });
+
+    std::vector<FreeIpmiProvider::Entity> leds;
+    for (size_t i = 0; i < catalog.frus.size(); i++) {
+        auto& cached = m_scanCache.leds[catalog.frus[i].address.getDevice()];
+        if (results[i])
+            cached = std::move(*results[i]);
+        else if (mode == ScanMode::FULL)
+            continue;
+        leds.insert(leds.end(), cached.begin(), cached.end());
+    }
+
+    return leds;
+}
 
-    uint64_t statusLeds;
-    uint64_t appLeds;
-    if (fiid_obj_get(*obj_cmd_rs, "status_leds", &statusLeds) < 0)
-        throw std::runtime_error("failed to decode PICMG LED properties response");
-    if (fiid_obj_get(*obj_cmd_rs, "app_leds", &appLeds) < 0)
-        throw std::runtime_error("failed to decode PICMG LED properties response");
+std::vector<FreeIpmiProvider::Entity> FreeIpmiProvider::getPicmgLeds(ipmi_ctx_t ipmi, const FruAddress& fruAddress, const std::string& namePrefix, ScanMode mode)
+{
+    IpmbBridgeScoped bridge(ipmi, fruAddress.deviceAddr, fruAddress.channel, fruAddress.route);
+    auto props = picmg::getLedProperties(bridge, fruAddress.fruId);
+    bridge.close();
 
     PicmgLedAddress ledAddr(fruAddress.deviceAddr, fruAddress.channel, fruAddress.fruId, 0);
+    ledAddr.route = fruAddress.route;
     std::vector<FreeIpmiProvider::Entity> leds;
     for (int i = 0; i < 4; i++) {
-        if (statusLeds & (1 << i)) {
+        if (props.statusLeds & (1 << i)) {
             try {
                 ledAddr.ledId = i;
-                leds.emplace_back( getPicmgLedFull(ipmi, ledAddr, namePrefix) );
+                leds.emplace_back( getPicmgLedFull(ipmi, ledAddr, namePrefix, mode) );
             } catch (...) {
                 continue;
             }
         }
     }
-    for (int i = 0; i < 252; i++) {
-        if (appLeds & (1 << i)) {
-            try {
-                ledAddr.ledId = i + 4;
-                leds.emplace_back( getPicmgLedFull(ipmi, ledAddr, namePrefix) );
-            } catch (...) {
-                continue;
-            }
+    for (int i = 0; i < props.appLedCount && i < 0xFB - 4; i++) {
+        try {
+            ledAddr.ledId = i + 4;
+            leds.emplace_back( getPicmgLedFull(ipmi, ledAddr, namePrefix, mode) );
+        } catch (...) {
+            continue;
         }
     }
 
     return leds;
 }
 
-FreeIpmiProvider::Entity FreeIpmiProvider::getPicmgLedFull(ipmi_ctx_t ipmi, const PicmgLedAddress& address, const std::string& namePrefix)
+FreeIpmiProvider::Entity FreeIpmiProvider::getPicmgLedFull(ipmi_ctx_t ipmi, const PicmgLedAddress& address, const std::string& namePrefix, ScanMode mode)
 {
-    static fiid_template_t tmpl_cmd_get_picmg_led_cap_rq =
-    {
-        { 8, "cmd", FIID_FIELD_REQUIRED | FIID_FIELD_LENGTH_FIXED},
-        { 8, "picmg_id", FIID_FIELD_REQUIRED | FIID_FIELD_LENGTH_FIXED},
-        { 8, "fru_device_id", FIID_FIELD_REQUIRED | FIID_FIELD_LENGTH_FIXED},
-        { 8, "led_id", FIID_FIELD_REQUIRED | FIID_FIELD_LENGTH_FIXED},
-        { 0, "", 0}
-    };
-
-    static fiid_template_t tmpl_cmd_get_picmg_led_cap_rs =
-    {
-        { 8, "cmd", FIID_FIELD_REQUIRED | FIID_FIELD_LENGTH_FIXED | FIID_FIELD_MAKES_PACKET_SUFFICIENT},
-        { 8, "comp_code", FIID_FIELD_REQUIRED | FIID_FIELD_LENGTH_FIXED | FIID_FIELD_MAKES_PACKET_SUFFICIENT},
-        { 8, "picmg_id", FIID_FIELD_REQUIRED | FIID_FIELD_LENGTH_FIXED},
-        { 8, "colors", FIID_FIELD_REQUIRED | FIID_FIELD_LENGTH_FIXED},
-        { 8, "local_control_default", FIID_FIELD_REQUIRED | FIID_FIELD_LENGTH_FIXED},
-        { 8, "override_control_default", FIID_FIELD_REQUIRED | FIID_FIELD_LENGTH_FIXED},
-        { 8, "flags", FIID_FIELD_OPTIONAL | FIID_FIELD_LENGTH_FIXED},
-        { 0, "", 0}
-    };
-
-    FiidScoped obj_cmd_rq(tmpl_cmd_get_picmg_led_cap_rq);
-    FiidScoped obj_cmd_rs(tmpl_cmd_get_picmg_led_cap_rs);
-
-    if (*obj_cmd_rq == nullptr)
-        throw std::runtime_error("failed to allocate PICMG LED request");
-    if (fiid_obj_set(*obj_cmd_rq, "cmd", PICMG_GET_FRU_LED_COLOR_CAPABILITIES_CMD) < 0)
-        throw std::runtime_error("failed to initialize PICMG LED request");
-    if (fiid_obj_set(*obj_cmd_rq, "picmg_id", IPMI_NET_FN_GROUP_EXTENSION_IDENTIFICATION_PICMG) < 0)
-        throw std::runtime_error("failed to initialize PICMG LED request");
-    if (fiid_obj_set(*obj_cmd_rq, "fru_device_id", address.fruId) < 0)
-        throw std::runtime_error("failed to initialize PICMG LED request");
-    if (fiid_obj_set(*obj_cmd_rq, "led_id", address.ledId) < 0)
-        throw std::runtime_error("failed to initialize PICMG LED request");
-
-    if (*obj_cmd_rs == nullptr)
-        throw std::runtime_error("failed to allocate PICMG LED response");
-
-//ipmi_ctx_set_flags(ipmi, IPMI_FLAGS_DEBUG_DUMP);
-    IpmbBridgeScoped bridge(ipmi, address.deviceAddr, address.channel);
-    int ret = ipmi_cmd(ipmi, IPMI_BMC_IPMB_LUN_BMC, IPMI_NET_FN_PICMG_RQ, *obj_cmd_rq, *obj_cmd_rs);
-    if (ret < 0)
-        throw std::runtime_error("failed to request PICMG LED capabilities");
+    IpmbBridgeScoped bridge(ipmi, address.deviceAddr, address.channel, address.route);
+    auto caps = picmg::getLedCapabilities(bridge, address.fruId, address.ledId);
     bridge.close();
 
-    uint64_t compCode;
-    if (fiid_obj_get(*obj_cmd_rs, "comp_code", &compCode) < 0)
-        throw std::runtime_error("failed to decode PICMG LED capabilities response");
-    if (compCode != 0)
-        throw std::runtime_error("failed to decode PICMG LED capabilities response, invalid comp_code");
-
-    uint64_t val;
-    if (fiid_obj_get(*obj_cmd_rs, "colors", &val) < 0)
-        throw std::runtime_error("failed to decode PICMG LED capabilities response");
+    uint8_t val = caps.colors;
     val |= 0x1; // Force 'off' color to be part of the options
 
     static const std::vector<std::string> colors = {
@@ -263,7 +327,12 @@ FreeIpmiProvider::Entity FreeIpmiProvider::getPicmgLedFull(ipmi_ctx_t ipmi, cons
         { "SXVL", "SXST" },
     };
 
-    Entity entity = getPicmgLed(ipmi, address);
+    Entity entity;
+    if (mode == ScanMode::METADATA)
+        entity["VAL"] = 0;
+    else
+        entity = getPicmgLed(ipmi, address);
+
     size_t j = 0;
     for (int i = 0; i < 7; i++) {
         if (val & (1 << i)) {
@@ -281,122 +350,350 @@ FreeIpmiProvider::Entity FreeIpmiProvider::getPicmgLedFull(ipmi_ctx_t ipmi, cons
 
 FreeIpmiProvider::Entity FreeIpmiProvider::getPicmgLed(ipmi_ctx_t ipmi, const PicmgLedAddress& address)
 {
-    static fiid_template_t tmpl_cmd_get_picmg_led_get_rq =
-    {
-        { 8, "cmd", FIID_FIELD_REQUIRED | FIID_FIELD_LENGTH_FIXED},
-        { 8, "picmg_id", FIID_FIELD_REQUIRED | FIID_FIELD_LENGTH_FIXED},
-        { 8, "fru_device_id", FIID_FIELD_REQUIRED | FIID_FIELD_LENGTH_FIXED},
-        { 8, "led_id", FIID_FIELD_REQUIRED | FIID_FIELD_LENGTH_FIXED},
-        { 0, "", 0}
-    };
+    Entity entity;
 
-    static fiid_template_t tmpl_cmd_get_picmg_led_get_rs =
-    {
-        { 8, "cmd", FIID_FIELD_REQUIRED | FIID_FIELD_LENGTH_FIXED | FIID_FIELD_MAKES_PACKET_SUFFICIENT},
-        { 8, "comp_code", FIID_FIELD_REQUIRED | FIID_FIELD_LENGTH_FIXED | FIID_FIELD_MAKES_PACKET_SUFFICIENT},
-        { 8, "picmg_id", FIID_FIELD_REQUIRED | FIID_FIELD_LENGTH_FIXED},
-        { 1, "state_local_control", FIID_FIELD_REQUIRED | FIID_FIELD_LENGTH_FIXED},
-        { 1, "state_override_control", FIID_FIELD_REQUIRED | FIID_FIELD_LENGTH_FIXED},
-        { 1, "state_lamp_test", FIID_FIELD_REQUIRED | FIID_FIELD_LENGTH_FIXED},
-        { 1, "state_hardware_restrict", FIID_FIELD_REQUIRED | FIID_FIELD_LENGTH_FIXED},
-        { 4, "reserved", FIID_FIELD_REQUIRED | FIID_FIELD_LENGTH_FIXED},
-
-        { 8, "local_control_function", FIID_FIELD_REQUIRED | FIID_FIELD_LENGTH_FIXED},
-        { 8, "local_control_duration", FIID_FIELD_REQUIRED | FIID_FIELD_LENGTH_FIXED},
-        { 4, "local_control_color", FIID_FIELD_REQUIRED | FIID_FIELD_LENGTH_FIXED},
-        { 4, "local_control_reserved", FIID_FIELD_REQUIRED | FIID_FIELD_LENGTH_FIXED},
-        { 8, "override_control_function", FIID_FIELD_REQUIRED | FIID_FIELD_LENGTH_FIXED},
-        { 8, "override_control_duration", FIID_FIELD_REQUIRED | FIID_FIELD_LENGTH_FIXED},
-        { 4, "override_control_color", FIID_FIELD_REQUIRED | FIID_FIELD_LENGTH_FIXED},
-        { 4, "override_control_reserved", FIID_FIELD_REQUIRED | FIID_FIELD_LENGTH_FIXED},
-        { 8, "lamp_test_duration", FIID_FIELD_OPTIONAL | FIID_FIELD_LENGTH_FIXED},
-        { 0, "", 0}
-    };
+    // Watched LEDs are kept up to date by poller
+    auto poll = m_ledPolls.find(PicmgLedKey(address.route.transitAddr, address.route.transitChannel,
+                                            address.deviceAddr, address.channel, address.fruId, address.ledId));
+    if (poll != m_ledPolls.end() && poll->second.valid) {
+        double period = getHousekeepingPeriod();
+        if (period > 0.0 && (epicsTime::getCurrent() - poll->second.updated) < 2*period) {
+            entity["VAL"] = poll->second.value;
+            entity.time = poll->second.updated;
+            return entity;
+        }
+    }
+
+    picmg::LedState led;
 
-    FiidScoped obj_cmd_rq(tmpl_cmd_get_picmg_led_get_rq);
-    FiidScoped obj_cmd_rs(tmpl_cmd_get_picmg_led_get_rs);
-
-    if (*obj_cmd_rq == nullptr)
-        throw std::runtime_error("failed to allocate PICMG LED request");
-    if (fiid_obj_set(*obj_cmd_rq, "cmd", PICMG_GET_FRU_LED_STATE_CMD) < 0)
-        throw std::runtime_error("failed to initialize PICMG LED request");
-    if (fiid_obj_set(*obj_cmd_rq, "picmg_id", IPMI_NET_FN_GROUP_EXTENSION_IDENTIFICATION_PICMG) < 0)
-        throw std::runtime_error("failed to initialize PICMG LED request");
-    if (fiid_obj_set(*obj_cmd_rq, "fru_device_id", address.fruId) < 0)
-        throw std::runtime_error("failed to initialize PICMG LED request");
-    if (fiid_obj_set(*obj_cmd_rq, "led_id", address.ledId) < 0)
-        throw std::runtime_error("failed to initialize PICMG LED request");
-
-    if (*obj_cmd_rs == nullptr)
-        throw std::runtime_error("failed to allocate PICMG LED response");
-
-    IpmbBridgeScoped bridge(ipmi, address.deviceAddr, address.channel);
-    int ret  = ipmi_cmd(ipmi, IPMI_BMC_IPMB_LUN_BMC, IPMI_NET_FN_PICMG_RQ, *obj_cmd_rq, *obj_cmd_rs);
-    if (ret < 0 && ipmi_ctx_errnum(ipmi) == IPMI_ERR_SESSION_TIMEOUT)
-        m_connected = false;
-    if (ret < 0)
-        throw std::runtime_error("failed to request PICMG LED state");
+    IpmbBridgeScoped bridge(ipmi, address.deviceAddr, address.channel, address.route);
+    try {
+        led = picmg::getLedState(bridge, address.fruId, address.ledId);
+    } catch (Provider::comm_error&) {
+        disconnectOnTimeout(ipmi);
+        throw;
+    }
     bridge.close();
 
-    uint64_t compCode;
-    if (fiid_obj_get(*obj_cmd_rs, "comp_code", &compCode) < 0)
-        throw std::runtime_error("failed to decode PICMG LED state response");
-    if (compCode != 0)
-        throw std::runtime_error("failed to decode PICMG LED state response, invalid comp_code");
-
-    int state = 0; // off
-
-    uint64_t val = 0;
-    if (fiid_obj_get(*obj_cmd_rs, "state_local_control", &val) < 0)
-        throw std::runtime_error("failed to decode PICMG LED state response");
-    if (val) {
-        val = 0;
-        // TODO: val < 255 => off-state blinking
-        if (fiid_obj_get(*obj_cmd_rs, "local_control_function", &val) < 0)
-            throw std::runtime_error("failed to decode PICMG LED state response");
-        if (val > 0) {
-            val = 0;
-            if (fiid_obj_get(*obj_cmd_rs, "local_control_color", &val) < 0)
-                throw std::runtime_error("failed to decode PICMG LED state response");
-            state = (val & 0xF);
+    entity["VAL"] = picmg::getLedColor(led);
+    return entity;
+}
+
+/*
+ * Set FRU LED State is described in PICMG 3.0 specification, section 3.2.5.6.
+ * Value is the color to turn LED on in, like returned when reading the LED,
+ * 15 for the default override color, 0 turns LED off and 255 returns it to
+ * local control.
+ */
+FreeIpmiProvider::Entity FreeIpmiProvider::setPicmgLed(ipmi_ctx_t ipmi, const PicmgLedAddress& address, int value)
+{
+    static const uint8_t LED_OFF            = 0x00;
+    static const uint8_t LED_LOCAL_CONTROL  = 0xFC;
+    static const uint8_t LED_ON             = 0xFF;
+    static const uint8_t COLOR_UNCHANGED    = 0x0E;
+
+    uint8_t function = LED_ON;
+    uint8_t color = value;
+    if (value == 0) {
+        function = LED_OFF;
+        color = COLOR_UNCHANGED;
+    } else if (value == 255) {
+        function = LED_LOCAL_CONTROL;
+        color = COLOR_UNCHANGED;
+    } else if (!(value >= 1 && value <= 6) && value != 15) {
+        throw Provider::syntax_error("Invalid PICMG LED value " + std::to_string(value));
+    }
+
+    uint8_t rq[] = { PICMG_SET_FRU_LED_STATE_CMD, 0, address.fruId, address.ledId, function, 0, color };
+    uint8_t rs[picmg::MAX_RESPONSE_LENGTH];
+
+    IpmbBridgeScoped bridge(ipmi, address.deviceAddr, address.channel, address.route);
+    picmg::send(bridge, rq, sizeof(rq), rs, 3, "PICMG set LED state");
+    auto led = picmg::getLedState(bridge, address.fruId, address.ledId);
+    bridge.close();
+
+    Entity entity;
+    entity["VAL"] = picmg::getLedColor(led);
+    return entity;
+}
+
+/*
+ * Set FRU Activation is described in PICMG 3.0 specification, section 3.2.5.11.
+ * Value 1 activates FRU and 0 deactivates it, FRU then goes through M-states
+ * on its own pace and hot-swap sensor reports where it ends up.
+ */
+FreeIpmiProvider::Entity FreeIpmiProvider::setPicmgFruActivation(ipmi_ctx_t ipmi, const PicmgFruAddress& address, int value)
+{
+    uint8_t rq[] = { PICMG_FRU_ACTIVATION_CMD, 0, address.fruId, (uint8_t)(value ? 1 : 0) };
+    uint8_t rs[picmg::MAX_RESPONSE_LENGTH];
+
+    IpmbBridgeScoped bridge(ipmi, address.deviceAddr, address.channel, address.route);
+    picmg::send(bridge, rq, sizeof(rq), rs, 3, "PICMG FRU activation");
+
+    Entity entity;
+    entity["VAL"] = (value ? 1 : 0);
+    return entity;
+}
+
+/*
+ * Watched LEDs are ordered by IPMB target, FRU and LED id. Bridge is only
+ * switched when moving to next target, a target that fails to respond is
+ * skipped for the rest of the pass instead of timing out on each LED.
+ * API lock is released in between targets so that reads don't wait for
+ * the whole pass.
+ */
+void FreeIpmiProvider::pollPicmgLeds()
+{
+    std::vector<std::function<void()>> changed;
+    PicmgLedKey last;
+    bool first = true;
+
+    while (true) {
+        common::ScopedLock lock(m_apiMutex);
+        if (!m_connected)
+            break;
+        auto it = (first ? m_ledPolls.begin() : m_ledPolls.upper_bound(last));
+        if (it == m_ledPolls.end())
+            break;
+        first = false;
+
+        IpmbRoute route;
+        route.transitAddr    = std::get<0>(it->first);
+        route.transitChannel = std::get<1>(it->first);
+        auto deviceAddr      = std::get<2>(it->first);
+        auto channel         = std::get<3>(it->first);
+        auto target = std::make_tuple(route.transitAddr, route.transitChannel, deviceAddr, channel);
+
+        IpmbBridgeScoped bridge(m_ctx.ipmi, deviceAddr, channel, route);
+        bool targetFailed = false;
+        for (; it != m_ledPolls.end(); ++it) {
+            if (std::make_tuple(std::get<0>(it->first), std::get<1>(it->first), std::get<2>(it->first), std::get<3>(it->first)) != target)
+                break;
+            last = it->first;
+            auto fruId = std::get<4>(it->first);
+            auto ledId = std::get<5>(it->first);
+            auto& poll = it->second;
+
+            bool valid = false;
+            if (!targetFailed && isPresent(deviceAddr, channel, fruId)) {
+                try {
+                    auto led = picmg::getLedState(bridge, fruId, ledId);
+                    auto state = picmg::packLedState(led);
+                    valid = true;
+                    poll.updated = epicsTime::getCurrent();
+                    if (poll.valid && poll.state == state)
+                        continue;
+                    poll.state = state;
+                    poll.value = picmg::getLedColor(led);
+                } catch (Provider::comm_error& e) {
+                    if (disconnectOnTimeout(m_ctx.ipmi))
+                        break;
+                    LOG_DEBUG(e.what());
+                    targetFailed = true;
+                } catch (std::runtime_error& e) {
+                    LOG_DEBUG(e.what());
+                }
+            }
+
+            // Records need to see errors as well, but only once
+            if (!valid && !poll.valid)
+                continue;
+            poll.valid = valid;
+            changed.insert(changed.end(), poll.callbacks.begin(), poll.callbacks.end());
         }
     }
 
-    val = 0;
-    if (fiid_obj_get(*obj_cmd_rs, "state_override_control", &val) < 0)
-        throw std::runtime_error("failed to decode PICMG LED state response");
-    if (val) {
-        val = 0;
-        // TODO: val < 255 => off-state blinking
-        if (fiid_obj_get(*obj_cmd_rs, "override_control_function", &val) < 0)
-            throw std::runtime_error("failed to decode PICMG LED state response");
-        if (val > 0) {
-            val = 0;
-            if (fiid_obj_get(*obj_cmd_rs, "override_control_color", &val) < 0)
-                throw std::runtime_error("failed to decode PICMG LED state response");
-            state = (val & 0xF);
+    for (auto& cb: changed)
+        cb();
+}
+
+FreeIpmiProvider::PicmgLedKey FreeIpmiProvider::getLedKey(const PicmgLedAddress& address)
+{
+    return PicmgLedKey(address.route.transitAddr, address.route.transitChannel,
+                       address.deviceAddr, address.channel, address.fruId, address.ledId);
+}
+
+void FreeIpmiProvider::resolvePendingLeds()
+{
+    for (auto it = m_pendingLeds.begin(); it != m_pendingLeds.end(); ) {
+        auto& ledAddr = it->first;
+        try {
+            resolveTarget(ledAddr.site, ledAddr.route, ledAddr.deviceAddr, ledAddr.channel);
+        } catch (Provider::absent_error&) {
+            ++it;
+            continue;
         }
+        // Next poll sees it as changed and notifies the record
+        LOG_DEBUG("Site '%s' populated, watching LED %u", ledAddr.site.c_str(), ledAddr.ledId);
+        m_ledPolls[getLedKey(ledAddr)].callbacks.push_back(it->second);
+        it = m_pendingLeds.erase(it);
     }
+}
 
-    // TODO: lamp test
+/*
+ * Sites of controllers on IPMB-0 are known to shelf manager, controllers
+ * behind transit controller are asked themselves and their site is qualified
+ * with carrier's site. Controllers not aware of PICMG sites are still
+ * listed, they just can't be addressed by site.
+ * Management Controller Device Locator layout is in IPMI 2.0 spec, section 43.9.
+ */
+void FreeIpmiProvider::buildTopology(ipmi_ctx_t ipmi)
+{
+    static const size_t MC_LOCATOR_RECORD_LENGTH = 16;
+    static const uint8_t FRU_INVENTORY_DEVICE = 0x08;
 
-    Entity entity;
-    entity["VAL"] = state;
-    return entity;
+    Topology topology;
+    topology.fingerprint = m_sdrCatalog.fingerprint;
+
+    for (auto& record: m_sdrCatalog.controllers) {
+        if (record.size < MC_LOCATOR_RECORD_LENGTH)
+            continue;
+
+        Topology::Controller controller;
+        controller.deviceAddr   = record.data[5] & 0xFE;
+        controller.channel      = record.data[6] & 0x0F;
+        controller.capabilities = record.data[8];
+        controller.route        = m_sdrCatalog.findRoute(controller.deviceAddr, controller.channel);
+        if (controller.capabilities & FRU_INVENTORY_DEVICE)
+            controller.fruIds.push_back(0);
+
+        auto key = std::make_pair(controller.deviceAddr, controller.channel);
+        if (topology.controllerIndex.find(key) != topology.controllerIndex.end())
+            continue;
+        topology.controllerIndex[key] = topology.controllers.size();
+        topology.controllers.push_back(controller);
+    }
+
+    for (auto& fru: m_sdrCatalog.frus) {
+        auto it = topology.controllerIndex.find(std::make_pair(fru.address.deviceAddr, fru.address.channel));
+        if (it == topology.controllerIndex.end())
+            continue;
+        auto& fruIds = topology.controllers[it->second].fruIds;
+        if (std::find(fruIds.begin(), fruIds.end(), fru.address.fruId) == fruIds.end())
+            fruIds.push_back(fru.address.fruId);
+    }
+
+    // Carriers first so that their AMC sites can be qualified
+    size_t nSites = 0;
+    bool timedOut = false;
+    for (int transit = 0; transit < 2 && !timedOut; transit++) {
+        for (size_t i = 0; i < topology.controllers.size(); i++) {
+            auto& controller = topology.controllers[i];
+            if (controller.route.isTransit() != (transit == 1))
+                continue;
+            if (!isPresent(controller.deviceAddr, controller.channel, 0))
+                continue;
+
+            picmg::AddressInfo info;
+            try {
+                if (controller.route.isTransit()) {
+                    IpmbBridgeScoped bridge(ipmi, controller.deviceAddr, controller.channel, controller.route);
+                    info = picmg::getAddressInfo(bridge);
+                } else {
+                    IpmbBridgeScoped shelf(ipmi, IPMI_SLAVE_ADDRESS_BMC, 0);
+                    info = picmg::getAddressInfo(shelf, controller.deviceAddr);
+                }
+            } catch (Provider::comm_error& e) {
+                if (disconnectOnTimeout(ipmi)) {
+                    // Sites are missing, topology will be built again
+                    LOG_WARN("%s, shelf topology incomplete", e.what());
+                    topology.fingerprint = 0;
+                    timedOut = true;
+                    break;
+                }
+                LOG_DEBUG("Controller %u on channel %u has no site - %s", controller.deviceAddr, controller.channel, e.what());
+                continue;
+            } catch (std::runtime_error& e) {
+                LOG_DEBUG("Controller %u on channel %u has no site - %s", controller.deviceAddr, controller.channel, e.what());
+                continue;
+            }
+
+            auto site = picmg::getSiteName(info);
+            if (site.empty())
+                continue;
+            if (controller.route.isTransit()) {
+                auto carrier = topology.find(controller.route.transitAddr, controller.route.transitChannel);
+                if (carrier && !carrier->site.empty())
+                    site = carrier->site + "." + site;
+            }
+            if (topology.siteIndex.find(site) != topology.siteIndex.end()) {
+                LOG_WARN("Site %s claimed by more than one controller, ignoring controller %u on channel %u",
+                         site.c_str(), controller.deviceAddr, controller.channel);
+                continue;
+            }
+
+            controller.site = site;
+            topology.siteIndex[site] = i;
+            nSites++;
+            LOG_DEBUG("Controller %u on channel %u is in site %s with %zu FRU devices",
+                      controller.deviceAddr, controller.channel, site.c_str(), controller.fruIds.size());
+        }
+    }
+
+    LOG_INFO("Shelf topology has %zu controllers, %zu in known sites", topology.controllers.size(), nSites);
+    m_topology = std::move(topology);
 }
 
+void FreeIpmiProvider::resolveTarget(const std::string& site, IpmbRoute& route, uint8_t& deviceAddr, uint8_t& channel, int fruId) const
+{
+    if (site.empty()) {
+        // Links without explicit route use the learned one
+        if (!route.isTransit()) {
+            auto controller = m_topology.find(deviceAddr, channel);
+            if (controller)
+                route = controller->route;
+        }
+        return;
+    }
+
+    auto controller = m_topology.findSite(site);
+    if (!controller)
+        throw Provider::absent_error("No controller in site '" + site + "'");
+    if (fruId >= 0 && std::find(controller->fruIds.begin(), controller->fruIds.end(), fruId) == controller->fruIds.end())
+        throw Provider::absent_error("No FRU " + std::to_string(fruId) + " in site '" + site + "'");
+
+    route      = controller->route;
+    deviceAddr = controller->deviceAddr;
+    channel    = controller->channel;
+}
+
+const FreeIpmiProvider::Topology::Controller* FreeIpmiProvider::Topology::find(uint8_t address, uint8_t channel) const
+{
+    auto it = controllerIndex.find(std::make_pair(address, channel));
+    if (it == controllerIndex.end())
+        return nullptr;
+    return &controllers[it->second];
+}
+
+const FreeIpmiProvider::Topology::Controller* FreeIpmiProvider::Topology::findSite(const std::string& site) const
+{
+    auto it = siteIndex.find(site);
+    if (it == siteIndex.end())
+        return nullptr;
+    return &controllers[it->second];
+}
 
 /*
  * ===== PicmgLedAddress implementation =====
  *
  * EPICS record link specification for SENSOR entities
- * @ipmi <conn> PICMG_LED <owner>:<channel>:<fru>:<led>
+ * @ipmi <conn> PICMG_LED [<transit addr>:<transit channel>/]<owner>:<channel>:<fru>:<led>
+ * @ipmi <conn> PICMG_LED <site>:<fru>:<led>
  * Example:
  * @ipmi IPMI1 PICMG_LED 130:5:1
+ * @ipmi IPMI1 PICMG_LED 130:0/114:7:0:2
+ * @ipmi IPMI1 PICMG_LED slot4.amc2:0:1
  */
 FreeIpmiProvider::PicmgLedAddress::PicmgLedAddress(const std::string& address)
 {
-    auto tokens = common::split(address, ':');
+    auto tokens = common::split(route.parse(address), ':');
+    // Site replaces owner and channel, they're resolved through topology
+    if (!tokens.empty() && !tokens[0].empty() && std::isalpha(tokens[0][0])) {
+        if (tokens.size() != 3 || route.isTransit())
+            throw Provider::syntax_error("Invalid PICMG LED address");
+        site = tokens[0];
+        tokens = { "0", "0", tokens[1], tokens[2] };
+    }
     if (tokens.size() != 4)
         throw Provider::syntax_error("Invalid PICMG LED address");
 
@@ -419,11 +716,13 @@ FreeIpmiProvider::PicmgLedAddress::PicmgLedAddress(uint8_t deviceAddr_, uint8_t
 
 std::string FreeIpmiProvider::PicmgLedAddress::get() const
 {
-    return std::to_string(deviceAddr) + ":" + std::to_string(channel) + ":" + std::to_string(fruId) + ":" + std::to_string(ledId);
+    return route.get() + std::to_string(deviceAddr) + ":" + std::to_string(channel) + ":" + std::to_string(fruId) + ":" + std::to_string(ledId);
 }
 
 bool FreeIpmiProvider::PicmgLedAddress::compare(const FreeIpmiProvider::PicmgLedAddress& other) const
 {
+    if (!(other.route == route))
+        return false;
     if (other.deviceAddr != deviceAddr)
         return false;
     if (other.channel != channel)
@@ -434,3 +733,45 @@ bool FreeIpmiProvider::PicmgLedAddress::compare(const FreeIpmiProvider::PicmgLed
         return false;
     return true;
 }
+
+/*
+ * ===== PicmgFruAddress implementation =====
+ *
+ * EPICS record link specification for PICMG_FRU entities, output records only
+ * @ipmi <conn> PICMG_FRU [<transit addr>:<transit channel>/]<owner>:<channel>:<fru> ACTIVATION
+ * @ipmi <conn> PICMG_FRU <site>:<fru> ACTIVATION
+ * Example:
+ * @ipmi IPMI1 PICMG_FRU 130:0:0 ACTIVATION
+ * @ipmi IPMI1 PICMG_FRU slot4.amc2:0 ACTIVATION
+ */
+FreeIpmiProvider::PicmgFruAddress::PicmgFruAddress(const std::string& address)
+{
+    auto sections = common::split(route.parse(address), ' ');
+    if (sections.size() != 2 || sections[1] != "ACTIVATION")
+        throw Provider::syntax_error("Invalid PICMG FRU address");
+    control = sections[1];
+
+    auto tokens = common::split(sections[0], ':');
+    // Site replaces owner and channel, they're resolved through topology
+    if (!tokens.empty() && !tokens[0].empty() && std::isalpha(tokens[0][0])) {
+        if (tokens.size() != 2 || route.isTransit())
+            throw Provider::syntax_error("Invalid PICMG FRU address");
+        site = tokens[0];
+        tokens = { "0", "0", tokens[1] };
+    }
+    if (tokens.size() != 3)
+        throw Provider::syntax_error("Invalid PICMG FRU address");
+
+    try {
+        deviceAddr = std::stoi(tokens[0]) & 0xFF;
+        channel    = std::stoi(tokens[1]) & 0xFF;
+        fruId      = std::stoi(tokens[2]) & 0xFF;
+    } catch (std::invalid_argument) {
+        throw Provider::syntax_error("Invalid PICMG FRU address");
+    }
+}
+
+std::string FreeIpmiProvider::PicmgFruAddress::get() const
+{
+    return route.get() + std::to_string(deviceAddr) + ":" + std::to_string(channel) + ":" + std::to_string(fruId) + " " + control;
+}
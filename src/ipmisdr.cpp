@@ -0,0 +1,259 @@
+/* ipmisdr.cpp
+ *
+ * Copyright (c) 2026 Oak Ridge National Laboratory.
+ * All rights reserved.
+ * See file LICENSE that is included with this distribution.
+ *
+ * @author agent
+ * @date Oct 2026
+ */
+
+#include "freeipmiprovider.h"
+
+void FreeIpmiProvider::buildSdrCatalog(ipmi_sdr_ctx_t sdr, SdrCatalog& catalog)
+{
+    catalog = SdrCatalog();
+
+    if (ipmi_sdr_cache_first(sdr) < 0)
+        throw std::runtime_error("failed to rewind SDR cache - " + std::string(ipmi_sdr_ctx_errormsg(sdr)));
+
+    do {
+        uint8_t recordType;
+        if (ipmi_sdr_parse_record_id_and_type(sdr, NULL, 0, NULL, &recordType) < 0) {
+            LOG_WARN("Failed to parse SDR record type - %s, skipping", ipmi_sdr_ctx_errormsg(sdr));
+            continue;
+        }
+
+        if (recordType != IPMI_SDR_FORMAT_FULL_SENSOR_RECORD &&
+            recordType != IPMI_SDR_FORMAT_COMPACT_SENSOR_RECORD &&
+            recordType != IPMI_SDR_FORMAT_FRU_DEVICE_LOCATOR_RECORD &&
+            recordType != IPMI_SDR_FORMAT_MANAGEMENT_CONTROLLER_DEVICE_LOCATOR_RECORD &&
+            recordType != IPMI_SDR_FORMAT_ENTITY_ASSOCIATION_RECORD)
+            continue;
+
+        SdrRecord record;
+        int size = ipmi_sdr_cache_record_read(sdr, record.data, record.max_size);
+        if (size < 0) {
+            LOG_DEBUG("Failed to read SDR record - %s, skipping", ipmi_sdr_ctx_errormsg(sdr));
+            continue;
+        }
+        record.size = size;
+
+        // FNV-1a, cheap and good enough to detect SDR changes
+        catalog.fingerprint ^= recordType;
+        for (size_t i = 0; i < record.size; i++) {
+            catalog.fingerprint ^= record.data[i];
+            catalog.fingerprint *= 16777619u;
+        }
+
+        try {
+            if (recordType == IPMI_SDR_FORMAT_FULL_SENSOR_RECORD || recordType == IPMI_SDR_FORMAT_COMPACT_SENSOR_RECORD) {
+                SensorAddress address(sdr, record);
+                uint8_t entityId;
+                uint8_t entityInstance;
+                if (ipmi_sdr_parse_entity_id_instance_type(sdr, record.data, record.size, &entityId, &entityInstance, NULL) < 0)
+                    throw Provider::process_error("Failed to read SDR entity info - " + std::string(ipmi_sdr_ctx_errormsg(sdr)));
+                uint8_t sensorType;
+                if (ipmi_sdr_parse_sensor_type(sdr, record.data, record.size, &sensorType) < 0)
+                    throw Provider::process_error("Failed to read SDR sensor type - " + std::string(ipmi_sdr_ctx_errormsg(sdr)));
+
+                SdrCatalog::Sensor sensor{std::move(record), address, entityId, entityInstance, sensorType};
+
+                catalog.sensorIndex[sensor.address.get()] = catalog.sensors.size();
+                catalog.sensors.emplace_back(std::move(sensor));
+
+            } else if (recordType == IPMI_SDR_FORMAT_FRU_DEVICE_LOCATOR_RECORD) {
+                FruAddress address(sdr, record);
+                uint8_t entityId;
+                uint8_t entityInstance;
+                if (ipmi_sdr_parse_fru_entity_id_and_instance(sdr, record.data, record.size, &entityId, &entityInstance) < 0)
+                    throw Provider::process_error("Failed to read SDR entity info - " + std::string(ipmi_sdr_ctx_errormsg(sdr)));
+
+                auto name = getFruName(sdr, record);
+                auto desc = getFruDesc(sdr, record);
+
+                SdrCatalog::Fru fru{std::move(record), address, name, desc, entityId, entityInstance};
+
+                catalog.fruNames[std::make_pair(entityId, entityInstance)] = fru.name;
+                catalog.fruIndex[fru.address.getDevice()] = catalog.frus.size();
+                catalog.frus.emplace_back(std::move(fru));
+
+            } else if (recordType == IPMI_SDR_FORMAT_MANAGEMENT_CONTROLLER_DEVICE_LOCATOR_RECORD) {
+                catalog.controllers.emplace_back(std::move(record));
+
+            } else if (recordType == IPMI_SDR_FORMAT_ENTITY_ASSOCIATION_RECORD) {
+                catalog.entityAssocs.emplace_back(std::move(record));
+            }
+        } catch (std::runtime_error& e) {
+            LOG_DEBUG(std::string(e.what()) + ", skipping");
+        }
+    } while (ipmi_sdr_cache_next(sdr) == 1);
+
+    learnRoutes(catalog);
+    assocEntityNames(catalog, catalog.fruNames);
+    assocHotSwapSensors(catalog);
+}
+
+static const size_t ENTITY_ASSOC_RECORD_LENGTH = 16;
+static const size_t MC_LOCATOR_RECORD_LENGTH = 16;
+
+/**
+ * @brief Get entities listed in Entity Association record, IPMI 2.0 spec section 43.4.
+ */
+static std::vector<std::pair<uint8_t,uint8_t>> getContainedEntities(const uint8_t* data)
+{
+    std::vector<std::pair<uint8_t,uint8_t>> contained;
+    bool range = (data[7] & 0x80);
+    for (size_t i = 8; i < ENTITY_ASSOC_RECORD_LENGTH; i += (range ? 4 : 2)) {
+        uint8_t entityId = data[i];
+        if (entityId == 0)
+            continue;
+        if (range) {
+            for (unsigned instance = data[i+1]; instance <= data[i+3]; instance++)
+                contained.emplace_back(entityId, instance);
+        } else {
+            contained.emplace_back(entityId, data[i+1]);
+        }
+    }
+    return contained;
+}
+
+/*
+ * Controller contained in entity of another controller but sitting on a
+ * different channel, like AMC MMC on carrier's IPMB-L, can only be reached
+ * through the containing controller. Everything else is at most a single
+ * bridge away from BMC, which is always cheaper and used by default.
+ * Management Controller Device Locator layout is in IPMI 2.0 spec, section 43.9.
+ */
+void FreeIpmiProvider::learnRoutes(SdrCatalog& catalog)
+{
+    std::map<std::pair<uint8_t,uint8_t>, std::pair<uint8_t,uint8_t>> controllers; // address and channel by entity
+    for (auto& record: catalog.controllers) {
+        if (record.size >= MC_LOCATOR_RECORD_LENGTH)
+            controllers[std::make_pair(record.data[12], record.data[13])] = std::make_pair(record.data[5] & 0xFE, record.data[6] & 0x0F);
+    }
+
+    for (auto& record: catalog.entityAssocs) {
+        if (record.size < ENTITY_ASSOC_RECORD_LENGTH)
+            continue;
+
+        auto container = controllers.find(std::make_pair(record.data[5], record.data[6]));
+        if (container == controllers.end())
+            continue;
+        // BMC bridges to any of its channels directly
+        if (container->second.first == IPMI_SLAVE_ADDRESS_BMC && container->second.second == 0)
+            continue;
+
+        IpmbRoute route;
+        route.transitAddr    = container->second.first;
+        route.transitChannel = container->second.second;
+
+        for (auto& entity: getContainedEntities(record.data)) {
+            auto contained = controllers.find(entity);
+            if (contained == controllers.end() || contained->second.second == route.transitChannel)
+                continue;
+
+            auto it = catalog.routes.find(contained->second);
+            if (it != catalog.routes.end() && !(it->second == route)) {
+                LOG_WARN("Ambiguous route to controller %u on channel %u, using %s",
+                         contained->second.first, contained->second.second, it->second.get().c_str());
+                continue;
+            }
+            catalog.routes[contained->second] = route;
+        }
+    }
+
+    if (catalog.routes.empty())
+        return;
+
+    // Addresses from SDR carry their route, indexes need to follow
+    catalog.sensorIndex.clear();
+    for (size_t i = 0; i < catalog.sensors.size(); i++) {
+        auto& address = catalog.sensors[i].address;
+        address.route = catalog.findRoute(address.ownerId << 1, address.channel);
+        catalog.sensorIndex[address.get()] = i;
+    }
+    catalog.fruIndex.clear();
+    for (size_t i = 0; i < catalog.frus.size(); i++) {
+        auto& address = catalog.frus[i].address;
+        address.route = catalog.findRoute(address.deviceAddr, address.channel);
+        catalog.fruIndex[address.getDevice()] = i;
+    }
+}
+
+FreeIpmiProvider::IpmbRoute FreeIpmiProvider::SdrCatalog::findRoute(uint8_t address, uint8_t channel) const
+{
+    auto it = routes.find(std::make_pair(address, channel));
+    if (it == routes.end())
+        return IpmbRoute();
+    return it->second;
+}
+
+/*
+ * PICMG hot-swap sensor shares entity with the FRU it describes. When there's
+ * no FRU device locator for that entity, it's the management controller itself.
+ * Management Controller Device Locator layout is in IPMI 2.0 spec, section 43.9.
+ */
+void FreeIpmiProvider::assocHotSwapSensors(SdrCatalog& catalog)
+{
+    static const uint8_t PICMG_HOT_SWAP_SENSOR_TYPE = 0xF0;
+
+    for (size_t i = 0; i < catalog.sensors.size(); i++) {
+        auto& sensor = catalog.sensors[i];
+        if (sensor.sensorType != PICMG_HOT_SWAP_SENSOR_TYPE)
+            continue;
+
+        auto entity = std::make_pair(sensor.entityId, sensor.entityInstance);
+        // Sensor owner is stored in 7-bit form
+        FruTarget target(sensor.address.ownerId << 1, sensor.address.channel, 0);
+        bool found = false;
+        for (auto& fru: catalog.frus) {
+            if (fru.entityId == entity.first && fru.entityInstance == entity.second) {
+                target = FruTarget(fru.address.deviceAddr, fru.address.channel, fru.address.fruId);
+                found = true;
+                break;
+            }
+        }
+        for (size_t j = 0; !found && j < catalog.controllers.size(); j++) {
+            auto& record = catalog.controllers[j];
+            if (record.size >= MC_LOCATOR_RECORD_LENGTH && record.data[12] == entity.first && record.data[13] == entity.second) {
+                target = FruTarget(record.data[5] & 0xFE, record.data[6] & 0x0F, 0);
+                found = true;
+            }
+        }
+
+        catalog.hotswapIndex[entity] = catalog.hotswap.size();
+        catalog.hotswap.push_back({i, target});
+    }
+}
+
+/*
+ * Entities contained in an entity that has a FRU device, ie. sensors on a
+ * board, inherit the FRU name unless they have FRU device of their own.
+ * Entity Association record layout is described in IPMI 2.0 spec, section 43.4.
+ */
+void FreeIpmiProvider::assocEntityNames(const SdrCatalog& catalog, std::map<std::pair<uint8_t,uint8_t>,std::string>& names)
+{
+    // Containers can be nested, repeat until there's nothing new
+    bool changed = true;
+    for (size_t depth = 0; changed && depth < 8; depth++) {
+        changed = false;
+
+        for (auto& record: catalog.entityAssocs) {
+            if (record.size < ENTITY_ASSOC_RECORD_LENGTH)
+                continue;
+
+            auto container = names.find(std::make_pair(record.data[5], record.data[6]));
+            if (container == names.end())
+                continue;
+
+            auto contained = getContainedEntities(record.data);
+            for (auto& entity: contained) {
+                if (names.find(entity) == names.end()) {
+                    names[entity] = container->second;
+                    changed = true;
+                }
+            }
+        }
+    }
+}
@@ -11,41 +11,255 @@
 #include "freeipmiprovider.h"
 
 #include <alarm.h> // from EPICS
+#include <algorithm>
+#include <cctype>
 #include <cmath>
+#include <set>
 
-FreeIpmiProvider::Entity FreeIpmiProvider::getSensor(ipmi_sdr_ctx_t sdr, ipmi_sensor_read_ctx_t sensors, const SensorAddress& address)
+FreeIpmiProvider::Entity FreeIpmiProvider::getSensor(ipmi_ctx_t ipmi, ipmi_sdr_ctx_t sdr, ipmi_sensor_read_ctx_t sensors, const SdrCatalog& catalog, const SensorAddress& address)
 {
-    if (ipmi_sdr_cache_first(sdr) < 0)
-        throw Provider::process_error("failed to rewind SDR cache - " + std::string(ipmi_sdr_ctx_errormsg(sdr)));
+    auto it = catalog.sensorIndex.find(address.get());
+    if (it == catalog.sensorIndex.end())
+        throw Provider::comm_error("sensor not found");
 
-    do {
-        uint8_t recordType;
-        if (ipmi_sdr_parse_record_id_and_type(sdr, NULL, 0, NULL, &recordType) < 0)
-            continue;
+    return getSensor(ipmi, sdr, sensors, catalog.sensors[it->second]);
+}
 
-        if (recordType != IPMI_SDR_FORMAT_FULL_SENSOR_RECORD && recordType != IPMI_SDR_FORMAT_COMPACT_SENSOR_RECORD)
-            continue;
+void FreeIpmiProvider::resolveSensor(SensorAddress& address) const
+{
+    // Sensor owner is stored in 7-bit form
+    uint8_t ownerAddr = address.ownerId << 1;
+    resolveTarget(address.site, address.route, ownerAddr, address.channel);
+    address.ownerId = ownerAddr >> 1;
+}
 
-        SdrRecord record;
-        record.size = ipmi_sdr_cache_record_read(sdr, record.data, IPMI_SDR_MAX_RECORD_LENGTH);
-        if (record.size < 0)
-            continue;
+FreeIpmiProvider::Entity FreeIpmiProvider::readSensor(SensorAddress& address)
+{
+    resolveSensor(address);
+    checkPresent(m_sdrCatalog, address);
+    return getSensor(m_ctx.ipmi, m_ctx.sdr, m_ctx.sensors, m_sdrCatalog, address);
+}
 
-        try {
-            SensorAddress tmp(sdr, record);
-            if (!tmp.compare(address))
-                continue;
-        } catch (...) {
-            continue;
+/*
+ * Record linked to a field other than VAL gets that field as its value.
+ * Alarm is only passed on when sensor couldn't be read, thresholds and
+ * raw value don't alarm by themselves. Event mask and its bits are valid
+ * even when reading is not.
+ */
+FreeIpmiProvider::Entity FreeIpmiProvider::selectSensorField(const Entity& sensor, const std::string& field)
+{
+    if (field.empty())
+        return sensor;
+
+    Entity entity;
+    bool alarm = true;
+    if (field == "SEVR" || field == "STAT") {
+        entity["VAL"] = sensor.getField<int>(field, 0);
+        alarm = false;
+    } else if (field.compare(0, 3, "BIT") == 0) {
+        auto mask = sensor.find("MASK");
+        if (mask != sensor.end()) {
+            entity["VAL"] = (sensor.getField<int>("MASK", 0) >> std::stoi(field.substr(3))) & 0x1;
+            alarm = false;
+        } else {
+            entity["VAL"] = 0;
+        }
+    } else {
+        auto it = sensor.find(field);
+        if (it != sensor.end()) {
+            entity["VAL"] = it->second;
+            alarm = (field != "MASK");
+        } else if (field == "MASK") {
+            entity["VAL"] = 0;
+        } else {
+            throw Provider::process_error("Sensor " + sensor.getField<std::string>("INP", "") + " has no " + field);
+        }
+    }
+
+    auto sevr = sensor.getField<int>("SEVR", epicsSevNone);
+    if (alarm && sevr == epicsSevInvalid) {
+        entity["SEVR"] = sevr;
+        entity["STAT"] = sensor.getField<int>("STAT", epicsAlarmUDF);
+    }
+    for (auto& name: { "EGU", "DESC" }) {
+        auto it = sensor.find(name);
+        if (it != sensor.end())
+            entity[name] = it->second;
+    }
+    return entity;
+}
+
+/*
+ * Set Sensor Thresholds and Get Sensor Thresholds are described in IPMI 2.0
+ * spec, sections 35.8 and 35.9. Both carry thresholds in the order below,
+ * bit N of the mask selects threshold N. Readable and settable threshold
+ * masks are in bytes 19 and 20 of full and compact sensor records, section 43.
+ */
+static const std::vector<std::string> THRESHOLD_FIELDS = { "LNC", "LC", "LNR", "UNC", "UC", "UNR" };
+static const size_t SENSOR_RECORD_THRESHOLD_MASKS = 18;
+
+std::vector<FreeIpmiProvider::Entity> FreeIpmiProvider::getSensorThresholdOutputs(ipmi_sdr_ctx_t sdr, const SdrCatalog::Sensor& sensor)
+{
+    std::vector<Entity> outputs;
+
+    auto& record = sensor.record;
+    uint8_t readingType;
+    if (ipmi_sdr_parse_event_reading_type_code(sdr, record.data, record.size, &readingType) < 0 ||
+        readingType != IPMI_EVENT_READING_TYPE_CODE_CLASS_THRESHOLD ||
+        record.size < SENSOR_RECORD_THRESHOLD_MASKS + 2)
+        return outputs;
+
+    double* thresholds[6] = { nullptr };
+    if (ipmi_sdr_parse_thresholds(sdr, record.data, record.size,
+                                  &thresholds[0], &thresholds[1], &thresholds[2],
+                                  &thresholds[3], &thresholds[4], &thresholds[5]) < 0)
+        return outputs;
+
+    uint8_t settable = record.data[SENSOR_RECORD_THRESHOLD_MASKS + 1];
+    for (size_t i = 0; i < THRESHOLD_FIELDS.size(); i++) {
+        if (settable & (1 << i)) {
+            Entity output;
+            output["OUT"] = "SENSOR " + sensor.address.get() + " " + THRESHOLD_FIELDS[i];
+            output["NAME"] = THRESHOLD_FIELDS[i];
+            output["EGU"] = getSensorUnits(sdr, record);
+            output["DESC"] = getSensorDesc(sdr, record);
+            output["VAL"] = (thresholds[i] ? *thresholds[i] : 0.0);
+            outputs.emplace_back(std::move(output));
         }
+    }
+    for (auto threshold: thresholds)
+        free(threshold);
+
+    return outputs;
+}
+
+std::vector<int> FreeIpmiProvider::getSensorThresholds(ipmi_ctx_t ipmi, const SdrCatalog::Sensor& sensor)
+{
+    uint8_t rq[] = { IPMI_CMD_GET_SENSOR_THRESHOLDS, sensor.address.sensorNum };
+    uint8_t rs[16];
+
+    // Sensor owner is stored in 7-bit form
+    IpmbBridgeScoped bridge(ipmi, sensor.address.ownerId << 1, sensor.address.channel, sensor.address.route);
+    int len = bridge.cmdRaw(sensor.address.ownerLun, IPMI_NET_FN_SENSOR_EVENT_RQ, rq, sizeof(rq), rs, sizeof(rs));
+    if (len < 0)
+        throw Provider::comm_error("failed to read sensor " + sensor.address.get() + " thresholds - " + bridge.errormsg());
+    if (len < 9 || rs[0] != rq[0] || rs[1] != 0)
+        throw Provider::process_error("failed to decode sensor " + sensor.address.get() + " thresholds");
+
+    std::vector<int> thresholds(THRESHOLD_FIELDS.size(), -1);
+    for (size_t i = 0; i < thresholds.size(); i++) {
+        if (rs[2] & (1 << i))
+            thresholds[i] = rs[3 + i];
+    }
+    return thresholds;
+}
 
-        return getSensor(sdr, sensors, record);
-    } while (ipmi_sdr_cache_next(sdr) == 1);
+void FreeIpmiProvider::setSensorThresholds(ipmi_ctx_t ipmi, const SdrCatalog::Sensor& sensor, uint8_t mask, const std::vector<uint8_t>& thresholds)
+{
+    uint8_t rq[9] = { IPMI_CMD_SET_SENSOR_THRESHOLDS, sensor.address.sensorNum, mask };
+    uint8_t rs[16];
+    for (size_t i = 0; i < THRESHOLD_FIELDS.size() && i < thresholds.size(); i++)
+        rq[3 + i] = thresholds[i];
+
+    // Sensor owner is stored in 7-bit form
+    IpmbBridgeScoped bridge(ipmi, sensor.address.ownerId << 1, sensor.address.channel, sensor.address.route);
+    int len = bridge.cmdRaw(sensor.address.ownerLun, IPMI_NET_FN_SENSOR_EVENT_RQ, rq, sizeof(rq), rs, sizeof(rs));
+    if (len < 0)
+        throw Provider::comm_error("failed to set sensor " + sensor.address.get() + " thresholds - " + bridge.errormsg());
+    if (len < 2 || rs[0] != rq[0])
+        throw Provider::process_error("failed to decode sensor " + sensor.address.get() + " set thresholds response");
+    if (rs[1] != 0)
+        throw Provider::process_error("sensor " + sensor.address.get() + " rejected thresholds, completion code " + std::to_string(rs[1]));
+}
 
-    throw Provider::comm_error("sensor not found");
+double FreeIpmiProvider::decodeThreshold(ipmi_sdr_ctx_t sdr, const SdrCatalog::Sensor& sensor, uint8_t raw)
+{
+    int8_t rExponent;
+    int8_t bExponent;
+    int16_t m;
+    int16_t b;
+    uint8_t linearization;
+    uint8_t analogDataFormat;
+    double value;
+    if (ipmi_sdr_parse_sensor_decoding_data(sdr, sensor.record.data, sensor.record.size, &rExponent, &bExponent, &m, &b, &linearization, &analogDataFormat) < 0 ||
+        ipmi_sensor_decode_value(rExponent, bExponent, m, b, linearization, analogDataFormat, raw, &value) < 0)
+        throw Provider::process_error("failed to convert sensor " + sensor.address.get() + " threshold");
+    return std::round(value * 100.0) / 100.0;
 }
 
-FreeIpmiProvider::Entity FreeIpmiProvider::getSensor(ipmi_sdr_ctx_t sdr, ipmi_sensor_read_ctx_t sensors, const SdrRecord& record)
+uint8_t FreeIpmiProvider::encodeThreshold(ipmi_sdr_ctx_t sdr, const SdrCatalog::Sensor& sensor, double value)
+{
+    int8_t rExponent;
+    int8_t bExponent;
+    int16_t m;
+    int16_t b;
+    uint8_t linearization;
+    uint8_t analogDataFormat;
+    uint8_t raw;
+    if (ipmi_sdr_parse_sensor_decoding_data(sdr, sensor.record.data, sensor.record.size, &rExponent, &bExponent, &m, &b, &linearization, &analogDataFormat) < 0 ||
+        ipmi_sensor_decode_raw_value(rExponent, bExponent, m, b, linearization, analogDataFormat, value, &raw) < 0)
+        throw Provider::process_error("failed to convert sensor " + sensor.address.get() + " threshold");
+    return raw;
+}
+
+const FreeIpmiProvider::SdrCatalog::Sensor& FreeIpmiProvider::findThresholdSensor(SensorAddress& address)
+{
+    resolveSensor(address);
+    checkPresent(m_sdrCatalog, address);
+
+    auto it = m_sdrCatalog.sensorIndex.find(address.get());
+    if (it == m_sdrCatalog.sensorIndex.end())
+        throw Provider::comm_error("sensor not found");
+    return m_sdrCatalog.sensors[it->second];
+}
+
+FreeIpmiProvider::Entity FreeIpmiProvider::readSensorThreshold(SensorAddress& address)
+{
+    auto& sensor = findThresholdSensor(address);
+    auto thresholds = getSensorThresholds(m_ctx.ipmi, sensor);
+    auto raw = thresholds[address.getThreshold()];
+    if (raw < 0)
+        throw Provider::process_error("sensor " + address.get() + " threshold " + address.field + " not readable");
+
+    Entity entity;
+    entity["VAL"] = decodeThreshold(m_ctx.sdr, sensor, raw);
+    entity["EGU"] = getSensorUnits(m_ctx.sdr, sensor.record);
+    return entity;
+}
+
+/*
+ * Set Sensor Thresholds only changes thresholds selected in the mask, all
+ * pending writes to one sensor go out together. Only thresholds that read
+ * back as written are reported, the ones that can't be read are trusted.
+ */
+FreeIpmiProvider::Entity FreeIpmiProvider::writeSensorThresholds(SensorAddress& address, const std::map<int,double>& thresholds)
+{
+    auto& sensor = findThresholdSensor(address);
+
+    uint8_t mask = 0;
+    std::vector<uint8_t> raw(THRESHOLD_FIELDS.size(), 0);
+    for (auto& kv: thresholds) {
+        mask |= (1 << kv.first);
+        raw[kv.first] = encodeThreshold(m_ctx.sdr, sensor, kv.second);
+    }
+    setSensorThresholds(m_ctx.ipmi, sensor, mask, raw);
+
+    auto readback = getSensorThresholds(m_ctx.ipmi, sensor);
+
+    Entity entity;
+    for (auto& kv: thresholds) {
+        auto& field = THRESHOLD_FIELDS[kv.first];
+        if (readback[kv.first] >= 0 && readback[kv.first] != raw[kv.first]) {
+            LOG_WARN("Sensor %s threshold %s not applied", address.get().c_str(), field.c_str());
+            continue;
+        }
+        entity[field] = decodeThreshold(m_ctx.sdr, sensor, raw[kv.first]);
+    }
+    entity["EGU"] = getSensorUnits(m_ctx.sdr, sensor.record);
+    return entity;
+}
+
+FreeIpmiProvider::Entity FreeIpmiProvider::getSensorMetadata(ipmi_sdr_ctx_t sdr, const SdrRecord& record)
 {
     Entity entity;
 
@@ -63,13 +277,75 @@ FreeIpmiProvider::Entity FreeIpmiProvider::getSensor(ipmi_sdr_ctx_t sdr, ipmi_se
     entity["NAME"] = getSensorName(sdr, record);
     entity["DESC"] = getSensorDesc(sdr, record);
 
+    uint8_t readingType;
+    if (ipmi_sdr_parse_event_reading_type_code(sdr, record.data, record.size, &readingType) >= 0 &&
+        readingType == IPMI_EVENT_READING_TYPE_CODE_CLASS_THRESHOLD) {
+
+        double* lowMinor;
+        double* lowAlarm;
+        double* lowCritical;
+        double* highMinor;
+        double* highAlarm;
+        double* highCritical;
+        if (ipmi_sdr_parse_thresholds(sdr, record.data, record.size,
+                                      &lowMinor, &lowAlarm, &lowCritical,
+                                      &highMinor, &highAlarm, &highCritical) >= 0) {
+            if (lowMinor)   entity["LOW"]  = *lowMinor;
+            if (lowAlarm)   entity["LOLO"] = *lowAlarm;
+            if (highMinor)  entity["HIGH"] = *highMinor;
+            if (highAlarm)  entity["HIHI"] = *highAlarm;
+            free(lowMinor);
+            free(lowAlarm);
+            free(lowCritical);
+            free(highMinor);
+            free(highAlarm);
+            free(highCritical);
+        }
+    }
+
+    return entity;
+}
+
+FreeIpmiProvider::Entity FreeIpmiProvider::getSensor(ipmi_ctx_t ipmi, ipmi_sdr_ctx_t sdr, ipmi_sensor_read_ctx_t sensors, const SdrCatalog::Sensor& sensor)
+{
+    auto& record = sensor.record;
+    Entity entity = getSensorMetadata(sdr, record);
+    entity["INP"] = "SENSOR " + sensor.address.get();
+
+    // Discrete sensors have no reading, their state is in event mask
+    uint8_t readingType;
+    bool discrete = (ipmi_sdr_parse_event_reading_type_code(sdr, record.data, record.size, &readingType) >= 0 &&
+                     readingType != IPMI_EVENT_READING_TYPE_CODE_CLASS_THRESHOLD);
+
     int sharedOffset = 0; // TODO: shared sensors support
     uint8_t readingRaw = 0;
     double* reading = nullptr;
+    double transitReading = 0.0;
     uint16_t eventMask = 0;
-    if (ipmi_sensor_read(sensors, record.data, record.size, sharedOffset, &readingRaw, &reading, &eventMask) <= 0) {
+    int errnum;
+    int ret;
+    if (sensor.address.route.isTransit()) {
+        // FreeIPMI can only bridge once
+        ret = readTransitSensor(ipmi, sdr, sensor, readingRaw, transitReading, eventMask, errnum);
+        if (ret > 0)
+            reading = &transitReading;
+    } else {
+        ret = ipmi_sensor_read(sensors, record.data, record.size, sharedOffset, &readingRaw, &reading, &eventMask);
+        errnum = ipmi_sensor_read_ctx_errnum(sensors);
+        // Session or IPMB target not responding, as opposed to sensor not being able to provide reading
+        if (ret < 0 && errnum == IPMI_SENSOR_READ_ERR_IPMI_ERROR &&
+            (ipmi_ctx_errnum(ipmi) == IPMI_ERR_SESSION_TIMEOUT || ipmi_ctx_errnum(ipmi) == IPMI_ERR_MESSAGE_TIMEOUT)) {
+            throw Provider::comm_error("failed to read sensor " + sensor.address.get() + " - " + ipmi_ctx_errormsg(ipmi));
+        }
+    }
+    // Event mask is valid even when reading is not
+    if (ret >= 0)
+        entity["MASK"] = (int)eventMask;
+    if (discrete && ret >= 0) {
+        entity["VAL"] = (int)eventMask;
+    } else if (ret <= 0) {
         entity["SEVR"] = epicsSevInvalid;
-        switch (ipmi_sensor_read_ctx_errnum(sensors)) {
+        switch (errnum) {
             case IPMI_SENSOR_READ_ERR_SENSOR_NON_ANALOG:
             case IPMI_SENSOR_READ_ERR_SENSOR_NON_LINEAR:
                 entity["STAT"] = epicsAlarmCalc;
@@ -88,111 +364,301 @@ FreeIpmiProvider::Entity FreeIpmiProvider::getSensor(ipmi_sdr_ctx_t sdr, ipmi_se
                 break;
         }
 
-        LOG_DEBUG("Failed to read sensor value (%s) - %s", address.get().c_str(), ipmi_sensor_read_ctx_errormsg(sensors));
+        LOG_DEBUG("Failed to read sensor value (%s) - %s", entity.getField<std::string>("INP", "").c_str(), ipmi_sensor_read_ctx_strerror(errnum));
+    } else if (reading) {
+        // TODO: readingType == IPMI_EVENT_READING_TYPE_CODE_CLASS_GENERIC_DISCRETE ???
+        entity["VAL"] = std::round(*reading * 100.0) / 100.0;
+        entity["RVAL"] = readingRaw;
     } else {
-
-        uint8_t readingType;
-        if (ipmi_sdr_parse_event_reading_type_code(sdr, record.data, record.size, &readingType) < 0) {
-            LOG_DEBUG("Failed to read sensor value type (%s) - %s", address.get().c_str(), ipmi_sdr_ctx_errormsg(sdr));
-
-        } else {
-
-            if (reading) {
-                // TODO: readingType == IPMI_EVENT_READING_TYPE_CODE_CLASS_GENERIC_DISCRETE ???
-                entity["VAL"] = std::round(*reading * 100.0) / 100.0;
-                entity["RVAL"] = readingRaw;
-            } else {
-                entity["VAL"] = 0.0;
-                entity["SEVR"] = epicsSevInvalid;
-                entity["STAT"] = epicsAlarmCalc;
-            }
-
-            if (readingType == IPMI_EVENT_READING_TYPE_CODE_CLASS_THRESHOLD) {
-                double* lowMinor;
-                double* lowAlarm;
-                double* lowCritical;
-                double* highMinor;
-                double* highAlarm;
-                double* highCritical;
-                if (ipmi_sdr_parse_thresholds(sdr, record.data, record.size,
-                                              &lowMinor, &lowAlarm, &lowCritical,
-                                              &highMinor, &highAlarm, &highCritical) >= 0) {
-                    entity["LOW"] = *lowMinor;
-                    entity["LOLO"] = *lowAlarm;
-                    entity["HIGH"] = *highMinor;
-                    entity["HIHI"] = *highAlarm;
-                    free(lowMinor);
-                    free(lowAlarm);
-                    free(lowCritical);
-                    free(highMinor);
-                    free(highAlarm);
-                    free(highCritical);
-                }
-
-                // TODO: create OUT records for driving thresholds
-            }
-        }
+        entity["VAL"] = 0.0;
+        entity["SEVR"] = epicsSevInvalid;
+        entity["STAT"] = epicsAlarmCalc;
     }
 
-    if (reading)
+    if (reading && reading != &transitReading)
         free(reading);
 
     return entity;
 }
 
-std::vector<FreeIpmiProvider::Entity> FreeIpmiProvider::getSensors(ipmi_sdr_ctx_t sdr, ipmi_sensor_read_ctx_t sensors)
+/*
+ * Get Sensor Reading response layout is described in IPMI 2.0 spec, section 35.14.
+ * Like ipmi_sensor_read(), returns 1 when reading is valid, 0 when only event
+ * mask is valid and -1 when nothing could be read, with errnum set to matching
+ * IPMI_SENSOR_READ_ERR_* code so that caller can treat both paths the same.
+ * Threshold sensors report comparison status in the lower 6 bits of event
+ * mask, discrete sensors report up to 15 state bits. Only full records of
+ * threshold sensors with linear analog conversion are converted.
+ */
+int FreeIpmiProvider::readTransitSensor(ipmi_ctx_t ipmi, ipmi_sdr_ctx_t sdr, const SdrCatalog::Sensor& sensor, uint8_t& readingRaw, double& reading, uint16_t& eventMask, int& errnum)
 {
-    std::vector<Entity> v;
-
-    auto frus = getFruEntityNameAssoc(sdr);
-
-    if (ipmi_sdr_cache_first(sdr) < 0)
-        throw std::runtime_error("failed to rewind SDR cache - " + std::string(ipmi_sdr_ctx_errormsg(sdr)));
-
-    do {
-        uint8_t recordType;
-        if (ipmi_sdr_parse_record_id_and_type(sdr, NULL, 0, NULL, &recordType) < 0) {
-            LOG_WARN("Failed to parse SDR record type - %s, skipping", ipmi_sdr_ctx_errormsg(sdr));
-            continue;
-        }
-
-        if (recordType != IPMI_SDR_FORMAT_FULL_SENSOR_RECORD && recordType != IPMI_SDR_FORMAT_COMPACT_SENSOR_RECORD)
-            continue;
+    uint8_t rq[] = { IPMI_CMD_GET_SENSOR_READING, sensor.address.sensorNum };
+    uint8_t rs[16];
+
+    // Sensor owner is stored in 7-bit form
+    IpmbBridgeScoped bridge(ipmi, sensor.address.ownerId << 1, sensor.address.channel, sensor.address.route);
+    int len = bridge.cmdRaw(sensor.address.ownerLun, IPMI_NET_FN_SENSOR_EVENT_RQ, rq, sizeof(rq), rs, sizeof(rs));
+    if (len < 0)
+        throw Provider::comm_error("failed to read sensor " + sensor.address.get() + " - " + bridge.errormsg());
+
+    errnum = IPMI_SENSOR_READ_ERR_IPMI_ERROR;
+    if (len >= 2 && rs[1] == IPMI_COMP_CODE_NODE_BUSY)
+        errnum = IPMI_SENSOR_READ_ERR_NODE_BUSY;
+    else if (len >= 2 && rs[1] == IPMI_COMP_CODE_REQUESTED_SENSOR_DATA_OR_RECORD_NOT_PRESENT)
+        errnum = IPMI_SENSOR_READ_ERR_SENSOR_READING_CANNOT_BE_OBTAINED;
+    if (len < 4 || rs[0] != rq[0] || rs[1] != 0)
+        return -1;
+
+    if (rs[3] & 0x20) {
+        errnum = IPMI_SENSOR_READ_ERR_SENSOR_READING_UNAVAILABLE;
+        return -1;
+    }
+    if (!(rs[3] & 0x40)) {
+        errnum = IPMI_SENSOR_READ_ERR_SENSOR_SCANNING_DISABLED;
+        return -1;
+    }
 
-        SdrRecord record;
-        record.size = ipmi_sdr_cache_record_read(sdr, record.data, IPMI_SDR_MAX_RECORD_LENGTH);
-        if (record.size < 0) {
-            LOG_DEBUG("Failed to read SDR record - %s, skipping", ipmi_sdr_ctx_errormsg(sdr));
-            continue;
-        }
+    uint8_t recordType;
+    uint8_t readingType;
+    if (ipmi_sdr_parse_record_id_and_type(sdr, sensor.record.data, sensor.record.size, NULL, &recordType) < 0 ||
+        ipmi_sdr_parse_event_reading_type_code(sdr, sensor.record.data, sensor.record.size, &readingType) < 0) {
+        errnum = IPMI_SENSOR_READ_ERR_IPMI_ERROR;
+        return -1;
+    }
+    bool threshold = (readingType == IPMI_EVENT_READING_TYPE_CODE_CLASS_THRESHOLD);
+
+    // Threshold comparison status has no second byte, discrete state may have 15 bits
+    eventMask = 0;
+    if (len >= 5)
+        eventMask |= (threshold ? (rs[4] & 0x3F) : rs[4]);
+    if (len >= 6 && !threshold)
+        eventMask |= (rs[5] & 0x7F) << 8;
+    readingRaw = rs[2];
+
+    errnum = IPMI_SENSOR_READ_ERR_SENSOR_NON_ANALOG;
+    if (!threshold || recordType != IPMI_SDR_FORMAT_FULL_SENSOR_RECORD)
+        return 0;
+
+    int8_t rExponent;
+    int8_t bExponent;
+    int16_t m;
+    int16_t b;
+    uint8_t linearization;
+    uint8_t analogDataFormat;
+    if (ipmi_sdr_parse_sensor_decoding_data(sdr, sensor.record.data, sensor.record.size, &rExponent, &bExponent, &m, &b, &linearization, &analogDataFormat) < 0)
+        return 0;
+    if (!IPMI_SDR_ANALOG_DATA_FORMAT_VALID(analogDataFormat))
+        return 0;
+    if (!IPMI_SDR_LINEARIZATION_IS_LINEAR(linearization)) {
+        errnum = IPMI_SENSOR_READ_ERR_SENSOR_NON_LINEAR;
+        return 0;
+    }
+    if (ipmi_sensor_decode_value(rExponent, bExponent, m, b, linearization, analogDataFormat, readingRaw, &reading) < 0)
+        return 0;
+    errnum = IPMI_SENSOR_READ_ERR_SUCCESS;
+    return 1;
+}
 
-        // Need entity id for FRU association
-        uint8_t entityId;
-        uint8_t entityInstance;
-        if (ipmi_sdr_parse_entity_id_instance_type(sdr, record.data, record.size, &entityId, &entityInstance, NULL) < 0) {
-            LOG_DEBUG("Failed to read SDR entity info - %s, skipping", ipmi_sdr_ctx_errormsg(sdr));
-            continue;
-        }
+std::vector<FreeIpmiProvider::Entity> FreeIpmiProvider::getSensors(ipmi_ctx_t ipmi, ipmi_sdr_ctx_t sdr, ipmi_sensor_read_ctx_t sensors, const SdrCatalog& catalog, ScanMode mode)
+{
+    std::vector<Entity> v;
 
+    for (auto& entry: catalog.sensors) {
         Entity sensor;
         try {
-            sensor = getSensor(sdr, sensors, record);
+            if (mode == ScanMode::METADATA) {
+                sensor = getSensorMetadata(sdr, entry.record);
+                sensor["INP"] = "SENSOR " + entry.address.get();
+                // Value type determines record type
+                sensor["VAL"] = 0.0;
+            } else {
+                try {
+                    sensor = getSensor(ipmi, sdr, sensors, entry);
+                } catch (Provider::comm_error& e) {
+                    // Keep unreachable sensors in the report
+                    LOG_DEBUG(e.what());
+                    sensor = getSensorMetadata(sdr, entry.record);
+                    sensor["INP"] = "SENSOR " + entry.address.get();
+                    sensor["SEVR"] = (int)epicsSevInvalid;
+                    sensor["STAT"] = (int)epicsAlarmComm;
+                }
+            }
         } catch (std::runtime_error e) {
             LOG_DEBUG(std::string(e.what()) + ", skipping");
             continue;
         }
 
         // Check if we can assign sensor to a device
-        auto it = frus.find(std::make_pair(entityId, entityInstance));
-        if (it != frus.end())
+        auto it = catalog.fruNames.find(std::make_pair(entry.entityId, entry.entityInstance));
+        if (it != catalog.fruNames.end())
             sensor["NAME"] = it->second + ":" + sensor.getField<std::string>("NAME", "");
 
+        auto name = sensor.getField<std::string>("NAME", "");
         v.emplace_back(std::move(sensor));
-    } while (ipmi_sdr_cache_next(sdr) == 1);
+
+        // Settable thresholds get output records
+        if (mode == ScanMode::METADATA) {
+            for (auto& output: getSensorThresholdOutputs(sdr, entry)) {
+                output["NAME"] = name + ":" + output.getField<std::string>("NAME", "");
+                v.emplace_back(std::move(output));
+            }
+        }
+    }
 
     return v;
 }
 
+/*
+ * EPICS record link specification for SENSORS entities, waveform records only
+ * @ipmi <conn> SENSORS ALL|ENTITY <entity id>.<instance>|TYPE <sensor type> [SEVR|NAMES]
+ * Example:
+ * @ipmi IPMI1 SENSORS ALL
+ * @ipmi IPMI1 SENSORS ENTITY 10.96
+ * @ipmi IPMI1 SENSORS TYPE 1 SEVR
+ * @ipmi IPMI1 SENSORS TYPE 1 NAMES
+ *
+ * Values are in SDR order, SEVR selects companion array of severities and
+ * NAMES the array of sensor names (FTVL=STRING) telling which sensor is at
+ * each index. Companion arrays come from the same pass as values: a pass
+ * not yet returned to the record is used before reading sensors again, so
+ * records of one selector processed together share a single pass.
+ */
+FreeIpmiProvider::Entity FreeIpmiProvider::getSensorSet(const std::string& address, const std::string& selector)
+{
+    auto tokens = common::split(selector, ' ');
+    std::string variant;
+    if (!tokens.empty() && (tokens.back() == "SEVR" || tokens.back() == "NAMES")) {
+        variant = tokens.back();
+        tokens.pop_back();
+    }
+    std::string base;
+    for (auto& token: tokens)
+        base += (base.empty() ? "" : " ") + token;
+
+    auto select = [&](const SensorSet& set) {
+        Entity entity;
+        if (variant == "SEVR")
+            entity["VAL"] = set.severities;
+        else if (variant == "NAMES")
+            entity["VAL"] = set.names;
+        else
+            entity["VAL"] = set.values;
+        entity.time = set.time;
+        return entity;
+    };
+
+    {
+        common::ScopedLock lock(m_apiMutex);
+        auto it = m_sensorSets.find(base);
+        auto& seen = m_sensorSetsSeen[address];
+        if (it != m_sensorSets.end() && it->second.seq != seen) {
+            seen = it->second.seq;
+            return select(it->second);
+        }
+    }
+
+    auto set = readSensorSet(base);
+
+    common::ScopedLock lock(m_apiMutex);
+    set.seq = ++m_sensorSetSeq;
+    m_sensorSetsSeen[address] = set.seq;
+    auto& stored = m_sensorSets[base];
+    stored = std::move(set);
+    return select(stored);
+}
+
+/*
+ * Matching sensors are picked once, then read taking API lock for one
+ * sensor at a time. Catalog may be rebuilt in between, sensors are looked
+ * up by address each time and the ones that went away stay invalid.
+ */
+FreeIpmiProvider::SensorSet FreeIpmiProvider::readSensorSet(const std::string& selector)
+{
+    auto tokens = common::split(selector, ' ');
+    std::function<bool(const SdrCatalog::Sensor&)> match;
+    try {
+        if (tokens.size() == 1 && tokens[0] == "ALL") {
+            match = [](const SdrCatalog::Sensor&) { return true; };
+        } else if (tokens.size() == 2 && tokens[0] == "ENTITY") {
+            auto entity = common::split(tokens[1], '.');
+            if (entity.size() != 2)
+                throw Provider::syntax_error("Invalid sensors selector '" + selector + "'");
+            uint8_t entityId = std::stoi(entity[0]) & 0xFF;
+            uint8_t entityInstance = std::stoi(entity[1]) & 0xFF;
+            match = [entityId, entityInstance](const SdrCatalog::Sensor& sensor) {
+                return (sensor.entityId == entityId && sensor.entityInstance == entityInstance);
+            };
+        } else if (tokens.size() == 2 && tokens[0] == "TYPE") {
+            uint8_t sensorType = std::stoi(tokens[1]) & 0xFF;
+            match = [sensorType](const SdrCatalog::Sensor& sensor) {
+                return (sensor.sensorType == sensorType);
+            };
+        } else {
+            throw Provider::syntax_error("Invalid sensors selector '" + selector + "'");
+        }
+    } catch (std::invalid_argument) {
+        throw Provider::syntax_error("Invalid sensors selector '" + selector + "'");
+    }
+
+    SensorSet set;
+    set.time = epicsTime::getCurrent();
+    std::vector<std::string> addresses;
+    {
+        common::ScopedLock lock(m_apiMutex);
+        reconnectIfDue();
+        for (auto& sensor: m_sdrCatalog.sensors) {
+            if (!match(sensor))
+                continue;
+            std::string name;
+            try {
+                name = getSensorName(m_ctx.sdr, sensor.record);
+            } catch (std::runtime_error&) {
+                name = sensor.address.get();
+            }
+            auto it = m_sdrCatalog.fruNames.find(std::make_pair(sensor.entityId, sensor.entityInstance));
+            if (it != m_sdrCatalog.fruNames.end())
+                name = it->second + ":" + name;
+            addresses.push_back(sensor.address.get());
+            set.names.push_back(name);
+        }
+    }
+
+    // Don't wait for every sensor of IPMB target that stopped responding
+    std::set<std::string> failed;
+    for (auto& address: addresses) {
+        double value = NAN;
+        int sevr = epicsSevInvalid;
+
+        common::ScopedLock lock(m_apiMutex);
+        auto it = m_sdrCatalog.sensorIndex.find(address);
+        if (m_connected && it != m_sdrCatalog.sensorIndex.end()) {
+            auto& sensor = m_sdrCatalog.sensors[it->second];
+            auto target = sensor.address.route.get() + std::to_string(sensor.address.ownerId) + ":" + std::to_string(sensor.address.channel);
+            if (failed.find(target) == failed.end()) {
+                try {
+                    checkPresent(m_sdrCatalog, sensor.address);
+                    auto entity = getSensor(m_ctx.ipmi, m_ctx.sdr, m_ctx.sensors, sensor);
+                    sevr = entity.getField<int>("SEVR", epicsSevNone);
+                    if (sevr != epicsSevInvalid)
+                        value = entity.getNumber("VAL", NAN);
+                } catch (Provider::absent_error&) {
+                    // Removed module, value stays invalid
+                } catch (Provider::comm_error& e) {
+                    if (disconnectOnTimeout(m_ctx.ipmi))
+                        throw;
+                    LOG_DEBUG(e.what());
+                    failed.insert(target);
+                } catch (std::runtime_error& e) {
+                    LOG_DEBUG(e.what());
+                }
+            }
+        }
+        set.values.push_back(value);
+        set.severities.push_back(sevr);
+    }
+    return set;
+}
+
 std::string FreeIpmiProvider::getSensorName(ipmi_sdr_ctx_t sdr, const SdrRecord& record)
 {
     uint8_t sensorNum;
@@ -243,13 +709,54 @@ std::string FreeIpmiProvider::getSensorUnits(ipmi_sdr_ctx_t sdr, const SdrRecord
  * ===== SensorAddress implementation =====
  *
  * EPICS record link specification for SENSOR entities
- * @ipmi <conn> SENSOR <owner>:<LUN>:<channel>:<sensor num>
+ * @ipmi <conn> SENSOR [<transit addr>:<transit channel>/]<owner>:<LUN>:<channel>:<sensor num> [<field>]
+ * @ipmi <conn> SENSOR <site>:<LUN>:<sensor num> [<field>]
  * Example:
  * @ipmi IPMI1 SENSOR 22:0:1:97
+ * @ipmi IPMI1 SENSOR 130:0/57:0:7:3
+ * @ipmi IPMI1 SENSOR slot4:0:97
+ * @ipmi IPMI1 SENSOR 22:0:1:97 HIHI
+ *
+ * @ipmi IPMI1 SENSOR 22:0:2:12 MASK
+ * @ipmi IPMI1 SENSOR 22:0:2:12 BIT3
+ * @ipmi IPMI1 SENSOR 22:0:1:97 UNC
+ *
+ * Optional field is one of RVAL, LOW, LOLO, HIGH, HIHI, SEVR, STAT, MASK
+ * or BIT0 to BIT14. MASK is the event mask of discrete sensors, BITn a single
+ * state bit of it. Records of the same sensor are served from the same read.
+ * LNC, LC, LNR, UNC, UC and UNR are thresholds as currently set in the
+ * controller, records with OUT link write them.
  */
 FreeIpmiProvider::SensorAddress::SensorAddress(const std::string& address)
 {
-    auto tokens = common::split(address, ':');
+    static const std::vector<std::string> fields = { "VAL", "RVAL", "LOW", "LOLO", "HIGH", "HIHI", "SEVR", "STAT", "MASK",
+                                                     "LNC", "LC", "LNR", "UNC", "UC", "UNR" };
+
+    auto isBit = [](const std::string& name) {
+        if (name.size() < 4 || name.size() > 5 || name.compare(0, 3, "BIT") != 0 ||
+            !std::all_of(name.begin() + 3, name.end(), ::isdigit))
+            return false;
+        return (std::stoi(name.substr(3)) < 15);
+    };
+
+    auto sections = common::split(route.parse(address), ' ');
+    if (sections.size() == 2) {
+        if (std::find(fields.begin(), fields.end(), sections[1]) == fields.end() && !isBit(sections[1]))
+            throw Provider::syntax_error("Invalid sensor field '" + sections[1] + "'");
+        if (sections[1] != "VAL")
+            field = sections[1];
+    } else if (sections.size() != 1) {
+        throw Provider::syntax_error("Invalid sensor address");
+    }
+
+    auto tokens = common::split(sections[0], ':');
+    // Site replaces owner and channel, they're resolved through topology
+    if (!tokens.empty() && !tokens[0].empty() && std::isalpha(tokens[0][0])) {
+        if (tokens.size() != 3 || route.isTransit())
+            throw Provider::syntax_error("Invalid sensor address");
+        site = tokens[0];
+        tokens = { "0", tokens[1], "0", tokens[2] };
+    }
     if (tokens.size() != 4)
         throw Provider::syntax_error("Invalid sensor address");
 
@@ -279,11 +786,19 @@ FreeIpmiProvider::SensorAddress::SensorAddress(ipmi_sdr_ctx_t sdr, const SdrReco
 
 std::string FreeIpmiProvider::SensorAddress::get() const
 {
-    return std::to_string(ownerId) + ":" + std::to_string(ownerLun) + ":" + std::to_string(channel) + ":" + std::to_string(sensorNum);
+    return route.get() + std::to_string(ownerId) + ":" + std::to_string(ownerLun) + ":" + std::to_string(channel) + ":" + std::to_string(sensorNum);
+}
+
+int FreeIpmiProvider::SensorAddress::getThreshold() const
+{
+    auto it = std::find(THRESHOLD_FIELDS.begin(), THRESHOLD_FIELDS.end(), field);
+    return (it != THRESHOLD_FIELDS.end() ? it - THRESHOLD_FIELDS.begin() : -1);
 }
 
 bool FreeIpmiProvider::SensorAddress::compare(const FreeIpmiProvider::SensorAddress& other)
 {
+    if (!(other.route == route))
+        return false;
     if (other.ownerId != ownerId)
         return false;
     if (other.ownerLun != ownerLun)
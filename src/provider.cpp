@@ -14,8 +14,13 @@
 #include <alarm.h>
 #include <epicsThread.h>
 
+#include <algorithm>
+#include <cctype>
+#include <cmath>
 #include <limits>
 
+static const double POLL_TOLERANCE = 0.001;    //!< Seconds within which polls are considered due together
+
 extern "C" {
     static void providerThread(void* ctx)
     {
@@ -35,8 +40,7 @@ Provider::~Provider()
 
 bool Provider::stopThread(double timeout)
 {
-    if (m_tasks.processing) {
-        m_tasks.processing = false;
+    if (m_tasks.processing.exchange(false)) {
         m_tasks.event.signal();
 
         if (timeout > 0)
@@ -47,46 +51,631 @@ bool Provider::stopThread(double timeout)
     return true;
 }
 
+double Provider::parseNonNegative(const std::string& name, const std::string& value)
+{
+    double number;
+    try {
+        number = std::stod(value);
+    } catch (...) {
+        throw syntax_error("Invalid value '" + value + "' for option " + name);
+    }
+    if (number < 0.0)
+        throw syntax_error("Option " + name + " must not be negative");
+    return number;
+}
+
+int Provider::parseInteger(const std::string& name, const std::string& value, int min)
+{
+    int number;
+    try {
+        number = std::stoi(value);
+    } catch (...) {
+        throw syntax_error("Invalid value '" + value + "' for option " + name);
+    }
+    if (number < min)
+        throw syntax_error("Option " + name + " must be at least " + std::to_string(min));
+    return number;
+}
+
+void Provider::setOption(const std::string& name, const std::string& value)
+{
+    static const std::string cachePrefix = "cache_ttl_";
+    static const std::string pollPrefix = "poll_period_";
+    static const std::string pollMaxPrefix = "poll_max_period_";
+    std::string prefix;
+    if (name.size() > cachePrefix.size() && name.compare(0, cachePrefix.size(), cachePrefix) == 0)
+        prefix = cachePrefix;
+    else if (name.size() > pollPrefix.size() && name.compare(0, pollPrefix.size(), pollPrefix) == 0)
+        prefix = pollPrefix;
+    else if (name.size() > pollMaxPrefix.size() && name.compare(0, pollMaxPrefix.size(), pollMaxPrefix) == 0)
+        prefix = pollMaxPrefix;
+    else
+        throw syntax_error("Unsupported option '" + name + "'");
+
+    double seconds = parseNonNegative(name, value);
+
+    // Addresses are upper case, like 'SENSOR' or 'PICMG_LED'
+    auto kind = name.substr(prefix.size());
+    std::transform(kind.begin(), kind.end(), kind.begin(), ::toupper);
+
+    if (prefix == cachePrefix) {
+        m_cache.mutex.lock();
+        m_cache.ttls[kind] = seconds;
+        m_cache.mutex.unlock();
+    } else {
+        m_tasks.mutex.lock();
+        (prefix == pollPrefix ? m_polls.periods : m_polls.maxPeriods)[kind] = seconds;
+        m_tasks.mutex.unlock();
+    }
+}
+
+void Provider::invalidateCache()
+{
+    m_cache.mutex.lock();
+    m_cache.entities.clear();
+    m_cache.mutex.unlock();
+}
+
+double Provider::getCacheTtl(const std::string& address)
+{
+    auto it = m_cache.ttls.find(address.substr(0, address.find(' ')));
+    return (it != m_cache.ttls.end() ? it->second : 0.0);
+}
+
+bool Provider::getCached(const std::string& address, Entity& entity)
+{
+    m_cache.mutex.lock();
+    double ttl = getCacheTtl(address);
+    if (ttl <= 0.0) {
+        m_cache.mutex.unlock();
+        return false;
+    }
+
+    auto it = m_cache.entities.find(address);
+    if (it == m_cache.entities.end() || (epicsTime::getCurrent() - epicsTime(it->second.time)) > ttl) {
+        m_cache.misses++;
+        m_cache.mutex.unlock();
+        return false;
+    }
+    for (auto& kv: it->second) {
+        entity[kv.first] = kv.second;
+    }
+    entity.time = it->second.time;
+    m_cache.hits++;
+    m_cache.mutex.unlock();
+    return true;
+}
+
+void Provider::storeCached(const std::vector<std::string>& addresses, const std::vector<Entity>& entities)
+{
+    m_cache.mutex.lock();
+    for (size_t i = 0; i < addresses.size() && i < entities.size(); i++) {
+        // Failures are retried on next process rather than served for ttl
+        if (getCacheTtl(addresses[i]) > 0.0 && entities[i].getField<int>("SEVR", 0) != epicsSevInvalid)
+            m_cache.entities[addresses[i]] = entities[i];
+    }
+    m_cache.mutex.unlock();
+}
+
+void Provider::cacheEntities(const std::vector<Entity>& entities)
+{
+    epicsTimeStamp now = epicsTime::getCurrent();
+    std::vector<std::string> addresses;
+    std::vector<Entity> stamped;
+    for (auto& entity: entities) {
+        auto inp = entity.getField<std::string>("INP", "");
+        if (inp.empty())
+            continue;
+        addresses.push_back(inp);
+        stamped.push_back(entity);
+        if (stamped.back().time.secPastEpoch == 0)
+            stamped.back().time = now;
+    }
+    storeCached(addresses, stamped);
+}
+
+/*
+ * Address is '<kind> <target> [<field>]', writing to any field can change
+ * the others, like sensor thresholds being rounded or LED state.
+ */
+void Provider::dropCached(const std::vector<std::string>& addresses)
+{
+    m_cache.mutex.lock();
+    for (auto& address: addresses) {
+        auto target = address.substr(0, address.find(' ', address.find(' ') + 1));
+        auto it = m_cache.entities.lower_bound(target);
+        while (it != m_cache.entities.end() && it->first.compare(0, target.size(), target) == 0) {
+            if (it->first.size() == target.size() || it->first[target.size()] == ' ')
+                it = m_cache.entities.erase(it);
+            else
+                ++it;
+        }
+    }
+    m_cache.mutex.unlock();
+}
+
+/*
+ * Records scanned periodically all process at the same instant and flood
+ * the queue, leaving the device idle for the rest of the period. Polls are
+ * given phases from the golden ratio sequence instead, which spreads any
+ * number of them evenly over the period. Each address has its own poll,
+ * addresses of the same group share the phase so that their notifications
+ * still coincide and are read together.
+ */
+void Provider::subscribe(const std::string& address, const std::function<void()>& cb, double period)
+{
+    auto group = getGroup(address);
+    auto phaseKey = (group.empty() ? address : group);
+
+    auto kind = address.substr(0, address.find(' '));
+
+    m_tasks.mutex.lock();
+    auto defaultPeriod = m_polls.periods.find(kind);
+    if (period <= 0.0 && defaultPeriod != m_polls.periods.end())
+        period = defaultPeriod->second;
+    if (period <= 0.0) {
+        m_tasks.mutex.unlock();
+        throw syntax_error("Change notifications not supported for '" + address + "', set poll_period option or POLL= in link");
+    }
+
+    auto now = epicsTime::getCurrent();
+    auto origin = m_polls.origins.find(phaseKey);
+    if (origin == m_polls.origins.end()) {
+        double phase = std::fmod(m_polls.count++ * 0.6180339887498949, 1.0);
+        origin = m_polls.origins.emplace(phaseKey, now + phase * period).first;
+    }
+
+    auto key = std::make_pair(address, period);
+    auto it = m_polls.polls.find(key);
+    if (it == m_polls.polls.end()) {
+        auto maxPeriod = m_polls.maxPeriods.find(kind);
+        auto& poll = m_polls.polls[key];
+        poll.period = period;
+        poll.minPeriod = period;
+        // Longer periods are whole multiples of shorter ones so group members stay aligned
+        poll.maxPeriod = period;
+        if (maxPeriod != m_polls.maxPeriods.end()) {
+            while (poll.maxPeriod * 2.0 <= maxPeriod->second)
+                poll.maxPeriod *= 2.0;
+        }
+        poll.origin = origin->second;
+        poll.next = getNextPoll(poll, now);
+        it = m_polls.polls.find(key);
+    }
+    it->second.callbacks.push_back(cb);
+    m_tasks.event.signal();
+    m_tasks.mutex.unlock();
+}
+
+epicsTime Provider::getNextPoll(const Poll& poll, const epicsTime& after)
+{
+    return poll.origin + (std::floor((after - poll.origin) / poll.period) + 1) * poll.period;
+}
+
+void Provider::pollIfDue()
+{
+    std::vector<std::function<void()>> callbacks;
+
+    m_tasks.mutex.lock();
+    auto now = epicsTime::getCurrent();
+    for (auto& kv: m_polls.polls) {
+        auto& poll = kv.second;
+        // Group members computed the same instant with different periods
+        if ((now - poll.next) < -POLL_TOLERANCE)
+            continue;
+        callbacks.insert(callbacks.end(), poll.callbacks.begin(), poll.callbacks.end());
+        // Skip missed periods rather than bursting to catch up, keep the phase
+        poll.next = getNextPoll(poll, now + POLL_TOLERANCE);
+    }
+    m_tasks.mutex.unlock();
+
+    for (auto& cb: callbacks)
+        cb();
+}
+
+/*
+ * Every address adapts on its own, a fast changing sensor doesn't drag its
+ * slow neighbours along. New period takes effect right away, not after
+ * the old one expires.
+ */
+void Provider::adaptPolls(const std::vector<std::string>& addresses, const std::vector<Entity>& entities)
+{
+    m_tasks.mutex.lock();
+    auto now = epicsTime::getCurrent();
+    for (size_t i = 0; i < addresses.size() && i < entities.size(); i++) {
+        for (auto it = m_polls.polls.lower_bound(std::make_pair(addresses[i], 0.0));
+             it != m_polls.polls.end() && it->first.first == addresses[i]; ++it) {
+            auto& poll = it->second;
+            if (poll.maxPeriod <= poll.minPeriod)
+                continue;
+
+            double period = poll.period;
+            adaptPeriod(poll, entities[i]);
+            if (poll.period != period)
+                poll.next = getNextPoll(poll, now);
+        }
+    }
+    m_tasks.mutex.unlock();
+}
+
+/*
+ * Noise is the average change between reads, trend is the average change
+ * per second. Changes within 3x noise are considered steady and double
+ * the period, bigger ones halve it. Period snaps to the shortest when
+ * value is within noise of a threshold, or when trend would take it there
+ * within two periods. Addresses that never gave a number have nothing to
+ * adapt to and stay at the longest period.
+ */
+void Provider::adaptPeriod(Poll& poll, const Entity& entity)
+{
+    auto& volatility = poll.volatility;
+
+    double value = entity.getNumber("VAL", std::numeric_limits<double>::quiet_NaN());
+    if (std::isnan(value) || entity.getField<int>("SEVR", 0) == epicsSevInvalid) {
+        if (!volatility.valid)
+            poll.period = poll.maxPeriod;
+        return;
+    }
+
+    epicsTime time(entity.time);
+    if (!volatility.valid) {
+        volatility.valid = true;
+        volatility.value = value;
+        volatility.time = time;
+        poll.period = poll.minPeriod;
+        return;
+    }
+
+    // Same snapshot read again for another record
+    double dt = time - volatility.time;
+    if (dt <= 0.0)
+        return;
+
+    double dv = value - volatility.value;
+    bool steady = (std::fabs(dv) <= 3.0 * volatility.noise);
+    volatility.noise += 0.25 * (std::fabs(dv) - volatility.noise);
+    volatility.trend += 0.25 * (dv / dt - volatility.trend);
+    volatility.value = value;
+    volatility.time = time;
+
+    double distance = std::numeric_limits<double>::infinity();
+    for (auto& field: { "LOLO", "LOW", "HIGH", "HIHI" }) {
+        double threshold = entity.getNumber(field, std::numeric_limits<double>::quiet_NaN());
+        if (!std::isnan(threshold))
+            distance = std::min(distance, std::fabs(value - threshold));
+    }
+
+    if (distance <= 3.0 * volatility.noise + 2.0 * std::fabs(volatility.trend) * poll.period)
+        poll.period = poll.minPeriod;
+    else if (steady)
+        poll.period = std::min(poll.maxPeriod, poll.period * 2.0);
+    else
+        poll.period = std::max(poll.minPeriod, poll.period / 2.0);
+}
+
+Provider::Entity Provider::setEntity(const std::string& address, const Variant& /*value*/)
+{
+    throw syntax_error("Writing not supported for '" + address + "'");
+}
+
+double Provider::getHousekeepingPeriod()
+{
+    m_tasks.mutex.lock();
+    double period = m_tasks.housekeepingPeriod;
+    m_tasks.mutex.unlock();
+    return period;
+}
+
+void Provider::setWriteDelay(double delay)
+{
+    m_tasks.mutex.lock();
+    m_tasks.writeDelay = delay;
+    m_tasks.event.signal();
+    m_tasks.mutex.unlock();
+}
+
+void Provider::setHousekeepingPeriod(double period)
+{
+    m_tasks.mutex.lock();
+    m_tasks.housekeepingPeriod = period;
+    m_tasks.nextHousekeeping = epicsTime::getCurrent() + period;
+    m_tasks.event.signal();
+    m_tasks.mutex.unlock();
+}
+
 bool Provider::schedule(const Task&& task)
 {
+    bool urgent = (task.write && !canMergeWrite(task.address));
+
     m_tasks.mutex.lock();
-    m_tasks.queue.emplace_back(task);
+    auto& queue = (task.write ? m_tasks.writes : m_tasks.queue);
+    queue.emplace_back(task);
+    queue.back().queued = epicsTime::getCurrent();
+    m_tasks.urgentWrite |= urgent;
     m_tasks.event.signal();
     m_tasks.mutex.unlock();
     return true;
 }
 
+void Provider::collectEntity(Entity& entity, const std::function<Entity()>& get)
+{
+    try {
+        auto tmp = get();
+        for (auto& kv: tmp) {
+            entity[kv.first] = std::move(kv.second);
+        }
+        if (tmp.time.secPastEpoch != 0)
+            entity.time = tmp.time;
+    } catch (absent_error& e) {
+        entity["SEVR"] = (int)epicsSevInvalid;
+        entity["STAT"] = (int)epicsAlarmDisable;
+        LOG_DEBUG(e.what());
+    } catch (std::runtime_error& e) {
+        entity["SEVR"] = (int)epicsSevInvalid;
+        entity["STAT"] = (int)epicsAlarmComm;
+        LOG_ERROR(e.what());
+    } catch (...) {
+        entity["SEVR"] = (int)epicsSevInvalid;
+        entity["STAT"] = (int)epicsAlarmComm;
+        LOG_ERROR("Unhandled exception getting IPMI entity");
+    }
+}
+
+std::vector<Provider::Entity> Provider::getEntities(const std::vector<std::string>& addresses)
+{
+    std::vector<Entity> entities(addresses.size());
+    for (size_t i = 0; i < addresses.size(); i++) {
+        collectEntity(entities[i], [&]() { return getEntity(addresses[i]); });
+    }
+    return entities;
+}
+
+std::vector<Provider::Entity> Provider::setEntities(const std::vector<std::string>& addresses, const std::vector<Variant>& values)
+{
+    std::vector<Entity> entities(addresses.size());
+    for (size_t i = 0; i < addresses.size(); i++) {
+        collectEntity(entities[i], [&]() { return setEntity(addresses[i], values[i]); });
+    }
+    return entities;
+}
+
+void Provider::housekeepingIfDue()
+{
+    m_tasks.mutex.lock();
+    double period = m_tasks.housekeepingPeriod;
+    if (period <= 0.0 || (m_tasks.nextHousekeeping - epicsTime::getCurrent()) > 0.0) {
+        m_tasks.mutex.unlock();
+        return;
+    }
+    m_tasks.nextHousekeeping = epicsTime::getCurrent() + period;
+    m_tasks.mutex.unlock();
+
+    try {
+        housekeeping();
+    } catch (std::runtime_error& e) {
+        LOG_ERROR(e.what());
+    } catch (...) {
+        LOG_ERROR("Unhandled exception in housekeeping");
+    }
+}
+
+/*
+ * Writes have their own queue. Processing thread checks it in between
+ * groups of reads, so a write waits for at most one group of reads. Writes
+ * that came in within write delay from the first one are handed over
+ * together, for provider to merge the ones that go to the same target.
+ * Writes that can't be merged take everything queued so far right away.
+ */
+void Provider::processWritesIfDue()
+{
+    m_tasks.mutex.lock();
+    if (m_tasks.writes.empty() ||
+        (!m_tasks.urgentWrite && (m_tasks.writes.front().queued + m_tasks.writeDelay - epicsTime::getCurrent()) > 0.0)) {
+        m_tasks.mutex.unlock();
+        return;
+    }
+    std::list<Task> writes;
+    writes.splice(writes.end(), m_tasks.writes);
+    m_tasks.urgentWrite = false;
+    m_tasks.mutex.unlock();
+
+    std::vector<Task*> tasks;
+    std::vector<std::string> addresses;
+    std::vector<Variant> values;
+    for (auto& task: writes) {
+        tasks.push_back(&task);
+        addresses.push_back(task.address);
+        values.push_back(task.value);
+    }
+
+    auto started = epicsTime::getCurrent();
+    auto entities = setEntities(addresses, values);
+    epicsTimeStamp acquired = epicsTime::getCurrent();
+    dropCached(addresses);
+
+    for (size_t i = 0; i < tasks.size() && i < entities.size(); i++) {
+        for (auto& kv: entities[i]) {
+            tasks[i]->entity[kv.first] = kv.second;
+        }
+        tasks[i]->entity.time = (entities[i].time.secPastEpoch != 0 ? entities[i].time : acquired);
+    }
+    accountTasks(tasks, started, true);
+    for (auto task: tasks)
+        task->callback();
+}
+
+void Provider::accountTasks(const std::vector<Task*>& tasks, const epicsTime& started, bool write)
+{
+    double sum = 0.0;
+    double max = 0.0;
+    for (auto task: tasks) {
+        double delay = started - task->queued;
+        sum += delay;
+        max = std::max(max, delay);
+    }
+
+    m_tasks.mutex.lock();
+    (write ? m_stats.writes : m_stats.reads) += tasks.size();
+    m_stats.queueDelay += sum;
+    m_stats.queueDelayMax = std::max(m_stats.queueDelayMax, max);
+    m_tasks.mutex.unlock();
+}
+
+std::map<std::string, double> Provider::getStats()
+{
+    std::map<std::string, double> stats;
+    m_tasks.mutex.lock();
+    unsigned long tasks = m_stats.reads + m_stats.writes;
+    stats["reads"] = m_stats.reads;
+    stats["writes"] = m_stats.writes;
+    stats["queue_delay_avg"] = (tasks > 0 ? m_stats.queueDelay / tasks : 0.0);
+    stats["queue_delay_max"] = m_stats.queueDelayMax;
+    stats["queue_depth"] = m_tasks.queue.size() + m_tasks.writes.size();
+
+    // Every notification reads the entity once, compared to polling at the shortest period
+    double pollReads = 0.0;
+    double fixedReads = 0.0;
+    for (auto& kv: m_polls.polls) {
+        pollReads += kv.second.callbacks.size() / kv.second.period;
+        fixedReads += kv.second.callbacks.size() / kv.second.minPeriod;
+    }
+    stats["poll_reads_per_sec"] = pollReads;
+    stats["poll_reads_saved_per_sec"] = fixedReads - pollReads;
+    m_tasks.mutex.unlock();
+
+    m_cache.mutex.lock();
+    stats["cache_hits"] = m_cache.hits;
+    stats["cache_misses"] = m_cache.misses;
+    stats["cache_entries"] = m_cache.entities.size();
+    m_cache.mutex.unlock();
+    return stats;
+}
+
+void Provider::resetStats()
+{
+    m_tasks.mutex.lock();
+    m_stats.reads = 0;
+    m_stats.writes = 0;
+    m_stats.queueDelay = 0.0;
+    m_stats.queueDelayMax = 0.0;
+    m_tasks.mutex.unlock();
+
+    m_cache.mutex.lock();
+    m_cache.hits = 0;
+    m_cache.misses = 0;
+    m_cache.mutex.unlock();
+}
+
+/*
+ * Records scanned together land in the queue together. Tasks whose entities
+ * share a group, like sensors of one board, are read back to back and their
+ * records are completed together, in the order the group was first seen.
+ * Tasks with the same address are served from a single read.
+ */
+void Provider::processTasks(std::list<Task>& tasks)
+{
+    std::vector<std::vector<Task*>> groups;
+    std::map<std::string, size_t> groupIndex;
+    std::map<std::string, size_t> addressIndex;
+    for (auto& task: tasks) {
+        auto group = getGroup(task.address);
+        auto& index = (group.empty() ? addressIndex : groupIndex);
+        auto it = index.find(group.empty() ? task.address : group);
+        if (it == index.end()) {
+            index[group.empty() ? task.address : group] = groups.size();
+            groups.push_back({ &task });
+        } else {
+            groups[it->second].push_back(&task);
+        }
+    }
+
+    for (auto& group: groups) {
+        std::vector<std::string> addresses;
+        std::vector<size_t> slots;      // Index into addresses for each task
+        std::map<std::string, size_t> unique;
+        for (auto task: group) {
+            auto it = unique.emplace(task->address, addresses.size());
+            if (it.second)
+                addresses.push_back(task->address);
+            slots.push_back(it.first->second);
+        }
+
+        auto started = epicsTime::getCurrent();
+        std::vector<Entity> entities;
+        if (addresses.size() == 1) {
+            entities.resize(1);
+            collectEntity(entities[0], [&]() { return getEntity(addresses[0]); });
+        } else {
+            entities = getEntities(addresses);
+        }
+        // Group is one snapshot, unless provider knows better when it was taken
+        epicsTimeStamp acquired = epicsTime::getCurrent();
+        for (auto& entity: entities) {
+            if (entity.time.secPastEpoch == 0)
+                entity.time = acquired;
+        }
+        storeCached(addresses, entities);
+        adaptPolls(addresses, entities);
+
+        for (size_t i = 0; i < group.size(); i++) {
+            if (slots[i] >= entities.size())
+                continue;
+            auto& entity = entities[slots[i]];
+            for (auto& kv: entity) {
+                group[i]->entity[kv.first] = kv.second;
+            }
+            group[i]->entity.time = entity.time;
+        }
+        accountTasks(group, started, false);
+        for (auto task: group)
+            task->callback();
+
+        // Don't hold back hot-swap detection, writes and polls for the whole batch
+        housekeepingIfDue();
+        processWritesIfDue();
+        pollIfDue();
+    }
+}
+
 void Provider::tasksThread()
 {
     while (m_tasks.processing) {
-        m_tasks.mutex.lock();
+        housekeepingIfDue();
+        processWritesIfDue();
+        pollIfDue();
 
+        m_tasks.mutex.lock();
         if (m_tasks.queue.empty()) {
+            auto now = epicsTime::getCurrent();
+            bool timed = false;
+            double timeout = 0.0;
+            if (m_tasks.housekeepingPeriod > 0.0) {
+                timeout = m_tasks.nextHousekeeping - now;
+                timed = true;
+            }
+            if (!m_tasks.writes.empty()) {
+                double delay = (m_tasks.urgentWrite ? 0.0 : m_tasks.writes.front().queued + m_tasks.writeDelay - now);
+                timeout = (timed ? std::min(timeout, delay) : delay);
+                timed = true;
+            }
+            for (auto& kv: m_polls.polls) {
+                double delay = kv.second.next - now;
+                timeout = (timed ? std::min(timeout, delay) : delay);
+                timed = true;
+            }
             m_tasks.mutex.unlock();
-            m_tasks.event.wait();
+            if (timed)
+                m_tasks.event.wait(timeout);
+            else
+                m_tasks.event.wait();
             continue;
         }
 
-        Task task = std::move(m_tasks.queue.front());
-        m_tasks.queue.pop_front();
+        std::list<Task> tasks;
+        tasks.splice(tasks.end(), m_tasks.queue);
         m_tasks.mutex.unlock();
 
-        try {
-            auto entity = getEntity(task.address);
-            for (auto& kv: entity) {
-                task.entity[kv.first] = std::move(kv.second);
-            }
-        } catch (std::runtime_error& e) {
-            task.entity["SEVR"] = (int)epicsSevInvalid;
-            task.entity["STAT"] = (int)epicsAlarmComm;
-            LOG_ERROR(e.what());
-        } catch (...) {
-            task.entity["SEVR"] = (int)epicsSevInvalid;
-            task.entity["STAT"] = (int)epicsAlarmComm;
-            LOG_ERROR("Unhandled exception getting IPMI entity");
-        }
-
-        task.callback();
+        processTasks(tasks);
     }
 
     m_tasks.stopped.signal();
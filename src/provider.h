@@ -12,7 +12,10 @@
 
 #include <epicsEvent.h>
 #include <epicsMutex.h>
+#include <epicsTime.h>
 
+#include <atomic>
+#include <functional>
 #include <string>
 #include <list>
 #include <map>
@@ -80,9 +83,11 @@ namespace std
  */
 class Provider {
     public:
-        typedef std::variant<int,double,std::string> Variant;           //!< Generic container for entity fields
+        typedef std::variant<int,double,std::string,std::vector<double>,std::vector<std::string>> Variant;  //!< Generic container for entity fields
         class Entity : public std::map<std::string, Variant> {
             public:
+                epicsTimeStamp time{0, 0};  //!< When entity was acquired from device, zero when unknown
+
                 template <typename T>
                 T getField(const std::string& field, const T& default_) const
                 {
@@ -94,16 +99,49 @@ class Provider {
                     }
                     return default_;
                 }
+
+                /**
+                 * @brief Get numeric field as double, integer fields are converted.
+                 */
+                double getNumber(const std::string& field, double default_) const
+                {
+                    auto it = find(field);
+                    if (it != end()) {
+                        if (auto ptr = std::get_if<double>(&it->second))
+                            return *ptr;
+                        if (auto ptr = std::get_if<int>(&it->second))
+                            return *ptr;
+                    }
+                    return default_;
+                }
         };
         struct Task {
             std::string address;
             std::function<void()> callback;
             Entity& entity;
+            bool write{false};      //!< Send value to entity instead of reading it
+            Variant value;          //!< New value when writing
+            epicsTime queued;       //!< When task was scheduled
             Task(const std::string& address_, const std::function<void()>& cb, Entity& entity_)
                 : address(address_)
                 , callback(cb)
                 , entity(entity_)
             {};
+            Task(const std::string& address_, const std::function<void()>& cb, Entity& entity_, const Variant& value_)
+                : address(address_)
+                , callback(cb)
+                , entity(entity_)
+                , write(true)
+                , value(value_)
+            {};
+        };
+
+        /**
+         * @brief Selects how much work scanning functions do.
+         */
+        enum class ScanMode {
+            FULL,       //!< Read current values of all entities
+            METADATA,   //!< Only describe entities, prefer cached data over talking to device
         };
 
         struct comm_error : public std::runtime_error {
@@ -115,6 +153,9 @@ class Provider {
         struct process_error : public std::runtime_error {
             using std::runtime_error::runtime_error;
         };
+        struct absent_error : public std::runtime_error {
+            using std::runtime_error::runtime_error;
+        };
 
         Provider(const std::string& conn_id);
 
@@ -122,21 +163,78 @@ class Provider {
 
         /**
          * @brief Scan for all sensors in the connected IPMI device.
+         * @param mode METADATA builds sensors from SDR only without reading their values
          * @return A list of sensors
          */
-        virtual std::vector<Entity> getSensors() = 0;
+        virtual std::vector<Entity> getSensors(ScanMode mode) = 0;
 
         /**
          * @brief Scans for all FRUs in the connected IPMI device.
+         * @param mode METADATA returns previously read FRUs when available
          * @return A list of FRUs
          */
-        virtual std::vector<Entity> getFrus() = 0;
+        virtual std::vector<Entity> getFrus(ScanMode mode) = 0;
 
         /**
          * @brief Scans for all PICMG LEDs in the connected IPMI device.
+         * @param mode METADATA uses cached LED properties and doesn't read LED states
          * @return A list of LEDs
          */
-        virtual std::vector<Entity> getPicmgLeds() = 0;
+        virtual std::vector<Entity> getPicmgLeds(ScanMode mode) = 0;
+
+        /**
+         * @brief Set implementation specific tunable option.
+         *
+         * Options cache_ttl_<kind> are common to all providers, they set
+         * seconds that values of entities with address starting with <kind>
+         * are served from cache, 0 disables caching and is the default.
+         * Options poll_period_<kind> set seconds between change notifications
+         * for entities that provider can't watch, 0 disables them. When
+         * poll_max_period_<kind> is longer, the period of each entity adapts
+         * to how fast its value changes, between the two. Adaptive periods
+         * are poll_period_<kind> times a power of 2.
+         *
+         * @param name of the option
+         * @param value new option value
+         * @exception syntax_error when option is not supported or value is invalid
+         */
+        virtual void setOption(const std::string& name, const std::string& value);
+
+        /**
+         * @brief Drop all cached data, it will be retrieved again when needed.
+         */
+        virtual void invalidateCache();
+
+        /**
+         * @brief Fill in entity from value cache when it was acquired recently enough.
+         * @param address IPMI entity address
+         * @param entity to be updated, its time is when value was acquired
+         * @return true when fresh value was found, false when entity must be scheduled
+         *
+         * Doesn't wait for processing thread, can be called from record processing.
+         */
+        bool getCached(const std::string& address, Entity& entity);
+
+        /**
+         * @brief Put entities read outside of tasks, like in a full scan, in the value cache.
+         * @param entities to be cached under their INP address
+         */
+        void cacheEntities(const std::vector<Entity>& entities);
+
+        /**
+         * @brief Register function to be called whenever entity value changes.
+         *
+         * Entities that provider doesn't watch are notified periodically,
+         * every period seconds or poll_period_<kind> when period is 0.
+         * Notifications are spread over the period, entities of the same
+         * group share the phase so they're notified together.
+         *
+         * @param address IPMI entity address
+         * @param cb function to be called, must not block
+         * @param period seconds between notifications, 0 uses poll_period_<kind> option
+         * @exception syntax_error when entity doesn't support change notifications
+         */
+        virtual void subscribe(const std::string& address, const std::function<void()>& cb, double period=0.0);
 
         /**
          * @brief Schedules retrieving IPMI value and calling cb function when done.
@@ -146,6 +244,17 @@ class Provider {
          */
         bool schedule(const Task&& task);
 
+        /**
+         * @brief Get processing statistics.
+         * @return values by name, derived providers may add their own
+         */
+        virtual std::map<std::string, double> getStats();
+
+        /**
+         * @brief Start collecting statistics anew.
+         */
+        virtual void resetStats();
+
         /**
          * @brief Thread processing enqueued tasks
          */
@@ -153,24 +262,208 @@ class Provider {
 
         /**
          * @brief Stop the processing thread, to be run from destructor.
+         *
+         * Processing thread calls virtual functions, derived class must
+         * stop it from its own destructor, before its members go away.
          * @param timeout in seconds to wait for thread, 0 means no timeout
          * @return true if thread successfully stopped in given time
          */
         bool stopThread(double timeout=0.0);
 
+    protected:
+        /**
+         * @brief Set how often processing thread invokes housekeeping().
+         * @param period in seconds, 0 disables housekeeping
+         */
+        void setHousekeepingPeriod(double period);
+
+        /**
+         * @brief Get period of housekeeping() invocations in seconds, 0 when disabled.
+         */
+        double getHousekeepingPeriod();
+
+        /**
+         * @brief Set how long writes wait in the queue for more writes to be merged with.
+         * @param delay in seconds, 0 processes writes as soon as possible
+         */
+        void setWriteDelay(double delay);
+
+        /**
+         * @brief Merge entity returned by get function into entity, exceptions are turned into SEVR and STAT fields.
+         */
+        static void collectEntity(Entity& entity, const std::function<Entity()>& get);
+
+        /**
+         * @brief Parse option value that must be a number not less than 0.
+         * @exception syntax_error when value is not a number or is negative
+         */
+        static double parseNonNegative(const std::string& name, const std::string& value);
+
+        /**
+         * @brief Parse option value that must be an integer not less than min.
+         * @exception syntax_error when value is not an integer or is less than min
+         */
+        static int parseInteger(const std::string& name, const std::string& value, int min);
+
     private:
         struct {
-            bool processing{true};
+            std::atomic<bool> processing{true};     //!< Cleared from other threads to stop processing
             std::list<Task> queue;
+            std::list<Task> writes;         //!< Writes never wait behind reads
+            bool urgentWrite{false};        //!< Queued write that must not wait for write delay
+            double writeDelay{0.01};
             epicsMutex mutex;
             epicsEvent event;
             epicsEvent stopped;
+            double housekeepingPeriod{0.0};
+            epicsTime nextHousekeeping;
         } m_tasks;
 
+        struct {
+            unsigned long reads{0};
+            unsigned long writes{0};
+            double queueDelay{0.0};         //!< Sum of times tasks waited in queue
+            double queueDelayMax{0.0};
+        } m_stats;                          //!< Protected by m_tasks.mutex
+
+        struct Volatility {
+            bool valid{false};              //!< Got at least one numeric value
+            double value{0.0};
+            epicsTime time;
+            double noise{0.0};              //!< Average absolute change between reads
+            double trend{0.0};              //!< Average change per second
+        };
+        struct Poll {
+            double period;                  //!< Current seconds between notifications
+            double minPeriod;
+            double maxPeriod;               //!< minPeriod times a power of 2, same as minPeriod when period is fixed
+            epicsTime origin;               //!< Notifications fall on origin plus whole periods, shared within group
+            epicsTime next;
+            std::vector<std::function<void()>> callbacks;
+            Volatility volatility;
+        };
+        struct {
+            std::map<std::string, double> periods;  //!< Seconds between notifications by first word of address
+            std::map<std::string, double> maxPeriods;   //!< Longest adaptive period by first word of address
+            std::map<std::pair<std::string, double>, Poll> polls;   //!< By address and shortest period
+            std::map<std::string, epicsTime> origins;   //!< Phase by group key, or address when not in a group
+            unsigned count{0};                      //!< Number of phases ever assigned, determines the next one
+        } m_polls;                          //!< Protected by m_tasks.mutex
+
+        /**
+         * @brief Invoke callbacks of polls whose time came.
+         */
+        void pollIfDue();
+
+        /**
+         * @brief First notification time of poll after given time, on its phase grid.
+         */
+        static epicsTime getNextPoll(const Poll& poll, const epicsTime& after);
+
+        /**
+         * @brief Adjust periods of adaptive polls from values just read.
+         * @param addresses of entities read
+         * @param entities in the same order as addresses, with acquisition time
+         */
+        void adaptPolls(const std::vector<std::string>& addresses, const std::vector<Entity>& entities);
+
+        /**
+         * @brief Update poll volatility with new value and determine period it needs.
+         */
+        static void adaptPeriod(Poll& poll, const Entity& entity);
+
+        struct {
+            epicsMutex mutex;
+            std::map<std::string, double> ttls;     //!< Max age in seconds by first word of address
+            std::map<std::string, Entity> entities; //!< Last good value by address
+            unsigned long hits{0};
+            unsigned long misses{0};
+        } m_cache;
+
+        /**
+         * @brief Get max age of cached value for address, 0 when not cached. Requires m_cache.mutex.
+         */
+        double getCacheTtl(const std::string& address);
+
+        /**
+         * @brief Cache good values of entities that have caching enabled.
+         * @param addresses of entities
+         * @param entities in the same order as addresses, with acquisition time
+         */
+        void storeCached(const std::vector<std::string>& addresses, const std::vector<Entity>& entities);
+
+        /**
+         * @brief Drop cached values of all entities of the target address was written to.
+         */
+        void dropCached(const std::vector<std::string>& addresses);
+
+        /**
+         * @brief Account time tasks spent in queue before provider started on them.
+         */
+        void accountTasks(const std::vector<Task*>& tasks, const epicsTime& started, bool write);
+
+        /**
+         * @brief Periodic maintenance invoked from processing thread in between tasks.
+         */
+        virtual void housekeeping() {};
+
+        /**
+         * @brief Invoke housekeeping() when its period elapsed.
+         */
+        void housekeepingIfDue();
+
+        /**
+         * @brief Process writes when the oldest one waited long enough to be merged with others.
+         */
+        void processWritesIfDue();
+
+        /**
+         * @brief Process tasks taken from queue all at once, tasks of the same group together.
+         */
+        void processTasks(std::list<Task>& tasks);
+
+        /**
+         * @brief Get key of a group of entities that are best read together.
+         * @param address IPMI entity address
+         * @return group key, empty when entity is read on its own
+         */
+        virtual std::string getGroup(const std::string& /*address*/) { return ""; };
+
+        /**
+         * @brief Retrieve current values of entities in the same group.
+         * @param addresses of entities sharing the group key
+         * @return entities in the same order as addresses, failures are reported in SEVR and STAT fields
+         */
+        virtual std::vector<Entity> getEntities(const std::vector<std::string>& addresses);
+
         /**
          * @brief Based on the address, determine IPMI entity type and retrieve its current value.
          * @param address FreeIPMI implementation specific address
          * @return current value
          */
         virtual Entity getEntity(const std::string& address) = 0;
+
+        /**
+         * @brief Based on the address, determine IPMI entity type and send it new value.
+         * @param address FreeIPMI implementation specific address
+         * @param value new value
+         * @return entity as read back after writing
+         * @exception syntax_error when entity can not be written
+         */
+        virtual Entity setEntity(const std::string& address, const Variant& value);
+
+        /**
+         * @brief Whether write to address may wait for other writes to be merged with.
+         *
+         * Called from the thread scheduling the task, must not block.
+         */
+        virtual bool canMergeWrite(const std::string& /*address*/) { return false; };
+
+        /**
+         * @brief Write all values pending at the same time, in the order they were scheduled.
+         * @param addresses of entities to write to, the same address may appear more than once
+         * @param values new values in the same order as addresses
+         * @return entities as read back, failures are reported in SEVR and STAT fields
+         */
+        virtual std::vector<Entity> setEntities(const std::vector<std::string>& addresses, const std::vector<Variant>& values);
 };